@@ -0,0 +1,510 @@
+'''
+Host side implementation of the Ctrl protocol (see docs/ctrl_protocol.md), to
+talk with the controller from scripts, and to evaluate protocol changes without
+hardware.
+
+It can be used as a library (import ctrl), or run as a benchmark:
+
+    python3 scripts/ctrl.py bench [--usb | --model] [--window N] [--profile N]
+
+The benchmark measures messages per second (status round-trips) and the time
+taken to sync the config and a full profile both ways. By default it runs
+against the firmware WebUSB layer (webusb.c and ctrl.c) built natively, with
+the USB endpoints and the config store faked (tests/build/libloopback.so,
+built with "make host_test"), so the results are expressed both in wall time
+and in device ticks. With --usb it runs against a real controller (requires
+pyusb). With --model it runs against LoopbackDevice, a hand-written model of
+the firmware rules that does not need a compiler, its numbers are only as good
+as the model.
+
+The constants below mirror src/headers/ctrl.h and src/headers/webusb.h, and
+must be kept in sync with them.
+'''
+
+import os
+import struct
+import sys
+import time
+from collections import deque
+
+# ctrl.h.
+MSG_SIZE = 64
+HEADER_SIZE = 4
+PAYLOAD_SIZE = MSG_SIZE - HEADER_SIZE
+SECTION_SIZE = 58
+FLAG_NONE = 1
+FLAG_WIRELESS = 2
+DEVICE_ALPAKKA = 1
+DEVICE_KAPYBARA = 2
+BULK_FIRST = 1
+BULK_LAST = 63
+BULK_WINDOW = 8
+BULK_OK = 1
+BULK_ERROR_CRC = 2
+BULK_ERROR_MISSING = 3
+
+# Message types.
+LOG = 1
+PROC = 2
+CONFIG_GET = 3
+CONFIG_SET = 4
+CONFIG_SHARE = 5
+SECTION_GET = 6
+SECTION_SET = 7
+SECTION_SHARE = 8
+STATUS_GET = 9
+STATUS_SET = 10
+STATUS_SHARE = 11
+PROFILE_OVERWRITE = 12
+PROFILE_GET = 13
+PROFILE_SET = 14
+PROFILE_SHARE = 15
+PROFILE_ACK = 16
+PROFILE_END = 17
+LOG_BINARY = 18
+TELEMETRY_SET = 19
+TELEMETRY_FRAME = 20
+LINK_GET = 21
+LINK_SHARE = 22
+
+# Config indexes.
+CONFIG_KEYS = range(1, 11)  # PROTOCOL to THUMBSTICK_SMOOTH_SAMPLES.
+
+# webusb.h.
+RX_RING_SIZE = 8
+RX_BUDGET = 4
+TX_BATCH = 4
+
+# USB.
+VENDORS = [0x0170, 0x045E]
+INTERFACE = 1  # ITF_WEBUSB.
+ADDR_IN = 0x83
+ADDR_OUT = 0x04
+
+
+def crc16(data, crc=0xFFFF):
+    # CRC-16/CCITT-FALSE, same as crc16() in common.c.
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if (crc & 0x8000) else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+def profile_crc(sections):
+    # Sections is a list of 64 sections (58 bytes each), as ctrl_profile_crc().
+    return crc16(b''.join(sections[BULK_FIRST:BULK_LAST+1]))
+
+
+class Ctrl:
+    def __init__(self, message_type, payload=b'', flags=FLAG_NONE, device=DEVICE_ALPAKKA):
+        self.flags = flags
+        self.device = device
+        self.message_type = message_type
+        self.payload = bytes(payload)
+
+    def encode(self):
+        header = bytes([self.flags, self.device, self.message_type, len(self.payload)])
+        return (header + self.payload).ljust(MSG_SIZE, b'\0')
+
+    @staticmethod
+    def decode(data):
+        size = min(data[3], PAYLOAD_SIZE)
+        return Ctrl(data[2], data[HEADER_SIZE:HEADER_SIZE+size], data[0], data[1])
+
+    def __repr__(self):
+        return f'Ctrl(type={self.message_type}, len={len(self.payload)})'
+
+
+# Encoders (app to controller).
+
+def proc(index):
+    return Ctrl(PROC, [index])
+
+def status_get():
+    return Ctrl(STATUS_GET)
+
+def config_get(key):
+    return Ctrl(CONFIG_GET, [key])
+
+def config_set(key, preset, values=(0, 0, 0, 0, 0)):
+    return Ctrl(CONFIG_SET, [key, preset, *values])
+
+def section_get(profile, section):
+    return Ctrl(SECTION_GET, [profile, section])
+
+def section_set(profile, section, data):
+    return Ctrl(SECTION_SET, bytes([profile, section]) + bytes(data).ljust(SECTION_SIZE, b'\0'))
+
+def profile_overwrite(index_to, index_from):
+    return Ctrl(PROFILE_OVERWRITE, struct.pack('<Bb', index_to, index_from))
+
+def profile_get(profile, window=0, first=0):
+    return Ctrl(PROFILE_GET, [profile, window, first])
+
+def profile_set(profile, section, data):
+    message = section_set(profile, section, data)
+    message.message_type = PROFILE_SET
+    return message
+
+def profile_set_start(profile, window=0):
+    # Section zero starts a transfer, carrying the window of the sender.
+    return profile_set(profile, 0, [window])
+
+def profile_ack(profile, section):
+    return Ctrl(PROFILE_ACK, [profile, section])
+
+def profile_end(profile, crc, status=BULK_OK):
+    count = BULK_LAST - BULK_FIRST + 1
+    return Ctrl(PROFILE_END, struct.pack('<BBHB', profile, count, crc, status))
+
+def telemetry_set(channels, divider=1):
+    return Ctrl(TELEMETRY_SET, [channels, divider])
+
+def link_get():
+    return Ctrl(LINK_GET)
+
+
+# Decoders (controller to app).
+
+def decode_status_share(ctrl):
+    major, mid, minor, nvm_bytes, tx_dropped = struct.unpack_from('<BBBII', ctrl.payload.ljust(11, b'\0'))
+    return {'version': (major, mid, minor), 'nvm_bytes': nvm_bytes, 'tx_dropped': tx_dropped}
+
+def decode_config_share(ctrl):
+    return {'key': ctrl.payload[0], 'preset': ctrl.payload[1], 'values': list(ctrl.payload[2:7])}
+
+def decode_section_share(ctrl):
+    # Also PROFILE_SHARE.
+    return {'profile': ctrl.payload[0], 'section': ctrl.payload[1], 'data': ctrl.payload[2:60]}
+
+def decode_profile_ack(ctrl):
+    return {'profile': ctrl.payload[0], 'section': ctrl.payload[1]}
+
+def decode_profile_end(ctrl):
+    profile, count, crc, status = struct.unpack_from('<BBHB', ctrl.payload)
+    return {'profile': profile, 'count': count, 'crc': crc, 'status': status}
+
+def decode_telemetry_frame(ctrl):
+    seq, timestamp, channels, dropped = struct.unpack_from('<HIBH', ctrl.payload)
+    return {'seq': seq, 'timestamp': timestamp, 'channels': channels, 'dropped': dropped, 'data': ctrl.payload[9:]}
+
+LINK_STATS = [
+    'srtt', 'rttvar', 'rto', 'tracked', 'acked', 'retransmits', 'failed',
+    'tx_frames', 'tx_dropped', 'rx_frames', 'rx_corrupted', 'rx_lost',
+    'version',
+]
+
+def decode_link_share(ctrl):
+    values = struct.unpack_from('<13I', ctrl.payload.ljust(52, b'\0'))
+    return dict(zip(LINK_STATS, values))
+
+
+# Transports, both exchange encoded 64 bytes messages.
+
+class UsbTransport:
+    def __init__(self):
+        import usb.core
+        self.usb = usb
+        self.device = None
+        for vendor in VENDORS:
+            self.device = usb.core.find(idVendor=vendor)
+            if self.device:
+                break
+        if self.device is None:
+            raise RuntimeError('Controller not found')
+        if self.device.is_kernel_driver_active(INTERFACE):
+            self.device.detach_kernel_driver(INTERFACE)
+
+    def send(self, ctrl):
+        self.device.write(ADDR_OUT, ctrl.encode())
+
+    def receive(self):
+        try:
+            data = bytes(self.device.read(ADDR_IN, MSG_SIZE * TX_BATCH, timeout=100))
+        except self.usb.core.USBTimeoutError:
+            return []
+        return [Ctrl.decode(data[i:i+MSG_SIZE]) for i in range(0, len(data), MSG_SIZE)]
+
+
+class NativeTransport:
+    '''
+    The firmware WebUSB layer built natively (see tests/loopback.c). Every
+    receive runs a device tick.
+    '''
+
+    def __init__(self, path=None):
+        import ctypes
+        if path is None:
+            root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+            path = os.path.join(root, 'tests', 'build', 'libloopback.so')
+        if not os.path.exists(path):
+            raise RuntimeError(f'{path} not found, build it with "make host_test"')
+        self.lib = ctypes.CDLL(path)
+        self.lib.loopback_send.argtypes = [ctypes.c_char_p]
+        self.lib.loopback_send.restype = ctypes.c_bool
+        self.lib.loopback_receive.argtypes = [ctypes.c_char_p]
+        self.lib.loopback_receive.restype = ctypes.c_bool
+        self.lib.loopback_ticks.restype = ctypes.c_uint32
+        self.lib.loopback_tick_interval.restype = ctypes.c_uint32
+        self.lib.loopback_reset()
+        self.buffer = ctypes.create_string_buffer(MSG_SIZE)
+
+    @property
+    def ticks(self):
+        return self.lib.loopback_ticks()
+
+    def send(self, ctrl):
+        # Refused while the endpoint NAKs, the sender must retry.
+        while not self.lib.loopback_send(ctrl.encode()):
+            self.lib.loopback_tick()
+
+    def receive(self):
+        self.lib.loopback_tick()
+        messages = []
+        while self.lib.loopback_receive(self.buffer):
+            messages.append(Ctrl.decode(self.buffer.raw))
+        return messages
+
+
+class LoopbackDevice:
+    '''
+    Hand-written model of the firmware rules, only for when the native
+    loopback can not be built: received messages wait in
+    a ring (extra messages are refused until there is room, as the endpoint
+    NAKs), a limited number is handled per tick, and up to TX_BATCH messages
+    are sent per tick with responses before streamed data.
+    '''
+
+    def __init__(self):
+        self.ticks = 0
+        self.rx = deque()
+        self.tx = deque()
+        self.config = {key: [0, 0, 0, 0, 0, 0] for key in CONFIG_KEYS}
+        self.profiles = [[bytes(SECTION_SIZE)] * 64 for _ in range(14)]
+        self.bulk_get = None  # [profile, next, acked, window]
+        self.bulk_set = None  # [profile, staging, received, acked, window]
+
+    def send(self, ctrl):
+        # Refused while the ring is full, the sender must retry.
+        while len(self.rx) >= RX_RING_SIZE:
+            self.tick()
+        self.rx.append(ctrl)
+
+    def receive(self):
+        self.tick()
+        messages = []
+        while self.tx and len(messages) < TX_BATCH:
+            messages.append(self.tx.popleft())
+        while len(messages) < TX_BATCH and self.bulk_get_next(messages):
+            pass
+        return messages
+
+    def tick(self):
+        self.ticks += 1
+        for _ in range(min(RX_BUDGET, len(self.rx))):
+            self.handle(self.rx.popleft())
+
+    def handle(self, ctrl):
+        p = ctrl.payload
+        if ctrl.message_type == STATUS_GET:
+            self.tx.append(Ctrl(0))
+            self.tx.append(Ctrl(STATUS_SHARE, bytes(11)))
+        elif ctrl.message_type == LINK_GET:
+            self.tx.append(Ctrl(LINK_SHARE, bytes(52)))
+        elif ctrl.message_type == CONFIG_GET:
+            self.tx.append(Ctrl(CONFIG_SHARE, [p[0], *self.config.get(p[0], [0]*6)]))
+        elif ctrl.message_type == CONFIG_SET:
+            self.config[p[0]] = list(p[1:7])
+            self.tx.append(Ctrl(CONFIG_SHARE, [p[0], *self.config[p[0]]]))
+        elif ctrl.message_type in (SECTION_GET, SECTION_SET):
+            if ctrl.message_type == SECTION_SET:
+                self.profiles[p[0]][p[1]] = p[2:60]
+            self.tx.append(Ctrl(SECTION_SHARE, bytes(p[0:2]) + self.profiles[p[0]][p[1]]))
+        elif ctrl.message_type == PROFILE_GET:
+            first = max(p[2], BULK_FIRST)
+            self.bulk_get = [p[0], first, first - 1, p[1] or BULK_WINDOW]
+        elif ctrl.message_type == PROFILE_ACK:
+            if self.bulk_get and self.bulk_get[0] == p[0]:
+                self.bulk_get[2] = max(self.bulk_get[2], p[1])
+        elif ctrl.message_type == PROFILE_SET:
+            if p[1] == 0 or not self.bulk_set or self.bulk_set[0] != p[0]:
+                window = p[2] if p[1] == 0 else 0
+                self.bulk_set = [p[0], list(self.profiles[p[0]]), set(), BULK_FIRST - 1, window or BULK_WINDOW]
+                if p[1] == 0:
+                    return
+            duplicate = p[1] in self.bulk_set[2]
+            self.bulk_set[1][p[1]] = p[2:60]
+            self.bulk_set[2].add(p[1])
+            contiguous = BULK_FIRST - 1
+            while contiguous < BULK_LAST and (contiguous + 1) in self.bulk_set[2]:
+                contiguous += 1
+            if contiguous == BULK_LAST or duplicate or contiguous >= self.bulk_set[3] + self.bulk_set[4]:
+                self.tx.append(profile_ack(p[0], contiguous))
+                self.bulk_set[3] = contiguous
+        elif ctrl.message_type == PROFILE_END:
+            if not self.bulk_set or self.bulk_set[0] != p[0]:
+                return
+            profile, staging, received = self.bulk_set[:3]
+            crc = profile_crc(staging)
+            status = BULK_OK
+            if not set(range(BULK_FIRST, BULK_LAST+1)) <= received:
+                status = BULK_ERROR_MISSING
+            elif crc != decode_profile_end(ctrl)['crc']:
+                status = BULK_ERROR_CRC
+            else:
+                self.profiles[profile] = staging
+            self.tx.append(profile_end(profile, crc, status))
+            self.bulk_set = None
+
+    def bulk_get_next(self, messages):
+        if not self.bulk_get:
+            return False
+        profile, next, acked, window = self.bulk_get
+        if next > acked + window:
+            return False
+        if next <= BULK_LAST:
+            share = Ctrl(PROFILE_SHARE, bytes([profile, next]) + self.profiles[profile][next])
+            messages.append(share)
+            self.bulk_get[1] += 1
+            return True
+        if acked >= BULK_LAST:
+            messages.append(profile_end(profile, profile_crc(self.profiles[profile])))
+            self.bulk_get = None
+            return True
+        return False
+
+
+# High level operations.
+
+class Client:
+    def __init__(self, transport):
+        self.transport = transport
+        self.pending = deque()
+
+    def send(self, ctrl):
+        self.transport.send(ctrl)
+
+    def wait(self, message_type, timeout=2):
+        return self.wait_any((message_type,), timeout)
+
+    def wait_any(self, message_types, timeout=2):
+        # Wait for a message of the given types, other messages are discarded.
+        start = time.monotonic()
+        while time.monotonic() - start < timeout:
+            if not self.pending:
+                self.pending.extend(self.transport.receive())
+            while self.pending:
+                ctrl = self.pending.popleft()
+                if ctrl.message_type in message_types:
+                    return ctrl
+        raise TimeoutError(f'No message of types {message_types}')
+
+    def status(self):
+        self.send(status_get())
+        return decode_status_share(self.wait(STATUS_SHARE))
+
+    def link(self):
+        self.send(link_get())
+        return decode_link_share(self.wait(LINK_SHARE))
+
+    def config_read_all(self):
+        for key in CONFIG_KEYS:
+            self.send(config_get(key))
+        return [decode_config_share(self.wait(CONFIG_SHARE)) for _ in CONFIG_KEYS]
+
+    def profile_read(self, profile, window=0):
+        sections = [bytes(SECTION_SIZE)] * 64
+        self.send(profile_get(profile, window))
+        while True:
+            ctrl = self.wait_any((PROFILE_SHARE, PROFILE_END))
+            if ctrl.message_type == PROFILE_END:
+                end = decode_profile_end(ctrl)
+                if end['crc'] != profile_crc(sections):
+                    raise ValueError('Profile GET CRC mismatch')
+                return sections
+            share = decode_section_share(ctrl)
+            sections[share['section']] = share['data']
+            if share['section'] % (window or BULK_WINDOW) == 0 or share['section'] == BULK_LAST:
+                self.send(profile_ack(profile, share['section']))
+
+    def profile_write(self, profile, sections, window=0, retries=3):
+        # Never more than a window of sections without acknowledge, the ones
+        # not acknowledged in time are sent again.
+        window = window or BULK_WINDOW
+        self.send(profile_set_start(profile, window))
+        next = BULK_FIRST
+        acked = BULK_FIRST - 1
+        while acked < BULK_LAST:
+            while next <= BULK_LAST and next <= acked + window:
+                self.send(profile_set(profile, next, sections[next]))
+                next += 1
+            try:
+                ack = decode_profile_ack(self.wait(PROFILE_ACK))
+            except TimeoutError:
+                if not retries:
+                    raise
+                retries -= 1
+                next = acked + 1
+                continue
+            if ack['profile'] == profile:
+                acked = max(acked, ack['section'])
+        self.send(profile_end(profile, profile_crc(sections)))
+        end = decode_profile_end(self.wait(PROFILE_END))
+        if end['status'] != BULK_OK:
+            raise ValueError(f'Profile SET failed with status {end["status"]}')
+
+
+def bench(args):
+    window = int(args[args.index('--window')+1]) if '--window' in args else 0
+    profile = int(args[args.index('--profile')+1]) if '--profile' in args else 9
+    if '--usb' in args:
+        transport = UsbTransport()
+        print('Transport: USB')
+    elif '--model' in args:
+        transport = LoopbackDevice()
+        print('Transport: model (LoopbackDevice, not the firmware code)')
+    else:
+        transport = NativeTransport()
+        print('Transport: native loopback (firmware webusb.c and ctrl.c)')
+    client = Client(transport)
+    simulated = hasattr(transport, 'ticks')
+
+    def measure(label, function, count=1):
+        ticks = getattr(transport, 'ticks', 0)
+        start = time.monotonic()
+        for _ in range(count):
+            result = function()
+        elapsed = time.monotonic() - start
+        line = f'{label:<24} {elapsed*1000/count:9.3f} ms'
+        if simulated:
+            line += f' {(transport.ticks - ticks)/count:8.1f} ticks'
+        print(line)
+        return result
+
+    rounds = 200
+    start = time.monotonic()
+    measure('Status round-trip', client.status, rounds)
+    print(f'{"Messages per second":<24} {rounds*2/(time.monotonic()-start):9.0f}')
+    measure('Config sync', client.config_read_all)
+    sections = measure('Profile GET', lambda: client.profile_read(profile, window))
+    measure('Profile SET', lambda: client.profile_write(profile, sections, window))
+    if isinstance(transport, NativeTransport):
+        # Device time, independent of the speed of the host running it.
+        interval = transport.lib.loopback_tick_interval() / 1000000
+        for label, function in (
+            ('GET', lambda: client.profile_read(profile, window)),
+            ('SET', lambda: client.profile_write(profile, sections, window)),
+        ):
+            ticks = transport.ticks
+            function()
+            rate = 1 / ((transport.ticks - ticks) * interval)
+            print(f'{"Profiles per second " + label:<24} {rate:9.1f} (device time)')
+
+
+if __name__ == '__main__':
+    if len(sys.argv) > 1 and sys.argv[1] == 'bench':
+        bench(sys.argv[2:])
+    else:
+        print(__doc__)
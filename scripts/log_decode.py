@@ -0,0 +1,73 @@
+'''
+This script decodes the binary logs emitted when the firmware is built with
+LOGGING_BINARY. Each record carries the address of its format string, which is
+resolved against the firmware ELF, so the strings never leave the device.
+
+Usage: python3 scripts/log_decode.py build/alpakka.elf dump.bin
+
+Where dump.bin is the concatenation of the payloads of the LOG_BINARY Ctrl
+messages, as received by the app. Requires pyelftools.
+'''
+
+import re
+import struct
+import sys
+from elftools.elf.elffile import ELFFile
+
+HEADER_SIZE = 10
+LEVELS = ['', 'WARNING: ', 'ERROR: ', '']
+CONVERSION = re.compile(r'%([-+ #0-9.]*)([hlLzjt]*)([a-zA-Z%])')
+
+elf = ELFFile(open(sys.argv[1], 'rb'))
+data = open(sys.argv[2], 'rb').read()
+
+def read_string(addr):
+    for section in elf.iter_sections():
+        start = section['sh_addr']
+        end = start + section['sh_size']
+        if start <= addr < end and section['sh_type'] == 'SHT_PROGBITS':
+            raw = section.data()[addr - start:]
+            return raw[:raw.index(0)].decode('utf8', 'replace')
+    return f'<unknown format 0x{addr:08x}>'
+
+def format_record(fmt, args):
+    values = []
+    pyfmt = ''
+    cursor = 0
+    for match in CONVERSION.finditer(fmt):
+        pyfmt += fmt[cursor:match.start()].replace('%', '%%')
+        cursor = match.end()
+        flags, length, conv = match.groups()
+        if conv == '%':
+            pyfmt += '%%'
+            continue
+        if conv in 'fFeEgGaA':
+            values.append(struct.unpack_from('<d', args)[0])
+            args = args[8:]
+        elif conv == 's':
+            end = args.index(0)
+            values.append(args[:end].decode('utf8', 'replace'))
+            args = args[end+1:]
+        elif length.count('l') >= 2:
+            signed = conv in 'di'
+            values.append(struct.unpack_from('<q' if signed else '<Q', args)[0])
+            args = args[8:]
+        else:
+            signed = conv in 'di'
+            values.append(struct.unpack_from('<i' if signed else '<I', args)[0])
+            args = args[4:]
+        conv = {'u': 'd', 'p': 'x'}.get(conv, conv)
+        pyfmt += f'%{flags}{conv}'
+    pyfmt += fmt[cursor:].replace('%', '%%')
+    return pyfmt % tuple(values)
+
+while len(data) >= HEADER_SIZE:
+    addr, timestamp, level, size = struct.unpack_from('<IIBB', data)
+    args = data[HEADER_SIZE:HEADER_SIZE+size]
+    data = data[HEADER_SIZE+size:]
+    fmt = read_string(addr)
+    try:
+        text = format_record(fmt, args)
+    except (struct.error, ValueError, TypeError):
+        text = f'{fmt} <truncated arguments>'
+    print(f'[{timestamp/1000000:10.6f}] {LEVELS[level]}{text}', end='')
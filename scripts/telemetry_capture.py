@@ -0,0 +1,73 @@
+'''
+This script subscribes to the controller telemetry stream over WebUSB and
+writes the received frames to a file, so they can be replayed later.
+
+Usage: python3 scripts/telemetry_capture.py CHANNELS DIVIDER OUTPUT [--wireless]
+
+Where CHANNELS is the bitmask of channels (see docs/ctrl_protocol.md), and
+DIVIDER sends a frame every N ticks. Use --wireless when the controller is
+connected through the dongle. Stop with Ctrl+C. Requires pyusb.
+
+Capture file format: The magic header b'ALPKTLM1', followed by the payload of
+each TELEMETRY_FRAME message as received (sequence, timestamp, channels,
+dropped, data), each one prefixed by its length as a single byte.
+
+Captures with the gyro channel (and divider 1) can be replayed through the
+gyro mouse with the host tests: tests/build/test_gyro OUTPUT
+'''
+
+import sys
+import usb.core
+
+VENDORS = [0x0170, 0x045E]
+INTERFACE = 1  # ITF_WEBUSB.
+ADDR_IN = 0x83
+ADDR_OUT = 0x04
+TELEMETRY_SET = 19
+TELEMETRY_FRAME = 20
+FLAG_NONE = 1
+FLAG_WIRELESS = 2
+MAGIC = b'ALPKTLM1'
+
+channels = int(sys.argv[1], 0)
+divider = int(sys.argv[2])
+path = sys.argv[3]
+flag = FLAG_WIRELESS if '--wireless' in sys.argv else FLAG_NONE
+
+device = None
+for vendor in VENDORS:
+    device = usb.core.find(idVendor=vendor)
+    if device:
+        break
+if device is None:
+    sys.exit('Controller not found')
+if device.is_kernel_driver_active(INTERFACE):
+    device.detach_kernel_driver(INTERFACE)
+
+def subscribe(channels, divider):
+    message = bytes([flag, 1, TELEMETRY_SET, 2, channels, divider])
+    device.write(ADDR_OUT, message.ljust(64, b'\0'))
+
+subscribe(channels, divider)
+frames = 0
+with open(path, 'wb') as file:
+    file.write(MAGIC)
+    try:
+        while True:
+            try:
+                data = bytes(device.read(ADDR_IN, 64 * 4, timeout=1000))
+            except usb.core.USBTimeoutError:
+                continue
+            # Several messages may come in a single transfer.
+            for i in range(0, len(data), 64):
+                message = data[i:i+64]
+                if len(message) < 4 or message[2] != TELEMETRY_FRAME:
+                    continue
+                size = message[3]
+                file.write(bytes([size]) + message[4:4+size])
+                frames += 1
+    except KeyboardInterrupt:
+        pass
+    finally:
+        subscribe(0, 0)
+print(f'{frames} frames written to {path}')
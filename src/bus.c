@@ -70,15 +70,15 @@ void bus_i2c_io_pcb_gen_determine() {
     #endif
 }
 
+// Both expanders are polled every tick (two transactions of two bytes).
+// Reading them only on change would require their interrupt line routed to a
+// free GPIO, and a faster bus (1MHz Fast-mode Plus) would require pull-ups
+// sized for it, neither is the case on the current boards.
 void bus_i2c_io_cache_update() {
     io_cache_0 = bus_i2c_read_two(I2C_IO_0, I2C_IO_REG_INPUT);
     io_cache_1 = bus_i2c_read_two(I2C_IO_1, I2C_IO_REG_INPUT);
 }
 
-bool bus_i2c_io_cache_read(uint8_t device_index, uint8_t bit_index) {
-    return (device_index ? io_cache_1 : io_cache_0) & (1 << bit_index);
-}
-
 bool bus_i2c_io_read(uint8_t device_id, uint8_t bit_index) {
     uint16_t value = bus_i2c_read_two(device_id, I2C_IO_REG_INPUT);
     return value & (1 << bit_index);
@@ -115,7 +115,8 @@ uint8_t bus_spi_read_one(uint8_t cs, uint8_t reg) {
 
 void bus_i2c_init() {
     info("INIT: I2C bus\n");
-    i2c_init(I2C_CHANNEL, I2C_FREQ);
+    uint32_t freq = i2c_init(I2C_CHANNEL, I2C_FREQ);
+    info("  freq=%lu\n", freq);
     gpio_set_function(PIN_I2C_SDA, GPIO_FUNC_I2C);
     gpio_set_function(PIN_I2C_SCL, GPIO_FUNC_I2C);
     gpio_pull_up(PIN_I2C_SDA);
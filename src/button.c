@@ -12,9 +12,65 @@
 #include "pin.h"
 #include "common.h"
 
-bool Button__is_pressed(Button *self) {
-    bool is_pressed = false;
+// Debounced state of all digital inputs, one bit per input (see
+// button_input_mask), and vertical counters of consecutive released samples.
+uint64_t button_input = 0;
+uint64_t button_counter_0 = 0;
+uint64_t button_counter_1 = 0;
+
+// Overlays applied on top of the debounced input as seen by the buttons, used
+// by chords and layers to hold back or inject presses. Cleared every sample.
+uint64_t button_input_suppress = 0;
+uint64_t button_input_force = 0;
+
+// Board GPIOs already configured as button inputs.
+uint32_t button_gpio_ready = 0;
+
+// Board pins are Pico GPIO numbers, only the ones up to 29 exist (the board
+// pin group starts at 1, GPIO 0 is never a button).
+bool button_is_board_pin(uint8_t pin) {
+    return is_between(pin, PIN_GROUP_BOARD, BUTTON_INPUT_BOARD_LAST);
+}
+
+// Position of each input in the input vector, zero if the pin does not exist
+// (so it never overlaps the bits of other inputs).
+uint64_t button_input_mask(uint8_t pin) {
+    if (button_is_board_pin(pin)) {
+        return (uint64_t)1 << pin;
+    }
+    if (is_between(pin, PIN_GROUP_IO_0, PIN_GROUP_IO_0 + BUTTON_INPUT_IO_PINS - 1)) {
+        return (uint64_t)1 << (BUTTON_INPUT_IO_0 + pin - PIN_GROUP_IO_0);
+    }
+    if (is_between(pin, PIN_GROUP_IO_1, PIN_GROUP_IO_1 + BUTTON_INPUT_IO_PINS - 1)) {
+        return (uint64_t)1 << (BUTTON_INPUT_IO_1 + pin - PIN_GROUP_IO_1);
+    }
+    return 0;
+}
+
+// Sample all digital inputs at once and debounce them, once per tick.
+// Presses are registered immediately, releases only after the input has been
+// released for 3 consecutive samples (2-bit vertical counters).
+void button_input_update() {
+    bus_i2c_io_cache_update();
+    uint64_t raw = (
+        ((uint64_t)(~gpio_get_all()) & BUTTON_INPUT_BOARD_MASK) |
+        ((uint64_t)io_cache_0 << BUTTON_INPUT_IO_0) |
+        ((uint64_t)io_cache_1 << BUTTON_INPUT_IO_1)
+    );
+    // Count consecutive released samples of inputs currently pressed, any
+    // input not in that condition gets its counter reset.
+    uint64_t releasing = button_input & ~raw;
+    button_counter_1 = (button_counter_1 ^ button_counter_0) & releasing;
+    button_counter_0 = ~button_counter_0 & releasing;
+    uint64_t released = button_counter_0 & button_counter_1;
+    button_counter_0 &= ~released;
+    button_counter_1 &= ~released;
+    button_input = (button_input & ~released) | raw;
+    button_input_suppress = 0;
+    button_input_force = 0;
+}
 
+bool Button__is_pressed(Button *self) {
     if (self->pin == PIN_NONE) return false;
     // Virtual buttons.
     else if (self->pin == PIN_VIRTUAL) {
@@ -25,36 +81,9 @@ bool Button__is_pressed(Button *self) {
             return false;
         }
     }
-    // Buttons connected directly to Pico.
-    else if (is_between(self->pin, PIN_GROUP_BOARD, PIN_GROUP_BOARD_END)) {
-        is_pressed =  !gpio_get(self->pin);
-    }
-    // Buttons connected to 1st IO expander.
-    else if (is_between(self->pin, PIN_GROUP_IO_0, PIN_GROUP_IO_0_END)) {
-        is_pressed =  bus_i2c_io_cache_read(0, self->pin - PIN_GROUP_IO_0);
-    }
-    // Buttons connected to 2nd IO expander.
-    else if (is_between(self->pin, PIN_GROUP_IO_1, PIN_GROUP_IO_1_END)) {
-        is_pressed =  bus_i2c_io_cache_read(1, self->pin - PIN_GROUP_IO_1);
-    }
-
-    // debounce processing
-    if (self->press_timestamp == 0 && is_pressed)
-    {
-        // start of debounce process
-        self->press_timestamp = time_us_64();
-    }
-    else if (self->press_timestamp > 0 && time_us_64()-self->press_timestamp < CFG_PRESS_DEBOUNCE*1000)
-    {
-        // is_pressed doesn't matter: we're debouncing
-        is_pressed = true;
-    }
-    else if (self->press_timestamp > 0 && !is_pressed)
-    {
-        // We're out of the debounce window : clear timestamp
-        self->press_timestamp = 0;
-    }
-    return is_pressed;
+    // Buttons connected directly to Pico or to the IO expanders.
+    uint64_t input = (button_input & ~button_input_suppress) | button_input_force;
+    return input & self->input_mask;
 }
 
 void Button__report(Button *self) {
@@ -90,7 +119,6 @@ void Button__handle_sticky(Button *self) {
 void Button__reset(Button *self) {
     self->fsm.current_state = BTN_NO_PRESS;
     self->fsm.activation_state = ACT_REST;
-    self->press_timestamp = 0;
 }
 
 // Init.
@@ -101,10 +129,15 @@ Button Button_ (
     Actions actions_secondary,
     Actions actions_terciary
 ) {
-    if (pin) {
-        gpio_init(pin);
-        gpio_set_dir(pin, GPIO_IN);
-        gpio_pull_up(pin);
+    // Configure board GPIOs only once, no matter how many profiles (or how
+    // many times a profile) are built.
+    if (button_is_board_pin(pin)) {
+        if (!(button_gpio_ready & ((uint32_t)1 << pin))) {
+            gpio_init(pin);
+            gpio_set_dir(pin, GPIO_IN);
+            gpio_pull_up(pin);
+            button_gpio_ready |= (uint32_t)1 << pin;
+        }
     }
     Button button;
     button.is_pressed = Button__is_pressed;
@@ -117,12 +150,12 @@ Button Button_ (
     memcpy(button.actions_secondary, actions_secondary, ACTIONS_LEN*sizeof(typeof(actions[0])));
     button.state_primary = false;
     button.virtual_press = false;
-    button.press_timestamp = 0;
+    button.input_mask = button_input_mask(pin);
     button.fsm = make_fsm();
     button.fsm.long_hold = (mode & LONG) != 0;
 
     // Translation layer from old to new
-    info("loading pin %d\n", pin);
+    mapping_trace("loading pin %d\n", pin);
     bool immediate = (mode & IMMEDIATE) != 0;
     bool hold = (mode & HOLD) != 0;
     bool dbl = (mode & DOUBLE) != 0;
@@ -137,8 +170,8 @@ Button Button_ (
     {
         for(int i = 0 ; i < ACTIONS_LEN ; ++i)
         {
-            addMapping(&button.fsm.press_actions, actions[i], MOD_START, immediate ? MOD_PRESS : MOD_TAP);
-            addMapping(&button.fsm.press_actions, actions_secondary[i], MOD_START, MOD_HOLD);
+            addMapping(&button.fsm.press_actions, actions[i], immediate ? MOD_START : MOD_TAP, immediate ? MOD_PRESS : MOD_PULSE);
+            addMapping(&button.fsm.press_actions, actions_secondary[i], MOD_HOLD, MOD_PRESS);
             if (dbl)
             {
                 addMapping(&button.fsm.double_press_actions, actions_terciary[i], MOD_START, MOD_PRESS);
@@ -149,7 +182,7 @@ Button Button_ (
     {
         for(int i = 0 ; i < ACTIONS_LEN ; ++i)
         {
-            addMapping(&button.fsm.press_actions, actions[i], MOD_START, immediate ? MOD_PRESS : MOD_TAP);
+            addMapping(&button.fsm.press_actions, actions[i], immediate ? MOD_START : MOD_TAP, immediate ? MOD_PRESS : MOD_PULSE);
             addMapping(&button.fsm.double_press_actions, actions_secondary[i], MOD_START, MOD_PRESS);
         }
     }
@@ -0,0 +1,117 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+/*
+A chord is a pair of buttons that, if pressed together within a time window,
+engage a different set of actions instead of their own.
+
+The chords operate on the debounced input vector (see button.c), before the
+buttons are evaluated, hiding or forcing the members bits as seen by the
+buttons. So buttons that are not members of any chord are never delayed, and
+the buttons themselves do not need to know about chords.
+
+When a single member is pressed it is held back until the other member is
+pressed or the window expires, whatever happens first, so the latency added
+to single presses is never longer than the window. If the member is released
+before that, the press is forwarded immediately (as a short tap), during a few
+samples, since the buttons need to see the press and the release on different
+ticks to engage their actions.
+
+In speculative mode members are never held back, and if the chord is
+completed within the window the single button actions are disengaged (by
+hiding the member) and the chord actions engaged.
+*/
+
+#include <string.h>
+#include <pico/time.h>
+#include "chord.h"
+#include "button.h"
+#include "hid.h"
+#include "logging.h"
+
+void Chord__report(Chord *self) {
+    if (!self->mask_a || !self->mask_b) return;
+    uint64_t mask = self->mask_a | self->mask_b;
+    uint64_t pressed = button_input & mask;
+    uint64_t now = time_us_64();
+    bool both = pressed == mask;
+    bool elapsed = (now - self->timestamp) > self->window;
+    if (self->state == CHORD_IDLE) {
+        if (both) {
+            hid_press_multiple(self->actions);
+            self->state = CHORD_ACTIVE;
+        } else if (pressed) {
+            self->timestamp = now;
+            self->first = pressed;
+            self->state = self->speculative ? CHORD_PASS : CHORD_PENDING;
+        }
+    }
+    else if (self->state == CHORD_PENDING) {
+        if (both) {
+            hid_press_multiple(self->actions);
+            self->state = CHORD_ACTIVE;
+        } else if (!pressed) {
+            // Released before the window expired, forward the press.
+            self->forward = CHORD_FORWARD_SAMPLES;
+            self->state = CHORD_FORWARD;
+        } else if (elapsed) {
+            self->state = CHORD_PASS;
+        }
+    }
+    else if (self->state == CHORD_PASS) {
+        if (!pressed) {
+            self->state = CHORD_IDLE;
+        } else if (both && self->speculative && !elapsed) {
+            // Hiding the members makes them disengage their own actions.
+            hid_press_multiple(self->actions);
+            self->state = CHORD_ACTIVE;
+        }
+    }
+    else if (self->state == CHORD_ACTIVE) {
+        if (!pressed) {
+            hid_release_multiple(self->actions);
+            self->state = CHORD_IDLE;
+        }
+    }
+    if (self->state == CHORD_FORWARD) {
+        // Overlays are cleared every sample, so the press is forced on each.
+        button_input_force |= self->first;
+        self->forward--;
+        if (!self->forward) self->state = CHORD_IDLE;
+        return;
+    }
+    // Hide members while the chord is undecided or engaged. Once engaged, the
+    // chord is kept until both members are released.
+    if (self->state == CHORD_PENDING || self->state == CHORD_ACTIVE) {
+        button_input_suppress |= mask;
+    }
+}
+
+void Chord__reset(Chord *self) {
+    self->state = CHORD_IDLE;
+    self->timestamp = 0;
+    self->first = 0;
+    self->forward = 0;
+}
+
+Chord Chord_(
+    uint64_t mask_a,
+    uint64_t mask_b,
+    Actions actions,
+    uint8_t window,
+    bool speculative
+) {
+    Chord chord;
+    chord.report = Chord__report;
+    chord.reset = Chord__reset;
+    chord.mask_a = mask_a;
+    chord.mask_b = mask_b;
+    chord.window = (window ? window : CHORD_WINDOW_DEFAULT) * 1000;
+    chord.speculative = speculative;
+    chord.state = CHORD_IDLE;
+    chord.timestamp = 0;
+    chord.first = 0;
+    chord.forward = 0;
+    memcpy(chord.actions, actions, ACTIONS_LEN);
+    return chord;
+}
@@ -27,3 +27,14 @@ uint8_t bitmask_set(uint8_t bitmask, uint8_t flag, bool value) {
     if (value) bitmask += flag;  // Add / set to one.
     return bitmask;
 }
+
+// CRC-16/CCITT-FALSE.
+uint16_t crc16(uint16_t crc, const uint8_t *data, uint32_t len) {
+    for(uint32_t i=0; i<len; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for(uint8_t b=0; b<8; b++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+        }
+    }
+    return crc;
+}
@@ -4,7 +4,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <hardware/sync.h>
+#include <pico/time.h>
 #include <pico/unique_id.h>
 #include "config.h"
 #include "nvm.h"
@@ -19,13 +21,28 @@
 #include "logging.h"
 #include "power.h"
 
-// Config values.
+// Config values, stored in the NVM journal (without the trailing padding).
+#define CONFIG_JOURNAL_SIZE offsetof(Config, padding)
+_Static_assert(CONFIG_JOURNAL_SIZE <= NVM_JOURNAL_PAYLOAD, "Config too big for journal");
 Config config_cache;
 bool config_cache_synced = true;
 
-// Profiles.
-CtrlProfile config_profile_cache[NVM_PROFILE_SLOTS];
-bool config_profile_cache_synced[NVM_PROFILE_SLOTS] = {0,};
+// Profiles are read in place from flash, only profiles with pending changes
+// are copied into a RAM overlay until they are written back. The modified
+// sections are written into the NVM journal, and only written into the profile
+// sector on the journal garbage collection (or if most of the profile changed).
+// Profiles with journaled sections are kept in an overlay until then, and
+// replayed into one at boot.
+CtrlProfile config_profile_overlay[NVM_PROFILE_OVERLAYS];
+uint8_t config_profile_overlay_index[NVM_PROFILE_OVERLAYS] = {
+    [0 ... NVM_PROFILE_OVERLAYS-1] = PROFILE_NONE
+};
+uint64_t config_profile_overlay_dirty[NVM_PROFILE_OVERLAYS] = {0,};  // Sections.
+uint64_t config_profile_overlay_ts[NVM_PROFILE_OVERLAYS] = {0,};  // Last edit.
+int8_t config_profile_committing = -1;  // Overlay being written to NVM.
+// Snapshot of the overlay being written, since the overlay may be edited again
+// while the commit is in progress, and the NVM commit buffer must not change.
+ConfigProfileSector config_profile_commit_buffer;
 
 // Misc.
 uint8_t config_tune_mode = 0;
@@ -36,27 +53,68 @@ uint8_t problems_state = 0;  // Bitmask with Problem enum.
 
 
 void config_load() {
-    // Load main config from NVM into the cache.
-    nvm_read(NVM_CONFIG_ADDR, (uint8_t*)&config_cache, NVM_CONFIG_SIZE);
+    // Load main config from NVM into the cache, from the journal if present,
+    // otherwise from the legacy config sector (migrated on the next write).
+    nvm_journal_init();
+    if (!nvm_journal_read(NVM_KEY_CONFIG, &config_cache, CONFIG_JOURNAL_SIZE)) {
+        nvm_read(NVM_CONFIG_ADDR, (uint8_t*)&config_cache, NVM_CONFIG_SIZE);
+    }
+}
+
+uint32_t config_profile_addr(uint8_t index) {
+    return NVM_CONFIG_ADDR + (NVM_PROFILE_SIZE * (index+1));
+}
+
+NvmKey config_profile_key(uint8_t index, uint8_t section) {
+    return NVM_KEY_PROFILE + (index * CTRL_PROFILE_SECTIONS) + section;
+}
+
+const ConfigProfileSector* config_profile_sector(uint8_t index) {
+    return nvm_pointer(config_profile_addr(index));
+}
+
+uint32_t config_profile_sector_seq(uint8_t index) {
+    // Journal sequence included in the profile sector (erased if the sector
+    // was written by a firmware without journal).
+    uint32_t seq = config_profile_sector(index)->seq;
+    return seq == UINT32_MAX ? 0 : seq;
+}
+
+bool config_profile_is_journaled(uint8_t index) {
+    // If the journal has sections of the profile not yet in its sector.
+    NvmKey first = config_profile_key(index, 0);
+    return nvm_journal_latest(first, CTRL_PROFILE_SECTIONS) > config_profile_sector_seq(index);
 }
 
-void config_profile_clear_cache(uint8_t index) {
-    debug("Config: Clear profile %i cache\n", index);
-    memset(&config_profile_cache[index], 0, sizeof(CtrlProfile));
+void config_profile_stored_section(uint8_t index, uint8_t section, CtrlSection *dest) {
+    // Section as stored in NVM, from the journal if newer than the sector.
+    uint32_t seq = nvm_journal_read(config_profile_key(index, section), dest, sizeof(CtrlSection));
+    if (seq > config_profile_sector_seq(index)) return;
+    memcpy(dest, &config_profile_sector(index)->profile.sections[section], sizeof(CtrlSection));
+}
+
+void config_profile_stored(uint8_t index, CtrlProfile *dest) {
+    for(uint8_t i=0; i<CTRL_PROFILE_SECTIONS; i++) {
+        config_profile_stored_section(index, i, &dest->sections[i]);
+    }
+}
+
+// Overlay slot holding the given profile, or -1 if none.
+int8_t config_profile_overlay_find(uint8_t index) {
+    for(uint8_t i=0; i<NVM_PROFILE_OVERLAYS; i++) {
+        if (config_profile_overlay_index[i] == index) return i;
+    }
+    return -1;
 }
 
 void config_profile_load(uint8_t index) {
-    debug("Config: Profile %i load from NVM\n", index);
-    // Nuke cache.
-    config_profile_clear_cache(index);
-    // Load NVM into cache.
-    uint32_t addr = NVM_CONFIG_ADDR + (NVM_PROFILE_SIZE * (index+1));
-    nvm_read(addr, (uint8_t*)&config_profile_cache[index], sizeof(CtrlProfile));
-    // Check if loaded profile is valid, otherwise load default.
-    CtrlProfileMeta meta = config_profile_cache[index].sections[SECTION_META].meta;
+    debug("Config: Profile %i check in NVM\n", index);
+    // Check if stored profile is valid, otherwise write default.
+    CtrlProfileMeta meta = config_profile_read(index)->sections[SECTION_META].meta;
     if (meta.control_byte != NVM_CONTROL_BYTE) {
         debug("Config: Profile %i not found\n", index);
         config_profile_default(index, index);
+        return;
     }
     uint32_t version = (
         (meta.version_major * 1000000) +
@@ -69,8 +127,6 @@ void config_profile_load(uint8_t index) {
         debug("Config: Profile %i incompatible version (%lu)\n", index, version);
         config_profile_default(index, index);
     }
-    // Tag as synced.
-    config_profile_cache_synced[index] = true;
 }
 
 Config* config_read() {
@@ -79,32 +135,186 @@ Config* config_read() {
     return &config_cache;
 }
 
-CtrlProfile* config_profile_read(uint8_t index) {
-    // Get a profile from cache.
-    return &(config_profile_cache[index]);
+const CtrlProfile* config_profile_read(uint8_t index) {
+    // Get a profile, from the overlay if it has pending changes, otherwise
+    // directly from flash.
+    int8_t slot = config_profile_overlay_find(index);
+    if (slot >= 0) return &config_profile_overlay[slot];
+    return nvm_pointer(config_profile_addr(index));
+}
+
+CtrlProfile* config_profile_edit(uint8_t index) {
+    // Get a writable profile, copying it into an overlay if needed. The
+    // profile is flagged as unsynced and saved on the next sync.
+    int8_t slot = config_profile_overlay_find(index);
+    if (slot >= 0) {
+        config_profile_overlay_dirty[slot] = UINT64_MAX;
+        config_profile_overlay_ts[slot] = time_us_64();
+        return &config_profile_overlay[slot];
+    }
+    // Find a free overlay, or save the least recently edited one to free it.
+    slot = config_profile_overlay_find(PROFILE_NONE);
+    if (slot < 0) {
+        slot = 0;
+        for(uint8_t i=1; i<NVM_PROFILE_OVERLAYS; i++) {
+            if (config_profile_overlay_ts[i] < config_profile_overlay_ts[slot]) slot = i;
+        }
+        config_profile_write(config_profile_overlay_index[slot]);
+    }
+    debug("Config: Profile %i copied into overlay %i\n", index, slot);
+    config_profile_stored(index, &config_profile_overlay[slot]);
+    config_profile_overlay_index[slot] = index;
+    config_profile_overlay_dirty[slot] = UINT64_MAX;
+    config_profile_overlay_ts[slot] = time_us_64();
+    return &config_profile_overlay[slot];
+}
+
+bool config_profile_set_section(uint8_t index, uint8_t section, const uint8_t *data) {
+    // Update a single section of a profile, only flagging it as modified if
+    // the data actually changed. Returns true if it changed.
+    if (index >= NVM_PROFILE_SLOTS || section >= CTRL_PROFILE_SECTIONS) {
+        warn("Config: Invalid profile section %i %i\n", index, section);
+        return false;
+    }
+    const CtrlProfile *current = config_profile_read(index);
+    if (!memcmp(&current->sections[section], data, sizeof(CtrlSection))) {
+        return false;
+    }
+    uint64_t dirty = 0;
+    int8_t slot = config_profile_overlay_find(index);
+    if (slot >= 0) dirty = config_profile_overlay_dirty[slot];
+    CtrlProfile *profile = config_profile_edit(index);
+    memcpy(&profile->sections[section], data, sizeof(CtrlSection));
+    slot = config_profile_overlay_find(index);
+    config_profile_overlay_dirty[slot] = dirty | ((uint64_t)1 << section);
+    return true;
+}
+
+uint64_t config_profile_changed_sections(int8_t slot) {
+    // Modified sections of an overlay that are actually different from what
+    // is stored in NVM (eg: a slider dragged back to its initial value).
+    uint64_t changed = 0;
+    for(uint8_t i=0; i<CTRL_PROFILE_SECTIONS; i++) {
+        if (!(config_profile_overlay_dirty[slot] & ((uint64_t)1 << i))) continue;
+        CtrlSection stored;
+        config_profile_stored_section(config_profile_overlay_index[slot], i, &stored);
+        CtrlSection *section = &config_profile_overlay[slot].sections[i];
+        if (memcmp(section, &stored, sizeof(CtrlSection))) changed |= (uint64_t)1 << i;
+    }
+    return changed;
+}
+
+void config_profile_release(int8_t slot) {
+    // Release an overlay, unless it has changes not yet in the profile sector.
+    uint8_t index = config_profile_overlay_index[slot];
+    if (index == PROFILE_NONE || config_profile_overlay_dirty[slot]) return;
+    if (config_profile_is_journaled(index)) return;
+    config_profile_overlay_index[slot] = PROFILE_NONE;
 }
 
 void config_write() {
     // Write main config from cache to NVM.
     info("NVM: Config write\n");
-    nvm_write(NVM_CONFIG_ADDR, (uint8_t*)&config_cache, NVM_CONFIG_SIZE);
+    nvm_journal_write(NVM_KEY_CONFIG, &config_cache, CONFIG_JOURNAL_SIZE);
     config_cache_synced = true;
 }
 
+void config_profile_commit_start(int8_t slot) {
+    // Write the modified sections of an overlay to NVM, each one as a journal
+    // record (a single page program). If most of the profile changed, the
+    // whole profile is written instead, in steps (see config_sync).
+    uint8_t index = config_profile_overlay_index[slot];
+    uint64_t changed = config_profile_changed_sections(slot);
+    uint8_t n = __builtin_popcountll(changed);
+    if (n == 0) {
+        debug("NVM: Profile %i unchanged, not written\n", index);
+    } else if (n <= NVM_PROFILE_JOURNAL_SECTIONS) {
+        debug("NVM: Profile %i journal (%i sections modified)\n", index, n);
+        for(uint8_t i=0; i<CTRL_PROFILE_SECTIONS; i++) {
+            if (!(changed & ((uint64_t)1 << i))) continue;
+            nvm_journal_write(
+                config_profile_key(index, i),
+                &config_profile_overlay[slot].sections[i],
+                sizeof(CtrlSection)
+            );
+        }
+    } else {
+        debug("NVM: Profile %i commit (%i sections modified)\n", index, n);
+        config_profile_committing = slot;
+        config_profile_commit_buffer.profile = config_profile_overlay[slot];
+        config_profile_commit_buffer.seq = nvm_journal_get_seq();
+        nvm_commit_start(
+            config_profile_addr(index),
+            (uint8_t*)&config_profile_commit_buffer,
+            sizeof(ConfigProfileSector)
+        );
+    }
+    // Cleared only now, so a garbage collection triggered by the journal
+    // writes above does not release the overlay.
+    config_profile_overlay_dirty[slot] = 0;
+    if (config_profile_committing != slot) config_profile_release(slot);
+}
+
+bool config_profile_commit_step() {
+    // Returns true when there is no commit in progress.
+    if (config_profile_committing < 0) return true;
+    if (!nvm_commit_step()) return false;
+    // Release the overlay, unless it was modified again in the meantime.
+    int8_t slot = config_profile_committing;
+    info(
+        "NVM: Profile %i written (max stall %lu us)\n",
+        config_profile_overlay_index[slot],
+        nvm_get_stall_max()
+    );
+    config_profile_committing = -1;
+    config_profile_release(slot);
+    return true;
+}
+
+void config_profile_write_sector(uint8_t index) {
+    // Write the profile in the commit buffer into its sector (blocking), as
+    // including every section journaled so far.
+    config_profile_commit_buffer.seq = nvm_journal_get_seq();
+    nvm_write(
+        config_profile_addr(index),
+        (uint8_t*)&config_profile_commit_buffer,
+        sizeof(ConfigProfileSector)
+    );
+}
+
 void config_profile_write(uint8_t index) {
-    // Write a profile from cache to NVM.
+    // Write a profile from its overlay to NVM, and release the overlay.
+    // Blocking, any commit in progress is completed first.
+    while(!config_profile_commit_step());
+    int8_t slot = config_profile_overlay_find(index);
+    if (slot < 0) return;
     info("NVM: Profile %i write\n", index);
-    uint32_t addr = NVM_CONFIG_ADDR + (NVM_PROFILE_SIZE * (index+1));
-    nvm_write(addr, (uint8_t*)&config_profile_cache[index], NVM_PROFILE_SIZE);
-    config_profile_cache_synced[index] = true;
+    config_profile_commit_buffer.profile = config_profile_overlay[slot];
+    config_profile_write_sector(index);
+    config_profile_overlay_index[slot] = PROFILE_NONE;
+    config_profile_overlay_dirty[slot] = 0;
 }
 
-void config_profile_set_sync(uint8_t index, bool state) {
-    // Flag a profile as synced or unsynced.
-    config_profile_cache_synced[index] = state;
+void config_profile_compact() {
+    // Write the journaled sections into their profiles, before the journal
+    // garbage collection erases their records. Blocking, a flash erase for
+    // each profile with journaled sections.
+    while(!config_profile_commit_step());
+    for(uint8_t i=0; i<NVM_PROFILE_SLOTS; i++) {
+        if (!config_profile_is_journaled(i)) continue;
+        info("NVM: Profile %i compact\n", i);
+        config_profile_stored(i, &config_profile_commit_buffer.profile);
+        config_profile_write_sector(i);
+    }
+    for(uint8_t slot=0; slot<NVM_PROFILE_OVERLAYS; slot++) {
+        config_profile_release(slot);
+    }
 }
 
 void config_sync() {
+    // Profile commit in progress, one step per tick so a single tick never
+    // stalls longer than one flash erase or a few page programs.
+    if (!config_profile_commit_step()) return;
     // Do not check in every cycle.
     static uint16_t i = 0;
     i++;
@@ -116,9 +326,15 @@ void config_sync() {
     }
     // Sync profiles.
     #ifdef DEVICE_IS_ALPAKKA
-        for(uint8_t i=0; i<NVM_PROFILE_SLOTS; i++) {
-            if (!config_profile_cache_synced[i]) {
-                config_profile_write(i);
+        // One profile at a time, and only once it has not been modified for
+        // a while (so a stream of edits is coalesced into a single write).
+        uint64_t now = time_us_64();
+        for(uint8_t i=0; i<NVM_PROFILE_OVERLAYS; i++) {
+            uint64_t quiet = now - config_profile_overlay_ts[i];
+            if (quiet < NVM_PROFILE_QUIET_TIME * 1000) continue;
+            if (config_profile_overlay_dirty[i]) {
+                config_profile_commit_start(i);
+                break;
             }
         }
     #endif
@@ -562,24 +778,25 @@ void config_alert_if_not_calibrated() {
 
 void config_profile_default(uint8_t indexTo, int8_t indexFrom) {
     info("Config: Profile %i init from default %i\n", indexTo, indexFrom);
-    config_profile_clear_cache(indexTo);
-    if (indexFrom ==  0) config_profile_default_home(           &(config_profile_cache[indexTo]));
-    if (indexFrom ==  1) config_profile_default_fps_fusion(     &(config_profile_cache[indexTo]));
-    if (indexFrom ==  2) config_profile_default_racing(         &(config_profile_cache[indexTo]));
-    if (indexFrom ==  3) config_profile_default_console(        &(config_profile_cache[indexTo]));
-    if (indexFrom ==  4) config_profile_default_desktop(        &(config_profile_cache[indexTo]));
-    if (indexFrom ==  5) config_profile_default_fps_wasd(       &(config_profile_cache[indexTo]));
-    if (indexFrom ==  6) config_profile_default_flight(         &(config_profile_cache[indexTo]));
-    if (indexFrom ==  7) config_profile_default_console_legacy( &(config_profile_cache[indexTo]));
-    if (indexFrom ==  8) config_profile_default_rts(            &(config_profile_cache[indexTo]));
-    if (indexFrom ==  9) config_profile_default_custom(         &(config_profile_cache[indexTo]));
-    if (indexFrom == 10) config_profile_default_custom(         &(config_profile_cache[indexTo]));
-    if (indexFrom == 11) config_profile_default_custom(         &(config_profile_cache[indexTo]));
-    if (indexFrom == 12) config_profile_default_custom(         &(config_profile_cache[indexTo]));
-    if (indexFrom == 13) config_profile_default_console_legacy( &(config_profile_cache[indexTo]));
+    CtrlProfile *profile = config_profile_edit(indexTo);
+    memset(profile, 0, sizeof(CtrlProfile));
+    if (indexFrom ==  0) config_profile_default_home(           profile);
+    if (indexFrom ==  1) config_profile_default_fps_fusion(     profile);
+    if (indexFrom ==  2) config_profile_default_racing(         profile);
+    if (indexFrom ==  3) config_profile_default_console(        profile);
+    if (indexFrom ==  4) config_profile_default_desktop(        profile);
+    if (indexFrom ==  5) config_profile_default_fps_wasd(       profile);
+    if (indexFrom ==  6) config_profile_default_flight(         profile);
+    if (indexFrom ==  7) config_profile_default_console_legacy( profile);
+    if (indexFrom ==  8) config_profile_default_rts(            profile);
+    if (indexFrom ==  9) config_profile_default_custom(         profile);
+    if (indexFrom == 10) config_profile_default_custom(         profile);
+    if (indexFrom == 11) config_profile_default_custom(         profile);
+    if (indexFrom == 12) config_profile_default_custom(         profile);
+    if (indexFrom == 13) config_profile_default_console_legacy( profile);
     // Add number to the name of the default custom profiles.
     if (indexTo >= 9 && indexTo<=12) {
-        char *name = config_profile_cache[indexTo].sections[SECTION_META].meta.name;
+        char *name = profile->sections[SECTION_META].meta.name;
         char custom_name[9];  // Custom=6 +space +digit +nullterm.
         snprintf(custom_name, 9, "Custom %i", indexTo-8);
         memcpy(name, custom_name, sizeof(custom_name));
@@ -599,26 +816,38 @@ void config_profile_overwrite(uint8_t indexTo, int8_t indexFrom) {
     debug("Config: Profile overwrite %i -> %i\n", indexFrom, indexTo);
     // Remember name.
     char name[24];
-    CtrlProfileMeta *meta = &(config_profile_cache[indexTo]).sections[SECTION_META].meta;
-    memcpy(name, meta->name, 24);
+    memcpy(name, config_profile_read(indexTo)->sections[SECTION_META].meta.name, 24);
     // From default.
     if (indexFrom < 0) {
         config_profile_default(indexTo, -indexFrom);
     }
     // From other profile slot.
     if (indexFrom > 0) {
-        memcpy(
-            &config_profile_cache[indexTo],
-            &config_profile_cache[indexFrom],
-            sizeof(CtrlProfile)
-        );
+        // Get the destination first, since it may evict the source overlay
+        // (the source is then read from flash).
+        CtrlProfile *to = config_profile_edit(indexTo);
+        const CtrlProfile *from = config_profile_read(indexFrom);
+        memcpy(to, from, sizeof(CtrlProfile));
     }
     // Restore name.
+    CtrlProfileMeta *meta = &(config_profile_edit(indexTo)->sections[SECTION_META].meta);
     memcpy(meta->name, name, 24);
 }
 
+void config_profile_replay(uint8_t index) {
+    // Replay the journaled sections of a profile over the one in flash, into
+    // an overlay (not flagged as modified, there is nothing to save).
+    debug("Config: Profile %i replay from journal\n", index);
+    config_profile_edit(index);
+    config_profile_overlay_dirty[config_profile_overlay_find(index)] = 0;
+}
+
 void config_init_profiles_from_nvm() {
     info("NVM: Loading profiles\n");
+    // Sections journaled before the last power off.
+    for(uint8_t i=0; i<NVM_PROFILE_SLOTS; i++) {
+        if (config_profile_is_journaled(i)) config_profile_replay(i);
+    }
     for(uint8_t i=0; i<NVM_PROFILE_SLOTS; i++) {
         config_profile_load(i);
     }
@@ -4,9 +4,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include "ctrl.h"
+#include "nvm.h"
 #include "config.h"
 #include "version.h"
 #include "logging.h"
+#include "wireless.h"
+#include "webusb.h"
 
 Ctrl ctrl_empty() {
     // For some reason, the very first USB message goes to "waste" and ignored
@@ -39,7 +42,7 @@ Ctrl ctrl_status_share() {
         .protocol_flags = CTRL_FLAG_NONE,
         .device_id = ALPAKKA,
         .message_type = STATUS_SHARE,
-        .len = 3
+        .len = 11
     };
     char version[] = VERSION;
     char *version_temp = version;
@@ -50,6 +53,40 @@ Ctrl ctrl_status_share() {
     ctrl.payload[0] = atoi(strsep(&semantic, dot));  // Version major.
     ctrl.payload[1] = atoi(strsep(&semantic, dot));  // Version mid.
     ctrl.payload[2] = atoi(strsep(&semantic, dot));  // Version minor.
+    // Bytes written to NVM since boot.
+    uint32_t nvm_bytes = nvm_get_bytes_written();
+    memcpy(&ctrl.payload[3], &nvm_bytes, 4);
+    // Responses dropped since boot.
+    uint32_t dropped = webusb_get_tx_overflows();
+    memcpy(&ctrl.payload[7], &dropped, 4);
+    return ctrl;
+}
+
+Ctrl ctrl_link_share() {
+    Ctrl ctrl = {
+        .protocol_flags = CTRL_FLAG_NONE,
+        .device_id = ALPAKKA,
+        .message_type = LINK_SHARE,
+        .len = 52
+    };
+    WirelessStats wireless = wireless_get_stats();
+    UartLinkStats link = uart_get_stats();
+    uint32_t values[13] = {
+        wireless.srtt,
+        wireless.rttvar,
+        wireless.rto,
+        wireless.tracked,
+        wireless.acked,
+        wireless.retransmits,
+        wireless.failed,
+        link.tx_frames,
+        link.tx_dropped,
+        link.rx_frames,
+        link.rx_corrupted,
+        link.rx_lost,
+        link.version,
+    };
+    memcpy(ctrl.payload, values, sizeof(values));  // Little endian.
     return ctrl;
 }
 
@@ -166,8 +203,8 @@ Ctrl ctrl_section_share(uint8_t profile_index, uint8_t section_index) {
     };
     // Profile section struct cast into packed int array.
     // Note that section structs must be guaranteed to be packed.
-    CtrlProfile *profile = config_profile_read(profile_index);
-    uint8_t *section = (uint8_t*)&(profile->sections[section_index]);
+    const CtrlProfile *profile = config_profile_read(profile_index);
+    const uint8_t *section = (const uint8_t*)&(profile->sections[section_index]);
     // Write payload.
     ctrl.payload[0] = profile_index;
     ctrl.payload[1] = section_index;
@@ -176,3 +213,44 @@ Ctrl ctrl_section_share(uint8_t profile_index, uint8_t section_index) {
     }
     return ctrl;
 }
+
+Ctrl ctrl_profile_share(uint8_t profile_index, uint8_t section_index) {
+    // Same as section share, but as part of a bulk transfer.
+    Ctrl ctrl = ctrl_section_share(profile_index, section_index);
+    ctrl.message_type = PROFILE_SHARE;
+    return ctrl;
+}
+
+Ctrl ctrl_profile_ack(uint8_t profile_index, uint8_t section_index) {
+    Ctrl ctrl = {
+        .protocol_flags = CTRL_FLAG_NONE,
+        .device_id = ALPAKKA,
+        .message_type = PROFILE_ACK,
+        .len = 2
+    };
+    ctrl.payload[0] = profile_index;
+    ctrl.payload[1] = section_index;
+    return ctrl;
+}
+
+Ctrl ctrl_profile_end(uint8_t profile_index, uint16_t crc, uint8_t status) {
+    Ctrl ctrl = {
+        .protocol_flags = CTRL_FLAG_NONE,
+        .device_id = ALPAKKA,
+        .message_type = PROFILE_END,
+        .len = 5
+    };
+    ctrl.payload[0] = profile_index;
+    ctrl.payload[1] = CTRL_BULK_LAST - CTRL_BULK_FIRST + 1;
+    ctrl.payload[2] = crc & 0xFF;
+    ctrl.payload[3] = crc >> 8;
+    ctrl.payload[4] = status;
+    return ctrl;
+}
+
+uint16_t ctrl_profile_crc(const CtrlProfile *profile) {
+    // CRC of all the sections of a bulk transfer, in order.
+    const uint8_t *first = (const uint8_t*)&(profile->sections[CTRL_BULK_FIRST]);
+    uint32_t len = (CTRL_BULK_LAST - CTRL_BULK_FIRST + 1) * sizeof(CtrlSection);
+    return crc16(CRC16_INIT, first, len);
+}
@@ -1,5 +1,6 @@
 #include "fsm.h"
 #include "config.h"
+#include "logging.h"
 
 // Identifier for State Handler functions
 typedef enum _Handler {
@@ -33,7 +34,7 @@ ActivationState REST__OnRelease(Fsm *self, FsmEvent *event, Mapping *active_mapp
 
 ActivationState START__OnEntry(Fsm *self, FsmEvent *event, Mapping *active_mapping) {
     // update chord state
-    info("How many mappings do I have? %d\n", active_mapping->count);
+    mapping_trace("How many mappings do I have? %d\n", active_mapping->count);
     processEvent(active_mapping, OnPress);
     self->timestamp = event->now; // Mark start press time
     return self->activation_state;
@@ -41,7 +42,7 @@ ActivationState START__OnEntry(Fsm *self, FsmEvent *event, Mapping *active_mappi
 
 ActivationState START__OnPress(Fsm *self, FsmEvent *event, Mapping *active_mapping) {
     uint64_t hold_time = self->long_hold? CFG_HOLD_LONG_TIME : CFG_HOLD_TIME;
-    if (event->now - self->timestamp > hold_time)
+    if (event->now - self->timestamp > hold_time * 1000)
     {
         // Button was held for long enough
         return ACT_HOLD;
@@ -73,7 +74,7 @@ ActivationState TAP__OnPress(Fsm *self, FsmEvent *event, Mapping *active_mapping
 ActivationState TAP__OnRelease(Fsm *self, FsmEvent *event, Mapping *active_mapping)
 {
     // Stay in this state until pulses have finished processing
-    if (event->now - self->timestamp > CFG_PULSE_TIME)
+    if (event->now - self->timestamp > CFG_PULSE_TIME * 1000)
     {
         return ACT_REST;
     }
@@ -93,7 +94,7 @@ ActivationState HOLD__OnEntry(Fsm *self, FsmEvent *event, Mapping *active_mappin
 
 ActivationState HOLD__OnPress(Fsm *self, FsmEvent *event, Mapping *active_mapping)
 {
-    if (event->now - self->timestamp > CFG_TURBO_TIME) {
+    if (event->now - self->timestamp > CFG_TURBO_TIME * 1000) {
         processEvent(active_mapping, OnTurbo);
         self->timestamp = event->now;
     }
@@ -137,7 +138,7 @@ void fsm__handle_mapping_event(Fsm *self, FsmEvent *event, Mapping *active_mappi
         active_mapping, event->is_pressed? DO_PRESS : DO_RELEASE);
  
     if (next_state != self->activation_state) {
-        info("State change from %d to %d\n", self->activation_state, next_state);
+        mapping_trace("State change from %d to %d\n", self->activation_state, next_state);
         // state change requested by the handler!
         // Call the exit handler of the current state
         Fsm__call_activation_state_handler(self, event, active_mapping, DO_EXIT);
@@ -202,7 +203,13 @@ ButtonState DBL_PRESS_START_ON_EVENT(Fsm *self, FsmEvent *event)
     }
     if (self->activation_state == ACT_REST)
     {
-        return event->now - self->timestamp < CFG_DOUBLE_PRESS_TIME ? BTN_DBL_PRESS_NO_PRESS : BTN_NO_PRESS;
+        if (event->now - self->timestamp < CFG_DOUBLE_PRESS_TIME * 1000)
+        {
+            return BTN_DBL_PRESS_NO_PRESS;
+        }
+        // Too late for a double press, process any Tap actions now
+        fsm__handle_mapping_event(self, event, &self->press_actions);
+        return self->activation_state == ACT_REST ? BTN_NO_PRESS : BTN_PRESS;
     }
     return self->current_state;
 }
@@ -215,7 +222,7 @@ ButtonState DBL_PRESS_NO_PRESS__OnPress(Fsm *self, FsmEvent *event)
 
 ButtonState DBL_PRESS_NO_PRESS__OnRelease(Fsm *self, FsmEvent *event)
 {
-    if (event->now - self->timestamp > CFG_DOUBLE_PRESS_TIME)
+    if (event->now - self->timestamp > CFG_DOUBLE_PRESS_TIME * 1000)
     {
         // Process any Tap actions now that the double press window has passed
         fsm__handle_mapping_event(self, event, &self->press_actions);
@@ -274,7 +281,7 @@ void fsm__handle_event(Fsm *self, FsmEvent *event)
         event->is_pressed? DO_PRESS : DO_RELEASE);
  
     if (next_state != self->current_state) {
-        info("State change from %d to %d\n", self->current_state, next_state);
+        mapping_trace("State change from %d to %d\n", self->current_state, next_state);
         // state change requested by the handler!
         // Call the exit handler of the current state
         Fsm__call_button_state_handler(self, event, DO_EXIT);
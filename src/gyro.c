@@ -48,8 +48,8 @@ void gyro_accel_correction() {
         Vector4 correction_fw = quaternion(world_fw, rate_fw);
         Vector4 correction_r = quaternion(world_right, -rate_r);
         Vector4 correction = qmultiply(correction_fw, correction_r);
-        world_top = qrotate(correction, world_top);
-        world_right = qrotate(correction, world_right);
+        world_top = qrotate_fast(correction, world_top);
+        world_right = qrotate_fast(correction, world_right);
         world_fw = vector_cross_product(world_top, world_right);
     }
 }
@@ -84,7 +84,7 @@ void gyro_absolute_output(float value, uint8_t *actions, bool *pressed) {
     }
 }
 
-void gyro_incremental_output(double value, uint8_t *actions) {
+void gyro_incremental_output(int16_t value, uint8_t *actions) {
     for(uint8_t i=0; i<4; i++) {
         uint8_t action = actions[i];
         if      (action == MOUSE_X)     hid_mouse_move(value, 0);
@@ -100,16 +100,24 @@ double hssnf(double t, double k, double x) {
     return a / b;
 }
 
+// Apply the slow-movement curve symmetrically on both signs.
+double gyro_curve(double t, double k, double x) {
+    if      (x > 0 && x <  t) return  hssnf(t, k,  x);
+    else if (x < 0 && x > -t) return -hssnf(t, k, -x);
+    else return x;
+}
+
 void Gyro__report_absolute(Gyro *self) {
     // Accel-based correction.
     gyro_accel_correction();
     // Get data from gyros.
     Vector gyro = imu_read_gyro();
-    static float sens = -BIT_18 * M_PI;
+    static float sens = -BIT_18 * (float)M_PI;
     // Rotate world space orientation.
-    Vector4 rx = quaternion(world_right, gyro.y / sens);
-    Vector4 ry = quaternion(world_fw, gyro.z / sens);
-    Vector4 rz = quaternion(world_top, gyro.x / sens);
+    float dt = imu_gyro_dt_factor();
+    Vector4 rx = quaternion(world_right, gyro.y * dt / sens);
+    Vector4 ry = quaternion(world_fw, gyro.z * dt / sens);
+    Vector4 rz = quaternion(world_top, gyro.x * dt / sens);
     static uint8_t i = 0;
     Vector4 r;
     if      (i==0) r = qmultiply(qmultiply(rx, ry), rz);
@@ -120,8 +128,8 @@ void Gyro__report_absolute(Gyro *self) {
     else if (i==5) r = qmultiply(qmultiply(rz, ry), rx);
     i++;
     if (i>5) i = 0;
-    world_top = qrotate(r, world_top);
-    world_fw = qrotate(r, world_fw);
+    world_top = qrotate_fast(r, world_top);
+    world_fw = qrotate_fast(r, world_fw);
     world_right = vector_cross_product(world_fw, world_top);
     // Debug.
     bool debug = 0;
@@ -133,9 +141,9 @@ void Gyro__report_absolute(Gyro *self) {
         return;
     }
     // Output calculation.
-    float x = degrees(asin(-world_right.z)) / 90;
-    float y = degrees(asin(-world_top.z)) / 90;
-    float z = degrees(asin(world_fw.z)) / 90;
+    float x = degrees(asinf(-world_right.z)) / 90;
+    float y = degrees(asinf(-world_top.z)) / 90;
+    float z = degrees(asinf(world_fw.z)) / 90;
     if (fabs(x) > 0.5 && z < 0) x += -z * 2 * sign(x); // Steering lock.
     x = constrain(x * 1.1, -1, 1); // Additional saturation.
     x = ramp(x, self->absolute_x_min/90, self->absolute_x_max/90); // Adjust range.
@@ -149,31 +157,37 @@ void Gyro__report_absolute(Gyro *self) {
 }
 
 void Gyro__report_incremental(Gyro *self) {
-    static double sub_x = 0;
-    static double sub_y = 0;
-    static double sub_z = 0;
-     // Read gyro values.
-    Vector imu_gyro = imu_read_gyro();
-    double x = imu_gyro.x * CFG_GYRO_SENSITIVITY_X * sensitivity_multiplier;
-    double y = imu_gyro.y * CFG_GYRO_SENSITIVITY_Y * sensitivity_multiplier;
-    double z = imu_gyro.z * CFG_GYRO_SENSITIVITY_Z * sensitivity_multiplier;
-    // Additional processing.
-    double t = 1.0;
+    // Subpixel leftovers, as fixed point integers.
+    static int32_t sub_x = 0;
+    static int32_t sub_y = 0;
+    static int32_t sub_z = 0;
+    // Read gyro values.
+    Vector batches[CFG_IMU_TICK_BATCHES];
+    imu_read_gyro_batches(batches);
+    // Each batch element accounts for a fraction of the tick movement, so the
+    // curve threshold is scaled by the same fraction. With constant motion the
+    // result is the same as processing the tick average, but fast changes
+    // within the tick are not distorted by the curve.
+    // Rates (and the curve threshold) are scaled by the real time elapsed
+    // since the previous read.
+    double dt = imu_gyro_dt_factor();
+    double sens_x = CFG_GYRO_SENSITIVITY_X * sensitivity_multiplier * dt / CFG_IMU_TICK_BATCHES;
+    double sens_y = CFG_GYRO_SENSITIVITY_Y * sensitivity_multiplier * dt / CFG_IMU_TICK_BATCHES;
+    double sens_z = CFG_GYRO_SENSITIVITY_Z * sensitivity_multiplier * dt / CFG_IMU_TICK_BATCHES;
+    double t = dt / CFG_IMU_TICK_BATCHES;
     double k = 0.5;
-    if      (x > 0 && x <  t) x =  hssnf(t, k,  x);
-    else if (x < 0 && x > -t) x = -hssnf(t, k, -x);
-    if      (y > 0 && y <  t) y =  hssnf(t, k,  y);
-    else if (y < 0 && y > -t) y = -hssnf(t, k, -y);
-    if      (z > 0 && z <  t) z =  hssnf(t, k,  z);
-    else if (z < 0 && z > -t) z = -hssnf(t, k, -z);
-    // Reintroduce subpixel leftovers.
-    x += sub_x;
-    y += sub_y;
-    z += sub_z;
-    // Round down and save leftovers.
-    sub_x = modf(x, &x);
-    sub_y = modf(y, &y);
-    sub_z = modf(z, &z);
+    for(uint8_t i=0; i<CFG_IMU_TICK_BATCHES; i++) {
+        sub_x += gyro_curve(t, k, batches[i].x * sens_x) * GYRO_SUBPIXEL_SCALE;
+        sub_y += gyro_curve(t, k, batches[i].y * sens_y) * GYRO_SUBPIXEL_SCALE;
+        sub_z += gyro_curve(t, k, batches[i].z * sens_z) * GYRO_SUBPIXEL_SCALE;
+    }
+    // Round down (towards zero) and keep leftovers.
+    int32_t x = sub_x / GYRO_SUBPIXEL_SCALE;
+    int32_t y = sub_y / GYRO_SUBPIXEL_SCALE;
+    int32_t z = sub_z / GYRO_SUBPIXEL_SCALE;
+    sub_x -= x * GYRO_SUBPIXEL_SCALE;
+    sub_y -= y * GYRO_SUBPIXEL_SCALE;
+    sub_z -= z * GYRO_SUBPIXEL_SCALE;
     // Report.
     if (x >= 0) gyro_incremental_output( x, self->actions_x_pos);
     else        gyro_incremental_output(-x, self->actions_x_neg);
@@ -189,12 +203,22 @@ bool Gyro__is_engaged(Gyro *self) {
     return self->engage_button.is_pressed(&(self->engage_button));
 }
 
+// Finger approaching the touch surface, read the gyro every tick (instead of
+// sparsely) so the first engaged tick has a valid time reference and a bias
+// tracker fed with the current motion.
+bool Gyro__is_ready(Gyro *self) {
+    return self->engage == PIN_TOUCH_IN && touch_confidence() >= GYRO_TOUCH_READY;
+}
+
 void Gyro__report(Gyro *self) {
     if (self->mode == GYRO_MODE_TOUCH_ON) {
         if (self->is_engaged(self)) self->report_incremental(self);
+        else if (Gyro__is_ready(self)) imu_read_gyro();
+        else imu_bias_idle();
     }
     else if (self->mode == GYRO_MODE_TOUCH_OFF) {
         if (!self->is_engaged(self)) self->report_incremental(self);
+        else imu_bias_idle();
     }
     else if (self->mode == GYRO_MODE_ALWAYS_ON) {
         self->report_incremental(self);
@@ -44,8 +44,9 @@ uint8_t bus_i2c_read_one(uint8_t device, uint8_t reg);
 uint16_t bus_i2c_read_two(uint8_t device, uint8_t reg);
 
 // IO expanders.
+extern uint16_t io_cache_0;
+extern uint16_t io_cache_1;
 void bus_i2c_io_cache_update();
-bool bus_i2c_io_cache_read(uint8_t device_index, uint8_t bit_index);
 bool bus_i2c_io_read(uint8_t device_id, uint8_t bit_index);
 
 // SPI.
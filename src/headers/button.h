@@ -9,6 +9,13 @@
 #include "mapping.h"
 #include "fsm.h"
 
+// Layout of the digital inputs vector.
+#define BUTTON_INPUT_BOARD_MASK 0x3FFFFFFF  // Pico GPIOs, bits 0 to 29.
+#define BUTTON_INPUT_BOARD_LAST 29  // Highest Pico GPIO.
+#define BUTTON_INPUT_IO_0 32  // 1st IO expander, bits 32 to 47.
+#define BUTTON_INPUT_IO_1 48  // 2nd IO expander, bits 48 to 63.
+#define BUTTON_INPUT_IO_PINS 16  // Inputs of each IO expander.
+
 typedef enum _ButtonMode {
     NORMAL = 1,
     HOLD = 2,
@@ -31,10 +38,18 @@ struct Button_struct {
     Actions actions_secondary;
     bool state_primary;
     bool virtual_press;
-    uint64_t press_timestamp;
+    uint64_t input_mask;
     Fsm fsm;
 };
 
+void button_input_update();
+bool button_is_board_pin(uint8_t pin);
+uint64_t button_input_mask(uint8_t pin);
+
+extern uint64_t button_input;
+extern uint64_t button_input_suppress;
+extern uint64_t button_input_force;
+
 Button Button_ (
     uint8_t pin,
     ButtonMode mode,
@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "mapping.h"
+
+#define CHORD_MAX 9  // Chords per profile.
+#define CHORD_WINDOW_DEFAULT 50  // Milliseconds.
+#define CHORD_FORWARD_SAMPLES 2  // Samples a held back tap is forwarded for.
+
+typedef enum ChordState_enum {
+    CHORD_IDLE,     // No member pressed.
+    CHORD_PENDING,  // One member pressed, waiting for the other (held back).
+    CHORD_PASS,     // Member press resolved as a single button press.
+    CHORD_ACTIVE,   // Both members pressed, chord actions engaged.
+    CHORD_FORWARD,  // Member released while held back, forwarding the tap.
+} ChordState;
+
+typedef struct Chord_struct Chord;
+struct Chord_struct {
+    void (*report) (Chord *self);
+    void (*reset) (Chord *self);
+    uint64_t mask_a;  // Input vector bit of each member.
+    uint64_t mask_b;
+    uint64_t first;  // Member that was pressed first.
+    uint64_t timestamp;
+    uint32_t window;  // Microseconds.
+    uint8_t forward;  // Samples left forwarding the tap.
+    bool speculative;
+    ChordState state;
+    Actions actions;
+};
+
+Chord Chord_(
+    uint64_t mask_a,
+    uint64_t mask_b,
+    Actions actions,
+    uint8_t window,
+    bool speculative
+);
@@ -16,6 +16,8 @@
 #define BIT_8 255
 #define BIT_7 127
 
+#define CRC16_INIT 0xFFFF
+
 #define min(a, b)  ((a < b) ? a : b)
 #define max(a, b)  ((a > b) ? a : b)
 #define constrain(value, low, high)  max(low, min(high, value))
@@ -23,8 +25,8 @@
 #define sign(value)  ( value >= 0 ? 1 : -1 )
 #define smooth(smoothed, value, factor)  ( (smoothed*factor + value) / (factor+1) )
 
-#define degrees(radians)  ( radians * 180.0 / M_PI )
-#define radians(degrees)  ( degrees * M_PI / 180.0 )
+#define degrees(radians)  ( (radians) * (float)(180.0 / M_PI) )
+#define radians(degrees)  ( (degrees) * (float)(M_PI / 180.0) )
 
 // Safe +1 increment saturating at max value (without wrapping).
 #define nowrap_u8_increment(x)  do { if ((x) < UINT8_MAX) (x)++; } while (0)
@@ -67,4 +69,5 @@ void print_array(uint8_t *array, uint8_t len);
 #define ramp(x, min, max)  constrain( 2 * ((x-min) / (max-min)) - 1, -1, 1)
 
 void print_array(uint8_t *array, uint8_t len);
+uint16_t crc16(uint16_t crc, const uint8_t *data, uint32_t len);
 uint8_t bitmask_set(uint8_t bitmask, uint8_t flag, bool value);
@@ -18,6 +18,9 @@
 
 #define NVM_PROFILE_SIZE 4096
 #define NVM_PROFILE_SLOTS 14
+#define NVM_PROFILE_OVERLAYS 2  // Profiles with unsaved changes kept in RAM.
+#define NVM_PROFILE_QUIET_TIME 1000  // Milliseconds without edits before saving.
+#define NVM_PROFILE_JOURNAL_SECTIONS 4  // Modified sections journaled, if more the whole profile is written.
 
 #define NVM_CONFIG_VERSION        ((MAJOR * 1) + (MINOR * 1) + (PATCH * 0))
 #define NVM_HOME_PROFILE_VERSION  ((MAJOR * 1) + (MINOR * 1) + (PATCH * 0))
@@ -32,6 +35,7 @@
 #endif
 
 #define CFG_IMU_TICK_SAMPLES 128  // Multi-sampling per pooling cycle.
+#define CFG_IMU_TICK_BATCHES 8  // Sub-divisions of the multi-sampling processed individually.
 
 #define CFG_TICK_INTERVAL_IN_MS  (1000 / CFG_TICK_FREQUENCY)
 #define CFG_TICK_INTERVAL_IN_US  (1000000 / CFG_TICK_FREQUENCY)
@@ -53,7 +57,6 @@
 #define CFG_ACCEL_CORRECTION_SMOOTH 50  // Number of averaged samples for the correction vector.
 #define CFG_ACCEL_CORRECTION_RATE 0.0007  // How fast the correction is applied.
 
-#define CFG_PRESS_DEBOUNCE 50  // Milliseconds.
 #define CFG_HOLD_TIME 200  // Milliseconds.
 #define CFG_TURBO_TIME 80  // Milliseconds.
 #define CFG_HOLD_LONG_TIME 2000  // Milliseconds.
@@ -76,6 +79,13 @@ typedef enum _Problem {
     PROBLEM_LOW_BATTERY = 4,
 } Problem;
 
+// Profile as stored in its flash sector, followed by the journal sequence up to
+// which the journaled sections are included in it.
+typedef struct __packed _ConfigProfileSector {
+    CtrlProfile profile;
+    uint32_t seq;
+} ConfigProfileSector;
+
 typedef struct __packed _Config {
     uint8_t header;
     uint32_t config_version;
@@ -166,9 +176,11 @@ void config_set_thumbstick_smooth_samples(uint8_t value);
 // Profiles.
 uint8_t config_get_profile();
 void config_set_profile(uint8_t profile);
-CtrlProfile* config_profile_read(uint8_t index);
+const CtrlProfile* config_profile_read(uint8_t index);
+CtrlProfile* config_profile_edit(uint8_t index);
+bool config_profile_set_section(uint8_t index, uint8_t section, const uint8_t *data);
 void config_profile_write(uint8_t index);
-void config_profile_set_sync(uint8_t index, bool state);
+void config_profile_compact();
 void config_profile_default_all();
 void config_profile_default(uint8_t indexTo, int8_t indexFrom);
 void config_profile_default_home(CtrlProfile *profile);
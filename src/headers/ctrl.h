@@ -31,8 +31,31 @@ typedef enum Ctrl_msg_type_enum {
     STATUS_SET,
     STATUS_SHARE,
     PROFILE_OVERWRITE,
+    PROFILE_GET,
+    PROFILE_SET,
+    PROFILE_SHARE,
+    PROFILE_ACK,
+    PROFILE_END,
+    LOG_BINARY,
+    TELEMETRY_SET,
+    TELEMETRY_FRAME,
+    LINK_GET,
+    LINK_SHARE,
 } Ctrl_msg_type;
 
+#define CTRL_PROFILE_SECTIONS 64  // Sections in a profile.
+
+// Bulk profile transfers (PROFILE_GET / PROFILE_SET).
+#define CTRL_BULK_FIRST 1  // First section index transferred.
+#define CTRL_BULK_LAST 63  // Last section index transferred.
+#define CTRL_BULK_WINDOW 8  // Default sections in flight without ack.
+
+typedef enum Ctrl_bulk_status_enum {
+    CTRL_BULK_OK = 1,
+    CTRL_BULK_ERROR_CRC,
+    CTRL_BULK_ERROR_MISSING,
+} Ctrl_bulk_status;
+
 typedef enum Ctrl_cfg_type_enum {
     PROTOCOL = 1,
     SENS_TOUCH,
@@ -109,6 +132,8 @@ typedef enum CtrlSectionType_enum {
     SECTION_MACRO_2,
     SECTION_MACRO_3,
     SECTION_MACRO_4,
+    SECTION_CHORDS = 62,
+    SECTION_LAYERS,
 } CtrlSectionType;
 
 typedef struct _Ctrl {
@@ -215,6 +240,32 @@ typedef struct __packed _CtrlMacro {
     uint8_t _padding[2];
 } CtrlMacro;
 
+typedef struct __packed _CtrlChord {
+    uint8_t section_a;  // Button section index of the 1st member.
+    uint8_t section_b;  // Button section index of the 2nd member.
+    uint8_t actions[4];
+} CtrlChord;
+
+typedef struct __packed _CtrlChords {
+    // Must be packed (58 bytes).
+    uint8_t window;  // Milliseconds, zero for default.
+    uint8_t speculative;
+    CtrlChord chords[9];
+    uint8_t _padding[2];
+} CtrlChords;
+
+typedef struct __packed _CtrlLayer {
+    uint8_t section;  // Button section index of the trigger.
+    uint8_t mode;  // LayerMode.
+    uint8_t profile;  // Profile index used as layer.
+} CtrlLayer;
+
+typedef struct __packed _CtrlLayers {
+    // Must be packed (58 bytes).
+    CtrlLayer layers[4];
+    uint8_t _padding[46];
+} CtrlLayers;
+
 typedef union _CtrlSection {
     CtrlProfileMeta meta;
     CtrlButton button;
@@ -225,16 +276,23 @@ typedef union _CtrlSection {
     CtrlGyro gyro;
     CtrlGyroAxis gyro_axis;
     CtrlMacro macro;
+    CtrlChords chords;
+    CtrlLayers layers;
 } CtrlSection;
 
 typedef struct _CtrlProfile {
-    CtrlSection sections[64];
+    CtrlSection sections[CTRL_PROFILE_SECTIONS];
 } CtrlProfile;
 
 Ctrl ctrl_empty();
 Ctrl ctrl_log(uint8_t* offset_ptr, uint8_t len);
 Ctrl ctrl_status_share();
+Ctrl ctrl_link_share();
 Ctrl ctrl_config_share(uint8_t index);
 Ctrl ctrl_section_share(uint8_t profile_index, uint8_t section_index);
+Ctrl ctrl_profile_share(uint8_t profile_index, uint8_t section_index);
+Ctrl ctrl_profile_ack(uint8_t profile_index, uint8_t section_index);
+Ctrl ctrl_profile_end(uint8_t profile_index, uint16_t crc, uint8_t status);
+uint16_t ctrl_profile_crc(const CtrlProfile *profile);
 
 void ctrl_config_set(Ctrl_cfg_type key, uint8_t preset, uint8_t values[5]);
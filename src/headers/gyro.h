@@ -3,6 +3,9 @@
 
 #pragma once
 
+#define GYRO_SUBPIXEL_SCALE 65536  // Fixed point factor of the subpixel accumulators.
+#define GYRO_TOUCH_READY 0.5  // Touch confidence to read the gyro every tick before engage.
+
 typedef enum GyroMode_enum {
     GYRO_MODE_OFF,
     GYRO_MODE_ALWAYS_ON,
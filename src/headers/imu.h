@@ -10,12 +10,15 @@
 #define IMU_CTRL2_G 0x11  // Gyroscope config address.
 #define IMU_CTRL3_C 0x12  // IMU config address.
 #define IMU_CTRL8_XL 0x17  // Accelerometer filter config address.
+#define IMU_CTRL10_C 0x19  // Timestamp config address.
 #define IMU_OUTX_L_G 0x22  // Gyroscope read X address.
 #define IMU_OUTY_L_G 0x24  // Gyroscope read Y address.
 #define IMU_OUTZ_L_G 0x26  // Gyroscope read Z address.
 #define IMU_OUTX_L_XL 0x28  // Accelerometer read X address.
 #define IMU_OUTY_L_XL 0x30  // Accelerometer read Y address.
 #define IMU_OUTZ_L_XL 0x2A  // Accelerometer read Z address.
+#define IMU_TIMESTAMP0 0x40  // Timestamp read address (4 bytes).
+#define IMU_INTERNAL_FREQ_FINE 0x63  // Internal oscillator deviation address.
 
 #define IMU_READ 0b10000000  // Read byte.
 #define IMU_CTRL1_XL_OFF 0b00000000  // Accelerometer value power off.
@@ -24,13 +27,33 @@
 #define IMU_CTRL2_G_OFF  0b00000000  // Gyroscope value power off.
 #define IMU_CTRL2_G_125  0b10100010  // Gyroscope value for 125 dps.
 #define IMU_CTRL2_G_500  0b10100100  // Gyroscope value for 500 dps.
+#define IMU_CTRL10_C_TIMESTAMP 0b00100000  // Timestamp counter enabled.
+
+#define IMU_TIMESTAMP_RES 25.0  // Microseconds, nominal timestamp resolution.
+#define IMU_TIMESTAMP_FREQ_FINE 0.0015  // Timestamp frequency deviation per FREQ_FINE unit.
+#define IMU_DT_MAX_FACTOR 4  // Larger gaps between reads are not integrated.
 
 #define GYRO_USER_OFFSET_FACTOR 1.5
 
+// Online gyro bias tracking.
+#define IMU_BIAS_WINDOW 250  // Gyro reads per rest evaluation (1 second when read every tick).
+#define IMU_BIAS_IDLE_DIVIDER 4  // Read gyro every N ticks while not engaged, only for bias tracking.
+#define IMU_BIAS_REST_STDEV_0 1.0  // LSB, max noise considered rest (500 dps IMU).
+#define IMU_BIAS_REST_STDEV_1 4.0  // LSB, max noise considered rest (125 dps IMU).
+#define IMU_BIAS_MAX_DRIFT_0 10.0  // LSB, larger residuals are considered motion (500 dps IMU).
+#define IMU_BIAS_MAX_DRIFT_1 40.0  // LSB, larger residuals are considered motion (125 dps IMU).
+#define IMU_BIAS_REST_ACCEL 200  // LSB, max accel spread considered rest (~0.012G).
+#define IMU_BIAS_RATE 0.2  // Portion of the residual incorporated into the offset per window.
+#define IMU_BIAS_PERSIST_INTERVAL 300000  // Milliseconds (5 minutes).
+#define IMU_BIAS_PERSIST_MIN_DELTA 2.0  // LSB, accumulated change required to persist.
+
 void imu_init();
 void imu_power_off();
 Vector imu_read_gyro();
+void imu_read_gyro_batches(Vector *batches);
+float imu_gyro_dt_factor();
 Vector imu_read_accel();
 void imu_load_calibration();
 void imu_calibrate();
+void imu_bias_idle();
 
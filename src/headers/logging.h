@@ -2,6 +2,18 @@
 // Copyright (C) 2022, Input Labs Oy.
 
 #pragma once
+#include <stdint.h>
+
+// Binary logging: instead of formatting the messages on the device, log
+// records are sent with the address of the format string, a timestamp and the
+// raw arguments, and formatted on the host from the firmware ELF (see
+// scripts/log_decode.py). Logs are then sent as LOG_BINARY Ctrl messages, and
+// not printed to UART.
+// #define LOGGING_BINARY
+
+#define LOG_BINARY_HEADER_SIZE 10  // Bytes.
+#define LOG_BINARY_RECORD_MAX 64  // Bytes.
+#define LOG_BINARY_STRING_MAX 16  // Bytes, for string arguments.
 
 typedef enum _LogLevel {
     LOG_INFO,
@@ -43,32 +43,52 @@ typedef enum _ButtonEvent {
 // The signature of any callback actions
 typedef void (*EventAction_Callback_fn)(uint8_t);
 
-// A callback functor object with stored parameter
-typedef struct EventAction_Callback_s
+// Functions that can be bound to an event, stored as an index into a static
+// table to keep the mappings (one per button and profile) small.
+typedef enum _MappingFunction {
+    FUNC_NONE = 0,
+    FUNC_PRESS,
+    FUNC_RELEASE,
+    FUNC_TOGGLE,
+    FUNC_PULSE,
+    FUNC_TURBO,
+    MappingFunction_SIZE,
+} MappingFunction;
+
+// Actions bound to a single event: one function called for up to ACTIONS_LEN
+// keys (packed at the start, KEY_NONE terminated).
+typedef struct EventActions_s
 {
-    ButtonEvent event;
-    EventAction_Callback_fn func;
-    Actions param;
-} EventAction_Callback;
-
-#define MAPPING_SIZE 3 // 5 is too much
+    uint8_t func;  // MappingFunction.
+    Actions keys;
+} EventActions;
 
 // This structure handles the mapping of a button, buy processing and action
-// to be done on tap, hold, turbo and others. It holds a map of actions to perform
-// when a specific event happens. This replaces the old Mapping structure.
+// to be done on tap, hold, turbo and others. The actions registered with
+// addMapping are compiled (at profile load) into a dense table indexed
+// directly by ButtonEvent, so dispatching an event does not require any
+// search.
 typedef struct Mapping_s
 {
-    // Each callback is tied to one event and one function
-    // but can have up to ACTIONS_LEN keys bound to it
-    EventAction_Callback event_mapping[MAPPING_SIZE];
-    int count;
+    EventActions events[NUM_EVENTS + 1];
+    uint8_t count;
 } Mapping;
 
+// Uncomment to log every mapping action and state change (slow, only for
+// debugging the button logic).
+// #define MAPPING_TRACE
+
+#ifdef MAPPING_TRACE
+    #define mapping_trace(...)  info(__VA_ARGS__)
+#else
+    #define mapping_trace(...)
+#endif
+
 // Initialize a mapping structure
 Mapping make_mapping();
 
 // Call all actions bound to this event
-void processEvent(Mapping *self,ButtonEvent evt);
+void processEvent(Mapping *self, ButtonEvent evt);
 
 // Register actions to the proper events for the provided mapping
 bool addMapping(Mapping *self, uint8_t key, EventModifier evtMod, ActionModifier actMod);
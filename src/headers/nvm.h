@@ -2,6 +2,52 @@
 // Copyright (C) 2022, Input Labs Oy.
 
 #pragma once
+#include <pico/stdlib.h>
+
+#define NVM_COMMIT_PAGES_PER_STEP 2  // Flash pages programmed per commit step.
+
+// Journal: append-only log of small records (one flash page each), spread
+// over several sectors used in rotation (wear leveling and garbage
+// collection).
+#define NVM_JOURNAL_ADDR 0x001E0000
+#define NVM_JOURNAL_SECTORS 4
+#define NVM_JOURNAL_SECTOR_SIZE 4096  // Bytes.
+#define NVM_JOURNAL_RECORD_SIZE 256  // Bytes (one flash page).
+#define NVM_JOURNAL_RECORDS (NVM_JOURNAL_SECTOR_SIZE / NVM_JOURNAL_RECORD_SIZE)
+#define NVM_JOURNAL_HEADER_SIZE 14  // Bytes.
+#define NVM_JOURNAL_PAYLOAD (NVM_JOURNAL_RECORD_SIZE - NVM_JOURNAL_HEADER_SIZE)
+#define NVM_JOURNAL_MAGIC 0x324C4E4A
+#define NVM_JOURNAL_KEYS 4  // Keys carried along by the garbage collection.
+
+typedef enum NvmKey_enum {
+    NVM_KEY_CONFIG,
+    // Profile sections, NVM_KEY_PROFILE + (profile * sections) + section. Not
+    // carried along, but compacted into the profiles by the garbage collection
+    // (see config_profile_compact).
+    NVM_KEY_PROFILE = 0x100,
+} NvmKey;
+
+typedef struct __packed _NvmRecord {
+    uint32_t magic;
+    uint32_t seq;  // Monotonic, the highest sequence of a key is the valid one.
+    uint16_t key;
+    uint16_t len;
+    uint16_t crc;  // Over sequence, key, length and payload.
+    uint8_t payload[NVM_JOURNAL_PAYLOAD];
+} NvmRecord;
 
 void nvm_read(uint32_t addr, uint8_t* buffer, uint32_t size);
+const void* nvm_pointer(uint32_t addr);
 void nvm_write(uint32_t addr, uint8_t* buffer, uint32_t size);
+
+void nvm_commit_start(uint32_t addr, const uint8_t* buffer, uint32_t size);
+bool nvm_commit_step();
+bool nvm_commit_is_busy();
+uint32_t nvm_get_stall_max();
+uint32_t nvm_get_bytes_written();
+
+void nvm_journal_init();
+uint32_t nvm_journal_read(NvmKey key, void *buffer, uint8_t size);
+void nvm_journal_write(NvmKey key, const void *buffer, uint8_t size);
+uint32_t nvm_journal_latest(NvmKey first, uint16_t count);
+uint32_t nvm_journal_get_seq();
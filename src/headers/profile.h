@@ -3,6 +3,7 @@
 
 #pragma once
 #include "button.h"
+#include "chord.h"
 #include "thumbstick.h"
 #include "dhat.h"
 #include "rotary.h"
@@ -12,6 +13,19 @@
 #include "config.h"
 
 #define PROFILE_SLOTS 14
+#define PROFILE_NONE 255
+#define PROFILE_LAYERS 4  // Layers per profile.
+
+// Only a few profiles are built (materialized) at any given time, the rest are
+// kept as config only and built on demand when switched to. The layers of the
+// active profile are built together with it, one slot per layer.
+typedef enum ProfilePoolSlot_enum {
+    PROFILE_POOL_HOME,
+    PROFILE_POOL_HOME_GAMEPAD,
+    PROFILE_POOL_ACTIVE,
+    PROFILE_POOL_LAYER,
+    PROFILE_POOL_SIZE = PROFILE_POOL_LAYER + PROFILE_LAYERS,
+} ProfilePoolSlot;
 
 typedef enum ProfileIndex_enum {
     PROFILE_HOME,
@@ -30,11 +44,23 @@ typedef enum ProfileIndex_enum {
     PROFILE_HOME_GAMEPAD,
 } ProfileIndex;
 
+typedef enum LayerMode_enum {
+    LAYER_NONE,
+    LAYER_MOMENTARY,  // Active while the trigger is held.
+    LAYER_TOGGLE,  // Toggled on every trigger press.
+} LayerMode;
+
+typedef struct Layer_struct {
+    uint64_t mask;  // Input vector bit of the trigger.
+    LayerMode mode;
+    uint8_t profile;
+} Layer;
+
 typedef struct Profile_struct Profile;
 struct Profile_struct {
     void (*report) (Profile *self);
     void (*reset) (Profile *self);
-    void (*load_from_config) (Profile *self, CtrlProfile *profile);
+    void (*load_from_config) (Profile *self, const CtrlProfile *profile);
     Button select_1;
     Button select_2;
     Button start_1;
@@ -64,6 +90,8 @@ struct Profile_struct {
     Dhat dhat;
     Rotary rotary;
     Gyro gyro;
+    Chord chords[CHORD_MAX];
+    Layer layers[PROFILE_LAYERS];
 };
 Profile Profile_ ();
 
@@ -79,7 +107,7 @@ void profile_notify_protocol_changed(Protocol protocol);
 void profile_update_leds();
 void profile_enable_all(bool value);
 void profile_enable_abxy(bool value);
-Profile* profile_get(uint8_t index);
+void profile_reload(uint8_t index);
 Profile* profile_get_active(bool strict);
 uint8_t profile_get_active_index(bool strict);
 
@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "ctrl.h"
+#include "vector.h"
+
+#define TELEMETRY_QUEUE_SIZE 16  // Frames waiting to be sent.
+#define TELEMETRY_HEADER_SIZE 9  // Bytes.
+
+// Channels that can be subscribed to, packed in each frame in this order, all
+// values little-endian.
+typedef enum TelemetryChannel_enum {
+    TELEMETRY_GYRO_0 = 1,  // Raw gyro of IMU 0, 3x int16.
+    TELEMETRY_GYRO_1 = 2,  // Raw gyro of IMU 1, 3x int16.
+    TELEMETRY_ACCEL = 4,  // Raw accelerometer (both IMUs averaged), 3x int16.
+    TELEMETRY_THUMBSTICK = 8,  // Raw ADC channels (-1 to 1 as int16), 4x int16.
+    TELEMETRY_TOUCH = 16,  // Elapsed and threshold (microseconds), 2x float.
+    TELEMETRY_MOUSE = 32,  // Mouse deltas output in the tick, 2x int16.
+    TELEMETRY_AXES = 64,  // Gamepad axes output in the tick (-1 to 1 as int16), 6x int16.
+} TelemetryChannel;
+
+void telemetry_set(uint8_t channels, uint8_t divider);
+void telemetry_report();
+bool telemetry_pop(Ctrl *ctrl);
+
+void telemetry_gyro(Vector gyro0, Vector gyro1);
+void telemetry_accel(Vector accel);
+void telemetry_thumbstick(uint8_t channel, float value);
+void telemetry_touch(float elapsed, float threshold);
+void telemetry_mouse(int16_t x, int16_t y);
+void telemetry_axis(uint8_t axis, double value);
@@ -118,4 +118,4 @@ void thumbstick_report();
 void thumbstick_calibrate();
 void thumbstick_update_deadzone();
 void thumbstick_update_smooth_samples();
-void thumbstick_from_ctrl(Thumbstick *thumbstick, CtrlProfile *ctrl, uint8_t index);
+void thumbstick_from_ctrl(Thumbstick *thumbstick, const CtrlProfile *ctrl, uint8_t index);
@@ -4,26 +4,45 @@
 #pragma once
 
 // The maximum elapsed time before the measurement is assumed infinite.
-// Also the time limit to perform multiple measurements.
 #define TOUCH_TIMEOUT 100  // Microseconds.
 
+// Measurements ring buffer (written by DMA), and how many of the most recent
+// measurements are averaged on each status check.
+#define TOUCH_RING_BITS 7  // Ring size in bytes as power of 2 (32 entries).
+#define TOUCH_RING_SIZE ((1 << TOUCH_RING_BITS) / 4)
+#define TOUCH_SAMPLES 16
+
 // The starting baseline threshold value when using dynamic.
 #define TOUCH_AUTO_START_V0_GEN0 2  // Microseconds.
 #define TOUCH_AUTO_START_V0_GEN1 10 // Microseconds.
 #define TOUCH_AUTO_START_V1_GEN0 10 // Microseconds.
 
-// Dynamic threshold algorithm tuning (Wired).
-#define TOUCH_AUTO_RATIO_WIRED_PRESET1 2.0
-#define TOUCH_AUTO_RATIO_WIRED_PRESET2 1.5
-#define TOUCH_AUTO_RATIO_WIRED_PRESET3 1.25
+// Dynamic threshold, engage distance from the baseline in standard deviations
+// of the untouched signal noise.
+#define TOUCH_AUTO_SIGMA_PRESET1 10.0
+#define TOUCH_AUTO_SIGMA_PRESET2 7.0
+#define TOUCH_AUTO_SIGMA_PRESET3 5.0
+
+// Dynamic threshold, release distance from the baseline as a ratio of the
+// engage distance.
+#define TOUCH_AUTO_HYSTERESIS 0.6
+
+// Dynamic threshold, minimum engage distance as a ratio of the baseline, in
+// case the signal is very clean.
+#define TOUCH_AUTO_MARGIN_MIN 0.10
 
-// Dynamic threshold algorithm tuning (Wireless).
-#define TOUCH_AUTO_RATIO_WIRELESS_PRESET1 1.25
-#define TOUCH_AUTO_RATIO_WIRELESS_PRESET2 1.20
-#define TOUCH_AUTO_RATIO_WIRELESS_PRESET3 1.15
+// Dynamic threshold, drift of the untouched signal above the threshold (the
+// model is not updated while engaged). A finger adds the noise of the body and
+// its movement, so an engaged signal as flat as the untouched one for a whole
+// window is considered drift, and the signal is re-baselined.
+#define TOUCH_AUTO_DRIFT_WINDOW 10  // Seconds.
+#define TOUCH_AUTO_DRIFT_NOISE 2.0  // Max variance, ratio of the margin noise.
 
-// Smooting of the dynamic threshold (not the sampling).
+// Smooting of the untouched signal model (not the sampling).
 #define TOUCH_AUTO_SMOOTH  (CFG_TICK_FREQUENCY)  // 1 second.
+#define TOUCH_AUTO_NOISE_SMOOTH  (CFG_TICK_FREQUENCY * 4)  // 4 seconds.
+#define TOUCH_AUTO_NOISE_CLAMP 9  // Outliers limited to 3 standard deviations.
+#define TOUCH_AUTO_NOISE_MIN 0.02  // Microseconds, measurement resolution.
 
 // Debounce.
 #define TOUCH_DEBOUNCE 100  // Milliseconds.
@@ -34,3 +53,4 @@
 void touch_init();
 void touch_load_from_config();
 bool touch_status();
+float touch_confidence();
@@ -2,9 +2,42 @@
 // Copyright (C) 2022, Input Labs Oy.
 
 #pragma once
+#include <stdbool.h>
+#include <stdint.h>
 
-#define UART_RX_BUFFER_SIZE 1024
+#define UART_RX_BUFFER_BITS 10  // Ring size as power of 2 (1024 bytes).
+#define UART_RX_BUFFER_SIZE (1 << UART_RX_BUFFER_BITS)
+#define UART_RX_BUFFER_MASK (UART_RX_BUFFER_SIZE - 1)
 
+// Link frames between RP2040s (relayed as they are by the ESPs):
+// SOF, payload length, AT command, sequence number, payload, CRC-16 (LE) of
+// everything but the SOF.
+#define UART_SOF 0xA5
+#define UART_FRAME_HEADER_LEN 4
+#define UART_FRAME_CRC_LEN 2
+#define UART_FRAME_MAX_LEN (UART_FRAME_HEADER_LEN + AT_WEBUSB_LEN + UART_FRAME_CRC_LEN)
+#define UART_SEQ_RESTART 128  // Larger sequence jumps are considered peer restarts.
+#define UART_LOG_LINE_LEN 80  // ESP log lines, longer lines are split.
+
+// Link format. Both ends send hellos as frames when entering data mode, and
+// only switch to frames once the other end answers, which proves that both the
+// peer RP2040 and the ESPs in between pass frames. Otherwise (eg: an older
+// dongle, or ESP firmware that only relays the legacy format) the legacy format
+// is used, without acknowledges. Both formats are always accepted.
+#define UART_LINK_UNKNOWN 0  // Negotiating, sent as legacy.
+#define UART_LINK_LEGACY 1  // Control bytes header and fixed lengths.
+#define UART_LINK_FRAMED 2  // Frames with length, sequence and CRC.
+#define UART_LINK_VERSION UART_LINK_FRAMED  // Highest supported.
+#define UART_LINK_HELLO_INTERVAL 200  // Milliseconds between hellos.
+#define UART_LINK_HELLO_MAX 10  // Hellos not answered before using legacy.
+
+// Uncomment to flip a random bit every N received bytes (approximately), to
+// evaluate the link recovery on the device (see tests/test_uart.c for the
+// host tests of the recovery).
+// #define UART_FAULT_INJECT 1000
+
+// Legacy header, used by older peers and by messages originated in the ESP
+// (battery), followed by the AT command and a payload of fixed length.
 // Sequence of control bytes (chosen because these are non-printable, rarely used ASCII codes).
 #define UART_CONTROL_0 30
 #define UART_CONTROL_1 29
@@ -16,28 +49,56 @@
 #define AT_WEBUSB_LEN 64
 #define AT_BATTERY_LEN 4
 #define AT_USB_PROTOCOL_LEN 1
-#define AT_PAYLOAD_MAX_LEN  (AT_HEADER_LEN + AT_WEBUSB_LEN)
+#define AT_LINK_LEN 2
+
+#define UART_TX_QUEUE_SIZE 8  // Outbound frames, power of 2.
+#define UART_TX_READY_MIN 2  // Free frames required to accept a new report.
 
 typedef enum _UART_AT {
     AT_HID = 1,  // Keyboard, mouse or gamepad report (also Xinput).
     AT_WEBUSB,  // WebUSB relay.
     AT_BATTERY,  // Battery level.
     AT_USB_PROTOCOL,  // USB protocol (Windows/Linux/Genetic) automatic dongle sync.
+    AT_ACK,  // HID report received (sequence number), from dongle to controller.
+    AT_LINK,  // Link hello (version, is reply). Only as a frame.
 } UART_AT;
 
+typedef struct UartLinkStats_struct {
+    uint32_t tx_frames;
+    uint32_t tx_dropped;  // Queue full.
+    uint32_t rx_frames;
+    uint32_t rx_corrupted;  // Invalid length or CRC.
+    uint32_t rx_lost;  // Gaps in the sequence numbers.
+    uint32_t version;  // Link format in use (UART_LINK_*).
+} UartLinkStats;
+
 void uart_listen_serial();
 void uart_listen_serial_limited();
 
 void uart_rx_buffer_init();
+void uart_rx_buffer_deinit();
 bool uart_rx_buffer_is_empty();
 bool uart_rx_buffer_is_full();
 uint16_t uart_rx_buffer_available();
 void uart_rx_buffer_consume(uint16_t len);
-bool uart_rx_buffer_putc(uint8_t byte);
 uint8_t uart_rx_buffer_getc();
 uint8_t uart_rx_buffer_peekc();
 void uart_rx_buffer_get(uint8_t *dest, uint16_t len);
 bool uart_rx_buffer_match(uint8_t *pattern, uint8_t len);
-void uart_rx_irq_callback();
+void uart_rx_buffer_peek(uint8_t *dest, uint16_t len);
+bool uart_rx_frame(uint8_t *command, uint8_t *payload, uint8_t *len);
+uint8_t uart_rx_get_seq();
+
+void uart_tx_init();
+void uart_tx_deinit();
+bool uart_tx_send(uint8_t command, uint8_t *payload, uint8_t len);
+uint8_t uart_tx_get_seq();
+uint8_t* uart_tx_pending(uint8_t command, uint8_t id);
+void uart_frame_seal(uint8_t *frame);
+uint8_t uart_tx_free();
 
+void uart_link_task();
+void uart_link_handle(uint8_t *payload);
+uint8_t uart_link_get_version();
 
+UartLinkStats uart_get_stats();
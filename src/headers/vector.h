@@ -2,11 +2,18 @@
 // Copyright (C) 2022, Input Labs Oy.
 
 #pragma once
+#include <stdint.h>
+#include <math.h>
+
+// All the vector and quaternion math is single precision and inlined, since
+// RP2040 has fast float routines in ROM but double precision is emulated.
+// sincosf() is declared by math.h as a GNU extension (_GNU_SOURCE is defined
+// by the build).
 
 typedef struct vector_struct {
-    double x;
-    double y;
-    double z;
+    float x;
+    float y;
+    float z;
 } Vector;
 
 typedef struct vector4_struct {
@@ -16,17 +23,104 @@ typedef struct vector4_struct {
     float r;  // Rotation, usually in radians.
 } Vector4;
 
-Vector vector_normalize(Vector v);
-Vector vector_add(Vector a, Vector b);
-Vector vector_sub(Vector a, Vector b);
-Vector vector_invert(Vector v);
-Vector vector_cross_product(Vector a, Vector b);
-Vector vector_smooth(Vector a, Vector b, float factor);
-float vector_lenght(Vector v);
+// Fast reciprocal square root, refined with two Newton iterations
+// (relative error below 5e-6).
+static inline float vector_rsqrt(float x) {
+    union {float f; uint32_t i;} u = {x};
+    u.i = 0x5F375A86 - (u.i >> 1);
+    u.f *= 1.5f - (0.5f * x * u.f * u.f);
+    u.f *= 1.5f - (0.5f * x * u.f * u.f);
+    return u.f;
+}
+
+static inline Vector vector_normalize(Vector v) {
+    float mag = (v.x*v.x) + (v.y*v.y) + (v.z*v.z);
+    if (fabsf(mag - 1.0f) > 0.0001f) {  // Tolerance.
+        float inv = vector_rsqrt(mag);
+        return (Vector){v.x*inv, v.y*inv, v.z*inv};
+    }
+    return v;
+}
+
+static inline Vector vector_add(Vector a, Vector b) {
+    return (Vector){a.x+b.x, a.y+b.y, a.z+b.z};
+}
+
+static inline Vector vector_sub(Vector a, Vector b) {
+    return (Vector){a.x-b.x, a.y-b.y, a.z-b.z};
+}
+
+static inline Vector vector_invert(Vector v) {
+    return (Vector){-v.x, -v.y, -v.z};
+}
+
+static inline Vector vector_cross_product(Vector a, Vector b) {
+    return (Vector){
+        (a.y * b.z) - (a.z * b.y),
+        (a.z * b.x) - (a.x * b.z),
+        (a.x * b.y) - (a.y * b.x)
+    };
+}
+
+// Get a pseudo-rolling average of A and B according to given weight.
+// Only (1/weight) parts of B is incorporated into A.
+// The higher the weight the more averaged the result is.
+static inline Vector vector_smooth(Vector a, Vector b, float weight) {
+    float inv = 1.0f / (weight + 1);
+    return  (Vector){
+        (a.x*weight + b.x) * inv,
+        (a.y*weight + b.y) * inv,
+        (a.z*weight + b.z) * inv
+    };
+}
+
+static inline float vector_lenght(Vector v) {
+    return sqrtf((v.x*v.x) + (v.y*v.y) + (v.z*v.z));
+}
+
+static inline Vector4 quaternion(Vector vector, float rotation /*radians*/) {
+    // https://en.wikipedia.org/wiki/Conversion_between_quaternions_and_Euler_angles
+    vector = vector_normalize(vector);
+    float s, c;
+    sincosf(rotation / 2, &s, &c);
+    return (Vector4){vector.x * s, vector.y * s, vector.z * s, c};
+}
+
+static inline Vector4 qmultiply(Vector4 q1, Vector4 q2) {
+    // https://en.wikipedia.org/wiki/Quaternion
+    return (Vector4){
+        q1.r * q2.x + q1.x * q2.r + q1.y * q2.z - q1.z * q2.y,
+        q1.r * q2.y + q1.y * q2.r + q1.z * q2.x - q1.x * q2.z,
+        q1.r * q2.z + q1.z * q2.r + q1.x * q2.y - q1.y * q2.x,
+        q1.r * q2.r - q1.x * q2.x - q1.y * q2.y - q1.z * q2.z
+    };
+}
+
+static inline Vector4 qconjugate(Vector4 q) {
+    return (Vector4){-q.x, -q.y, -q.z, q.r};
+}
+
+static inline Vector qvector(Vector4 q) {
+    return vector_normalize((Vector){q.x, q.y, q.z});
+}
 
-Vector4 quaternion(Vector vector, float rotation);
-Vector4 qmultiply(Vector4 q1, Vector4 q2);
-Vector4 qconjugate(Vector4 q);
-Vector qrotate(Vector4 q1, Vector v);
-Vector qvector(Vector4 q);
+// Rotate a vector by a unit quaternion, without renormalizing the result.
+// Equivalent to q * v * conjugate(q), but with 2 cross products instead of 2
+// full quaternion multiplications.
+static inline Vector qrotate_fast(Vector4 q, Vector v) {
+    Vector u = {q.x, q.y, q.z};
+    Vector t = vector_cross_product(u, v);
+    t = (Vector){t.x * 2, t.y * 2, t.z * 2};
+    Vector ut = vector_cross_product(u, t);
+    return (Vector){
+        v.x + (q.r * t.x) + ut.x,
+        v.y + (q.r * t.y) + ut.y,
+        v.z + (q.r * t.z) + ut.z
+    };
+}
 
+// Rotate a vector by a quaternion, renormalizing the result only if it has
+// drifted beyond the normalization tolerance.
+static inline Vector qrotate(Vector4 q, Vector v) {
+    return vector_normalize(qrotate_fast(q, v));
+}
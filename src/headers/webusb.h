@@ -6,11 +6,41 @@
 #include "ctrl.h"
 
 #define WEBUSB_BUFFER_SIZE 2048
+#define WEBUSB_TX_QUEUE_SIZE 24  // Control messages waiting to be sent.
+#define WEBUSB_TX_QUEUE_RESERVE 2  // Most messages queued by a single received one.
+#define WEBUSB_TX_RELAY_SIZE 8  // Relayed messages waiting to be sent.
+#define WEBUSB_TX_BATCH 4  // Messages per USB transfer.
+#define WEBUSB_RX_RING_SIZE 8  // Received messages waiting to be handled.
+#define WEBUSB_RX_BUDGET 4  // Received messages handled per tick.
+
+typedef enum WebusbTxKind_enum {
+    WEBUSB_TX_EMPTY = 1,
+    WEBUSB_TX_STATUS,
+    WEBUSB_TX_CONFIG,
+    WEBUSB_TX_SECTION,
+    WEBUSB_TX_PROFILE_ACK,
+    WEBUSB_TX_PROFILE_END,
+    WEBUSB_TX_RELAY,
+    WEBUSB_TX_LINK,
+} WebusbTxKind;
+
+typedef enum WebusbTxPriority_enum {
+    WEBUSB_TX_HIGH,
+    WEBUSB_TX_NORMAL,
+} WebusbTxPriority;
+
+typedef struct WebusbTx_struct {
+    uint8_t kind;
+    uint8_t priority;
+    uint8_t args[4];
+} WebusbTx;
 
 void webusb_read();
 void webusb_write(char *msg);
+void webusb_write_raw(uint8_t *msg, uint16_t len);
 bool webusb_flush();
 void webusb_flush_force();
-void webusb_set_pending_config_share(bool value);
-bool webusb_transfer_wired(Ctrl ctrl);
+void webusb_set_pending_config_share(uint8_t key);
+void webusb_queue_relay(Ctrl *ctrl);
 void webusb_handle(Ctrl ctrl);
+uint32_t webusb_get_tx_overflows();
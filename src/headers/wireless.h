@@ -4,6 +4,7 @@
 #pragma once
 #include "ctrl.h"
 #include "config.h"
+#include "uart.h"
 
 #define BATTERY_MIN 2700
 #define BATTERY_MAX 3350
@@ -12,6 +13,31 @@
 
 #define FAKE_PAIR_TIME_MS 2000
 
+// Acknowledged delivery of HID reports (microseconds).
+#define WIRELESS_RTO_INIT 20000  // Retransmit timeout until the RTT is measured.
+#define WIRELESS_RTO_MIN 2000
+#define WIRELESS_RTO_MAX 200000
+#define WIRELESS_RETRANSMIT_MAX 6  // Retransmits before giving up on a report.
+
+typedef struct WirelessPending_struct {
+    bool pending;  // Waiting for acknowledge.
+    uint8_t seq;  // Link sequence number of the latest transmission.
+    uint8_t retries;
+    uint8_t len;
+    uint32_t sent_ts;
+    uint8_t report[AT_HID_LEN];
+} WirelessPending;
+
+typedef struct WirelessStats_struct {
+    uint32_t srtt;  // Smoothed round-trip time.
+    uint32_t rttvar;  // Round-trip time variation.
+    uint32_t rto;  // Current retransmit timeout.
+    uint32_t tracked;  // Reports that require acknowledge.
+    uint32_t acked;
+    uint32_t retransmits;
+    uint32_t failed;  // Given up after WIRELESS_RETRANSMIT_MAX.
+} WirelessStats;
+
 void wireless_init();
 void wireless_controller_task();
 void wireless_dongle_task();
@@ -20,3 +46,5 @@ void wireless_set_uart_data_mode(bool mode);
 void wireless_send_hid(uint8_t report_id, void *packet, uint8_t len);
 void wireless_send_webusb(Ctrl ctrl);
 void wireless_send_usb_protocol(Protocol protocol);
+bool wireless_tx_ready();
+WirelessStats wireless_get_stats();
@@ -28,9 +28,13 @@ to zeros when the user changes the active profile, otherwise the disabled
 profile won't ever trigger the corresponding counter decrease of held buttons
 during the profile change.
 
-The replay feature was introduced as a simple mechanism to prevent stuck inputs
-if the last wireless report is lost (since the protocol does not have
-packet-received confirmation nor any resend logic yet).
+To prevent stuck inputs when a wireless report is lost, the dongle acknowledges
+the reports received over a framed UART link, and the wireless layer
+retransmits the latest report of each type that changed the state (keys,
+buttons, axes) until it is acknowledged, see docs/wireless_delivery.md.
+
+Over the legacy UART link (a dongle or ESP firmware without frames) nothing is
+acknowledged, so the replay mechanism is used instead.
 It works by re-sending (replaying) the last report of an specific report type
 several times, and therefore reducing the chances that all these packets are
 lost. To determine what is considered "last" it keeps counters of how many
@@ -48,6 +52,7 @@ Flow diagram: docs/replay.md
 #include "ctrl.h"
 #include "hid.h"
 #include "wireless.h"
+#include "uart.h"
 #include "profile.h"
 #include "xinput.h"
 #include "common.h"
@@ -55,6 +60,7 @@ Flow diagram: docs/replay.md
 #include "logging.h"
 #include "thanks.h"
 #include "power.h"
+#include "telemetry.h"
 
 // Toggle to prevent any further communication. Main use case being turning it
 // off while the protocol is being changed to avoid incoherent outputs.
@@ -265,8 +271,8 @@ void hid_release_multiple_later_callback(alarm_id_t alarm, uint8_t *keys) {
 void hid_macro(uint8_t index) {
     uint8_t section = SECTION_MACRO_1 + ((index - 1) / 2);
     uint8_t subindex = (index - 1) % 2;
-    CtrlProfile *profile = config_profile_read(profile_get_active_index(false));
-    uint8_t *macro = profile->sections[section].macro.macro[subindex];
+    const CtrlProfile *profile = config_profile_read(profile_get_active_index(false));
+    const uint8_t *macro = profile->sections[section].macro.macro[subindex];
     if (alarms > 0) return;  // Disallows parallel macros. TODO fix.
     uint16_t time = 10;
     for(uint8_t i=0; i<28; i++) {
@@ -285,12 +291,14 @@ bool hid_is_axis(uint8_t key) {
 void hid_mouse_move(int16_t x, int16_t y) {
     mouse_x += x;
     mouse_y += y;
+    telemetry_mouse(x, y);
     synced_mouse = false;
     profile_set_reported_inputs(true);
 }
 
 void hid_gamepad_axis(GamepadAxis axis, double value) {
     gamepad_axis[axis] += value;  // Multiple inputs can be combined.
+    telemetry_axis(axis, value);
     if (value != 0) profile_set_reported_inputs(true);
 }
 
@@ -530,6 +538,8 @@ void hid_update_replay_state(ReportType type) {
 }
 
 bool hid_should_replay(ReportType type) {
+    // Framed links are acknowledged and retransmitted by the wireless layer.
+    if (uart_link_get_version() == UART_LINK_FRAMED) return false;
     if (
         report_was_sent[type] == true &&
         cycles_without_reporting[type] > HID_REPLAY_THRESHOLD &&
@@ -592,6 +602,12 @@ bool hid_report_wired() {
 
 bool hid_report_wireless() {
     if (!hid_allow_communication) return true;
+    // Backpressure, the UART link is behind so reports wait for the next tick
+    // (mouse deltas keep accumulating meanwhile).
+    if (!wireless_tx_ready()) {
+        hid_reset_gamepad_axis();
+        return true;
+    }
     ReportType device_to_report = hid_get_priority();
     if (device_to_report == REPORT_KEYBOARD) hid_report_keyboard(false);
     if (device_to_report == REPORT_MOUSE) hid_report_mouse(false);
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <pico/stdlib.h>
 #include "imu.h"
@@ -12,6 +13,7 @@
 #include "bus.h"
 #include "vector.h"
 #include "logging.h"
+#include "telemetry.h"
 
 uint8_t IMU0 = 0;
 uint8_t IMU1 = 0;
@@ -28,6 +30,23 @@ double offset_accel_1_x;
 double offset_accel_1_y;
 double offset_accel_1_z;
 
+// Online gyro bias tracking state (index 0 for IMU0, index 1 for IMU1).
+// Sums are double precision, since the sum of squares along a whole window
+// would lose the small variance at rest in single precision.
+uint16_t bias_n = 0;
+double bias_sum[2][3];
+double bias_sum_sq[2][3];
+Vector bias_accel_min;
+Vector bias_accel_max;
+double bias_delta = 0;  // Accumulated correction since the last persist.
+uint64_t bias_persist_ts = 0;
+
+// Gyro read timing, from the IMU internal timestamp counter.
+float timestamp_res = IMU_TIMESTAMP_RES;  // Microseconds.
+uint32_t timestamp_last = 0;
+bool timestamp_valid = false;
+float dt_factor = 1;
+
 void imu_channel_select() {
     Config *config = config_read();
     IMU0 = config->swap_gyros ? PIN_SPI_CS1 : PIN_SPI_CS0;
@@ -39,6 +58,7 @@ void imu_init_single(uint8_t cs, uint8_t gyro_conf) {
     bus_spi_write(cs, IMU_CTRL1_XL, IMU_CTRL1_XL_2G);
     bus_spi_write(cs, IMU_CTRL8_XL, IMU_CTRL8_XL_LP);
     bus_spi_write(cs, IMU_CTRL2_G, gyro_conf);
+    bus_spi_write(cs, IMU_CTRL10_C, IMU_CTRL10_C_TIMESTAMP);
     uint8_t xl = bus_spi_read_one(cs, IMU_READ | IMU_CTRL1_XL);
     uint8_t g = bus_spi_read_one(cs, IMU_READ | IMU_CTRL2_G);
     info("  IMU cs=%i id=0x%02x xl=0b%08i g=0b%08i\n", cs, id, bin(xl), bin(g));
@@ -54,6 +74,10 @@ void imu_init() {
     imu_load_calibration();
     imu_init_single(IMU0, IMU_CTRL2_G_500);
     imu_init_single(IMU1, IMU_CTRL2_G_125);
+    // Timestamp resolution varies with the actual internal oscillator speed.
+    int8_t freq_fine = (int8_t)bus_spi_read_one(IMU0, IMU_READ | IMU_INTERNAL_FREQ_FINE);
+    timestamp_res = IMU_TIMESTAMP_RES / (1 + (IMU_TIMESTAMP_FREQ_FINE * freq_fine));
+    info("  IMU timestamp resolution=%.3fus\n", timestamp_res);
 }
 
 void imu_power_off_single(uint8_t cs) {
@@ -133,9 +157,154 @@ Vector imu_read_gyro_burst(uint8_t cs, uint8_t samples) {
     return (Vector){x, y, z};
 }
 
-Vector imu_read_gyro() {
-    Vector gyro0 = imu_read_gyro_burst(IMU0, CFG_IMU_TICK_SAMPLES/8*1);
-    Vector gyro1 = imu_read_gyro_burst(IMU1, CFG_IMU_TICK_SAMPLES/8*7);
+// Measure the real time elapsed since the previous gyro read, as a factor of
+// the nominal tick interval, so the gyro output is independent of the loop
+// timing (jitter and overruns).
+void imu_timestamp_update() {
+    uint8_t buf[4];
+    bus_spi_read(IMU0, IMU_READ | IMU_TIMESTAMP0, buf, 4);
+    uint32_t timestamp = (
+        ((uint32_t)buf[3] << 24) |
+        ((uint32_t)buf[2] << 16) |
+        ((uint32_t)buf[1] << 8) |
+        (uint32_t)buf[0]
+    );
+    float dt = (timestamp - timestamp_last) * timestamp_res;
+    float factor = dt / CFG_TICK_INTERVAL_IN_US;
+    // Fallback to nominal interval if there is no valid previous reading, or
+    // if the gap is too big (gyro was not in use), or if the counter does
+    // not work.
+    if (!timestamp_valid || factor <= 0 || factor > IMU_DT_MAX_FACTOR) factor = 1;
+    dt_factor = factor;
+    timestamp_last = timestamp;
+    timestamp_valid = true;
+}
+
+// Elapsed time factor of the latest gyro read, to be applied to the rates.
+float imu_gyro_dt_factor() {
+    return dt_factor;
+}
+
+void imu_bias_reset() {
+    bias_n = 0;
+    bias_delta = 0;
+    bias_persist_ts = time_us_64();
+}
+
+void imu_bias_accumulate(uint8_t index, Vector gyro) {
+    double axes[3] = {gyro.x, gyro.y, gyro.z};
+    for(uint8_t axis=0; axis<3; axis++) {
+        bias_sum[index][axis] += axes[axis];
+        bias_sum_sq[index][axis] += axes[axis] * axes[axis];
+    }
+}
+
+// Check if an axis is at rest, given its accumulated sums along the window.
+bool imu_bias_axis_is_rest(double sum, double sum_sq, double stdev, double drift) {
+    double mean = sum / IMU_BIAS_WINDOW;
+    double variance = (sum_sq / IMU_BIAS_WINDOW) - (mean * mean);
+    return variance <= (stdev * stdev) && fabs(mean) <= drift;
+}
+
+bool imu_bias_is_rest() {
+    // Accelerometer must be stable.
+    if (
+        bias_accel_max.x - bias_accel_min.x > IMU_BIAS_REST_ACCEL ||
+        bias_accel_max.y - bias_accel_min.y > IMU_BIAS_REST_ACCEL ||
+        bias_accel_max.z - bias_accel_min.z > IMU_BIAS_REST_ACCEL
+    ) {
+        return false;
+    }
+    // Gyros must be quiet, and any leftover rate small enough to be drift.
+    double stdev[2] = {IMU_BIAS_REST_STDEV_0, IMU_BIAS_REST_STDEV_1};
+    double drift[2] = {IMU_BIAS_MAX_DRIFT_0, IMU_BIAS_MAX_DRIFT_1};
+    for(uint8_t i=0; i<2; i++) {
+        for(uint8_t axis=0; axis<3; axis++) {
+            if (!imu_bias_axis_is_rest(bias_sum[i][axis], bias_sum_sq[i][axis], stdev[i], drift[i])) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void imu_bias_apply(uint8_t cs, Vector residual) {
+    double x = residual.x * IMU_BIAS_RATE;
+    double y = residual.y * IMU_BIAS_RATE;
+    double z = residual.z * IMU_BIAS_RATE;
+    if (cs == PIN_SPI_CS0) {
+        offset_gyro_0_x += x;
+        offset_gyro_0_y += y;
+        offset_gyro_0_z += z;
+    } else {
+        offset_gyro_1_x += x;
+        offset_gyro_1_y += y;
+        offset_gyro_1_z += z;
+    }
+    bias_delta += fabs(x) + fabs(y) + fabs(z);
+}
+
+void imu_bias_persist() {
+    uint64_t now = time_us_64();
+    if (now - bias_persist_ts < (uint64_t)IMU_BIAS_PERSIST_INTERVAL * 1000) return;
+    if (bias_delta < IMU_BIAS_PERSIST_MIN_DELTA) return;
+    // Runtime offsets include the user offset, but config stores them apart.
+    Config *config = config_read();
+    double user_x = config->offset_gyro_user_x * GYRO_USER_OFFSET_FACTOR;
+    double user_y = config->offset_gyro_user_y * GYRO_USER_OFFSET_FACTOR;
+    double user_z = config->offset_gyro_user_z * GYRO_USER_OFFSET_FACTOR;
+    config_set_gyro_offset(
+        offset_gyro_0_x + user_x,
+        offset_gyro_0_y + user_y,
+        offset_gyro_0_z + user_z,
+        offset_gyro_1_x + user_x,
+        offset_gyro_1_y + user_y,
+        offset_gyro_1_z + user_z
+    );
+    debug("IMU: Gyro bias persisted (delta=%.2f)\n", bias_delta);
+    bias_delta = 0;
+    bias_persist_ts = now;
+}
+
+// Track the gyro bias while the controller is at rest, without blocking.
+// Input values are the burst averages with the current offsets applied, so at
+// rest any leftover is the bias drift since the last calibration.
+void imu_bias_track(Vector gyro0, Vector gyro1) {
+    Vector accel = imu_read_accel();
+    if (bias_n == 0) {
+        memset(bias_sum, 0, sizeof(bias_sum));
+        memset(bias_sum_sq, 0, sizeof(bias_sum_sq));
+        bias_accel_min = bias_accel_max = accel;
+    }
+    imu_bias_accumulate(0, gyro0);
+    imu_bias_accumulate(1, gyro1);
+    bias_accel_min.x = min(bias_accel_min.x, accel.x);
+    bias_accel_min.y = min(bias_accel_min.y, accel.y);
+    bias_accel_min.z = min(bias_accel_min.z, accel.z);
+    bias_accel_max.x = max(bias_accel_max.x, accel.x);
+    bias_accel_max.y = max(bias_accel_max.y, accel.y);
+    bias_accel_max.z = max(bias_accel_max.z, accel.z);
+    bias_n++;
+    if (bias_n < IMU_BIAS_WINDOW) return;
+    // Window complete.
+    bias_n = 0;
+    if (!imu_bias_is_rest()) return;
+    imu_bias_apply(IMU0, (Vector){
+        bias_sum[0][0] / IMU_BIAS_WINDOW,
+        bias_sum[0][1] / IMU_BIAS_WINDOW,
+        bias_sum[0][2] / IMU_BIAS_WINDOW,
+    });
+    imu_bias_apply(IMU1, (Vector){
+        bias_sum[1][0] / IMU_BIAS_WINDOW,
+        bias_sum[1][1] / IMU_BIAS_WINDOW,
+        bias_sum[1][2] / IMU_BIAS_WINDOW,
+    });
+    imu_bias_persist();
+}
+
+// Combine both IMUs, favoring the high precision one (125 dps) on slow
+// movements and the high range one (500 dps) on fast movements.
+Vector imu_gyro_blend(Vector gyro0, Vector gyro1) {
     double weight = max(abs(gyro1.x), abs(gyro1.y)) / 32768.0;
     double weight_0 = ramp_mid(weight, 0.2);
     double weight_1 = 1 - weight_0;
@@ -145,14 +314,56 @@ Vector imu_read_gyro() {
     return (Vector){x, y, z};
 }
 
+Vector imu_read_gyro() {
+    imu_timestamp_update();
+    Vector gyro0 = imu_read_gyro_burst(IMU0, CFG_IMU_TICK_SAMPLES/8*1);
+    Vector gyro1 = imu_read_gyro_burst(IMU1, CFG_IMU_TICK_SAMPLES/8*7);
+    telemetry_gyro(gyro0, gyro1);
+    imu_bias_track(gyro0, gyro1);
+    return imu_gyro_blend(gyro0, gyro1);
+}
+
+// Same samples as imu_read_gyro() but without collapsing the whole tick into a
+// single average, the result is split in CFG_IMU_TICK_BATCHES consecutive
+// elements so nonlinear processing can be applied to each of them.
+void imu_read_gyro_batches(Vector *batches) {
+    Vector sum0 = {0, 0, 0};
+    Vector sum1 = {0, 0, 0};
+    imu_timestamp_update();
+    for(uint8_t i=0; i<CFG_IMU_TICK_BATCHES; i++) {
+        Vector gyro0 = imu_read_gyro_burst(IMU0, CFG_IMU_TICK_SAMPLES/CFG_IMU_TICK_BATCHES/8*1);
+        Vector gyro1 = imu_read_gyro_burst(IMU1, CFG_IMU_TICK_SAMPLES/CFG_IMU_TICK_BATCHES/8*7);
+        batches[i] = imu_gyro_blend(gyro0, gyro1);
+        sum0 = vector_add(sum0, gyro0);
+        sum1 = vector_add(sum1, gyro1);
+    }
+    Vector gyro0 = {sum0.x / CFG_IMU_TICK_BATCHES, sum0.y / CFG_IMU_TICK_BATCHES, sum0.z / CFG_IMU_TICK_BATCHES};
+    Vector gyro1 = {sum1.x / CFG_IMU_TICK_BATCHES, sum1.y / CFG_IMU_TICK_BATCHES, sum1.z / CFG_IMU_TICK_BATCHES};
+    telemetry_gyro(gyro0, gyro1);
+    imu_bias_track(gyro0, gyro1);
+}
+
+// Keep feeding the bias tracker while the gyro is not being used for output.
+void imu_bias_idle() {
+    static uint8_t i = 0;
+    i++;
+    if (i < IMU_BIAS_IDLE_DIVIDER) return;
+    i = 0;
+    imu_read_gyro();
+    // Sparse reads are not consecutive, so are not valid as time reference.
+    timestamp_valid = false;
+}
+
 Vector imu_read_accel() {
     Vector accel0 = imu_read_accel_bits(IMU0);
     Vector accel1 = imu_read_accel_bits(IMU1);
-    return (Vector){
+    Vector accel = {
         (accel0.x + accel1.x) / 2,
         (accel0.y + accel1.y) / 2,
         (accel0.z + accel1.z) / 2
     };
+    telemetry_accel(accel);
+    return accel;
 }
 
 void imu_calibrate_single(uint8_t cs, bool mode, double* x, double* y, double* z) {
@@ -207,6 +418,7 @@ void imu_load_calibration() {
     offset_accel_1_x = config->offset_accel_1_x;
     offset_accel_1_y = config->offset_accel_1_y;
     offset_accel_1_z = config->offset_accel_1_z;
+    imu_bias_reset();
 }
 
 void imu_reset_calibration() {
@@ -222,6 +434,7 @@ void imu_reset_calibration() {
     offset_accel_1_x = 0;
     offset_accel_1_y = 0;
     offset_accel_1_z = 0;
+    imu_bias_reset();
 }
 
 void imu_calibrate() {
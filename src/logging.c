@@ -5,6 +5,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <string.h>
+#include <pico/time.h>
 #include "logging.h"
 #include "webusb.h"
 #include "config.h"
@@ -65,28 +67,92 @@ void write(char *msg, va_list args) {
     webusb_write(formatted);  // WebUSB.
 }
 
+// Binary log record:
+// - Format string address (4 bytes).
+// - Timestamp, lower 32 bits of microseconds since boot (4 bytes).
+// - Log level (1 byte).
+// - Arguments length (1 byte).
+// - Arguments as passed, 4 bytes each, 8 bytes for doubles and long long, and
+//   strings copied inline null-terminated (truncated).
+void write_binary(LogLevel level, char *msg, va_list args) {
+    uint8_t record[LOG_BINARY_RECORD_MAX];
+    uint32_t addr = (uint32_t)(uintptr_t)msg;
+    uint32_t timestamp = (uint32_t)time_us_64();
+    memcpy(&record[0], &addr, 4);
+    memcpy(&record[4], &timestamp, 4);
+    record[8] = level;
+    uint8_t len = LOG_BINARY_HEADER_SIZE;
+    for(char *c=msg; *c; c++) {
+        if (*c != '%') continue;
+        c++;
+        // Skip flags, width, precision and length modifiers.
+        uint8_t longs = 0;
+        while(*c && strchr("-+ #0123456789.hlLzjt", *c)) {
+            if (*c == 'l') longs++;
+            c++;
+        }
+        if (*c == 0) break;
+        if (*c == '%') continue;
+        // Make sure the largest argument fits.
+        if (len + LOG_BINARY_STRING_MAX > LOG_BINARY_RECORD_MAX) break;
+        if (strchr("fFeEgGaA", *c)) {
+            double value = va_arg(args, double);
+            memcpy(&record[len], &value, 8);
+            len += 8;
+        } else if (*c == 's') {
+            char *value = va_arg(args, char*);
+            uint8_t n = strnlen(value, LOG_BINARY_STRING_MAX - 1);
+            memcpy(&record[len], value, n);
+            record[len + n] = 0;
+            len += n + 1;
+        } else if (longs >= 2) {
+            uint64_t value = va_arg(args, uint64_t);
+            memcpy(&record[len], &value, 8);
+            len += 8;
+        } else {
+            uint32_t value = va_arg(args, uint32_t);
+            memcpy(&record[len], &value, 4);
+            len += 4;
+        }
+    }
+    record[9] = len - LOG_BINARY_HEADER_SIZE;
+    webusb_write_raw(record, len);
+}
+
 void info(char *msg, ...) {
     va_list va;
     va_start(va, 0);
-    write(msg, va);
+    #ifdef LOGGING_BINARY
+        write_binary(LOG_INFO, msg, va);
+    #else
+        write(msg, va);
+    #endif
     va_end(va);
 }
 
 void warn(char *msg, ...) {
     va_list va;
     va_start(va, 0);
-    char warn[256] = {0,};
-    sprintf(warn, "WARNING: %s", msg);
-    write(warn, va);
+    #ifdef LOGGING_BINARY
+        write_binary(LOG_WARN, msg, va);
+    #else
+        char warn[256] = {0,};
+        sprintf(warn, "WARNING: %s", msg);
+        write(warn, va);
+    #endif
     va_end(va);
 }
 
 void error(char *msg, ...) {
     va_list va;
     va_start(va, 0);
-    char error[256] = {0,};
-    sprintf(error, "ERROR: %s", msg);
-    write(error, va);
+    #ifdef LOGGING_BINARY
+        write_binary(LOG_ERROR, msg, va);
+    #else
+        char error[256] = {0,};
+        sprintf(error, "ERROR: %s", msg);
+        write(error, va);
+    #endif
     va_end(va);
 }
 
@@ -94,7 +160,11 @@ void debug(char *msg, ...) {
     if (logging_level < LOG_DEBUG) return;
     va_list va;
     va_start(va, 0);
-    write(msg, va);
+    #ifdef LOGGING_BINARY
+        write_binary(LOG_DEBUG, msg, va);
+    #else
+        write(msg, va);
+    #endif
     va_end(va);
 }
 
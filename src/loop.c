@@ -22,6 +22,7 @@
 #include "pin.h"
 #include "power.h"
 #include "webusb.h"
+#include "telemetry.h"
 
 static DeviceMode device_mode = WIRED;
 static bool battery_low = false;
@@ -175,6 +176,8 @@ void loop_controller_task() {
     config_sync();
     // Gather values for input sources.
     profile_report_active();
+    // Sample telemetry, if subscribed.
+    telemetry_report();
     // Report to the correct channel.
     if (device_mode == WIRED) {
         static uint64_t last_report_ts = 0;
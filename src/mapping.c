@@ -1,6 +1,7 @@
 #include "mapping.h"
 #include "config.h"
 #include "hid.h"
+#include "logging.h"
 #include "string.h"
 #include <pico/stdlib.h>
 #include <pico/assert.h>
@@ -60,153 +61,135 @@ void turboKey(uint8_t key)
     hid_press_later(key, CFG_TURBO_TIME);
 }
 
+// Indexed by MappingFunction.
+static const EventAction_Callback_fn mapping_functions[MappingFunction_SIZE] = {
+    0,
+    hid_press,
+    releaseKey,
+    toggleKey,
+    pulseKey,
+    turboKey,
+};
+
 Mapping make_mapping()
 {
     Mapping map;
     map.count = 0;
-    for (int i = 0 ; i < MAPPING_SIZE ; ++i)
+    for (int i = 0 ; i <= NUM_EVENTS ; ++i)
     {
-        map.event_mapping[i].event = NoEvent;
-        map.event_mapping[i].func = 0;
+        map.events[i].func = FUNC_NONE;
         for(int j = 0 ; j < ACTIONS_LEN ; ++j)
         {
-            map.event_mapping[i].param[j] = KEY_NONE;
+            map.events[i].keys[j] = KEY_NONE;
         }
     }
     return map;
 }
 
-void insertEventMapping(Mapping *self, EventAction_Callback action)
+bool insertEventMapping(Mapping *self, ButtonEvent event, MappingFunction func, uint8_t key)
 {
     assert(self);
-    if (action.event != NoEvent || action.func == 0)
+    if (event == NoEvent || func == FUNC_NONE || key == KEY_NONE)
     {
-        return;
+        return true;
     }
-
-    int i_candidate = -1;
-    for(int i = 0 ; i <= MAPPING_SIZE ; ++i)
+    EventActions *actions = &self->events[event];
+    if (actions->func != FUNC_NONE && actions->func != func)
     {
-        if (self->event_mapping[i].event == action.event && self->event_mapping[i].func == action.func)
-        {
-            for(int j = 0 ; j < ACTIONS_LEN ; ++j)
-            {
-                if (self->event_mapping[i].param[j] == KEY_NONE)
-                {
-                    // Add key press to existing mapping on same action and event
-                    self->event_mapping[i].param[j] = action.param[0];
-                    self->count++;
-                    return;  
-                }
-            }
-        }
-        else if (self->event_mapping[i].event ==NoEvent)
-        {
-            i_candidate = i;
-        }
+        warn("Mapping: Event %d already bound to a different action\n", event);
+        return false;
     }
-
-    if (i_candidate != -1)
+    actions->func = func;
+    for(int j = 0 ; j < ACTIONS_LEN ; ++j)
     {
-        self->event_mapping[i_candidate] = action;
-        self->count++;   
+        if (actions->keys[j] == KEY_NONE)
+        {
+            actions->keys[j] = key;
+            self->count++;
+            return true;
+        }
     }
-    // Error actions registered on too many different events. Increase MAPPING_SIZE
+    warn("Mapping: Too many keys bound to event %d\n", event);
+    return false;
 }
 
 void processEvent(Mapping *self, ButtonEvent evt)
 {
     assert(self && evt != NoEvent);
-    // Call all actions for the event raised
-	for(int i = 0 ; i < MAPPING_SIZE ; ++i)
-	{
-		if (self->event_mapping[i].event == evt && self->event_mapping[evt].func != 0)
-        {
-            EventAction_Callback *cb = &self->event_mapping[evt];
-            for(int j = 0 ; j < ACTIONS_LEN ; ++j)
-            {
-                info("BTN: Calling action %c for event %d\n", cb->param[j], evt);
-                // Call the event actions
-                cb->func(cb->param[j]);
-            }
-		}
-	}
+    EventActions *actions = &self->events[evt];
+    if (actions->func == FUNC_NONE) return;
+    EventAction_Callback_fn func = mapping_functions[actions->func];
+    for(int j = 0 ; j < ACTIONS_LEN ; ++j)
+    {
+        uint8_t key = actions->keys[j];
+        if (key == KEY_NONE) break;
+        mapping_trace("BTN: Calling action %d for event %d\n", key, evt);
+        func(key);
+    }
 }
 
 bool addMapping(Mapping *self, uint8_t key, EventModifier evtMod, ActionModifier actMod)
 {
     assert(self);
-    info("Adding %d for %c on %d\n", actMod, key, evtMod);
-
-	EventAction_Callback apply, release;
-	switch (evtMod)
-	{
-	case MOD_START:
-		apply.event = OnPress;
-		release.event = OnRelease;
-		break;
-	case MOD_TAP:
-		apply.event = OnTap;
-		release.event = NoEvent;
-		break;
-	case MOD_HOLD:
-		apply.event = OnHold;
-		release.event = OnHoldRelease;
-		break;
-	case MOD_RELEASE:
-		// Acttion Modifier is required
-		apply.event = OnRelease;
-		release.event = NoEvent;
-		break;
-	case MOD_TURBO:
-		apply.event = OnTurbo;
-		release.event = OnRelease;
-		break;
-	default:
+    if (key == KEY_NONE) return true;
+    mapping_trace("Adding %d for %d on %d\n", actMod, key, evtMod);
+
+    ButtonEvent apply_event, release_event;
+    MappingFunction apply_func, release_func;
+    switch (evtMod)
+    {
+    case MOD_START:
+        apply_event = OnPress;
+        release_event = OnRelease;
+        break;
+    case MOD_TAP:
+        apply_event = OnTap;
+        release_event = NoEvent;
+        break;
+    case MOD_HOLD:
+        apply_event = OnHold;
+        release_event = OnHoldRelease;
+        break;
+    case MOD_RELEASE:
+        // Acttion Modifier is required
+        apply_event = OnRelease;
+        release_event = NoEvent;
+        break;
+    case MOD_TURBO:
+        apply_event = OnTurbo;
+        release_event = OnRelease;
+        break;
+    default:
         // Error bad input
-		return false;
-	}
+        return false;
+    }
 
-	switch (actMod)
-	{
-	case MOD_START:
+    switch (actMod)
     {
+    case MOD_PRESS:
         // With TURBO + PULSE pulses the key down whereas
         // just TURBO holds the key down and pulses up
-        apply.func = (evtMod == MOD_TURBO ? &turboKey : &hid_press);
-        apply.param[0] = key;
-        release.func = &releaseKey;
-        release.param[0] = key;
-    }
-	break;
-	case MOD_TOGGLE:
-		apply.func = &toggleKey;
-        apply.param[0] = key;
-		release.func = 0;
-		break;
-	case MOD_PULSE:
-	{
-        apply.func = &pulseKey;
-        apply.param[0] = key;
-		release.func = 0;
-	}
-	break;
-    case MOD_RELEASE:
-	{
-        apply.func = &releaseKey;
-        apply.param[0] = key;
-		release.func = 0;
-	}
-    break;
-	default:
+        apply_func = (evtMod == MOD_TURBO ? FUNC_TURBO : FUNC_PRESS);
+        release_func = FUNC_RELEASE;
+        break;
+    case MOD_TOGGLE:
+        apply_func = FUNC_TOGGLE;
+        release_func = FUNC_NONE;
+        break;
+    case MOD_PULSE:
+        apply_func = FUNC_PULSE;
+        release_func = FUNC_NONE;
+        break;
+    case MOD_KEYUP:
+        apply_func = FUNC_RELEASE;
+        release_func = FUNC_NONE;
+        break;
+    default:
         // Error bad input
-		return false;
-	}
-
-	insertEventMapping(self, apply);
-	insertEventMapping(self, release);
+        return false;
+    }
 
-	return true;
+    bool ok = insertEventMapping(self, apply_event, apply_func, key);
+    ok &= insertEventMapping(self, release_event, release_func, key);
+    return ok;
 }
-
-
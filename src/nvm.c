@@ -1,21 +1,272 @@
 // SPDX-License-Identifier: GPL-2.0-only
 // Copyright (C) 2022, Input Labs Oy.
 
+#include <string.h>
 #include <hardware/flash.h>
 #include <hardware/sync.h>
+#include <pico/time.h>
 #include "common.h"
 #include "nvm.h"
+#include "config.h"
+#include "logging.h"
 
-void nvm_write(uint32_t addr, uint8_t* buffer, uint32_t size) {
+// Longest time spent with interrupts disabled in a single flash operation.
+uint32_t nvm_stall_max = 0;  // Microseconds.
+uint32_t nvm_bytes_written = 0;  // Since boot.
+
+void nvm_flash_erase(uint32_t addr, uint32_t size) {
+    uint64_t start = time_us_64();
+    uint32_t interrupts = save_and_disable_interrupts();
+    flash_range_erase(addr, size);
+    restore_interrupts(interrupts);
+    nvm_stall_max = max(nvm_stall_max, (uint32_t)(time_us_64() - start));
+}
+
+void nvm_flash_program(uint32_t addr, const uint8_t* buffer, uint32_t size) {
+    uint64_t start = time_us_64();
     uint32_t interrupts = save_and_disable_interrupts();
-    flash_range_erase(addr, max(size, 4096));
-    flash_range_program(addr, (const uint8_t*)buffer, size);
+    flash_range_program(addr, buffer, size);
     restore_interrupts(interrupts);
+    nvm_stall_max = max(nvm_stall_max, (uint32_t)(time_us_64() - start));
+    nvm_bytes_written += size;
+}
+
+uint32_t nvm_get_stall_max() {
+    return nvm_stall_max;
+}
+
+uint32_t nvm_get_bytes_written() {
+    return nvm_bytes_written;
+}
+
+void nvm_write(uint32_t addr, uint8_t* buffer, uint32_t size) {
+    // Flash can only be programmed in whole pages, so the trailing partial
+    // page (if any) is padded in a separate buffer.
+    uint32_t body = size & ~(FLASH_PAGE_SIZE - 1);
+    uint8_t tail[FLASH_PAGE_SIZE];
+    memset(tail, 0xFF, FLASH_PAGE_SIZE);
+    memcpy(tail, buffer + body, size - body);
+    nvm_flash_erase(addr, max(size, 4096));
+    if (body) nvm_flash_program(addr, (const uint8_t*)buffer, body);
+    if (size > body) nvm_flash_program(addr + body, tail, FLASH_PAGE_SIZE);
 }
 
 void nvm_read(uint32_t addr, uint8_t* buffer, uint32_t size) {
-    uint8_t* p = (uint8_t*)(XIP_BASE + addr);
-    for(uint32_t i=0; i<size; i++) {
-        buffer[i] = *(p+i);
+    memcpy(buffer, nvm_pointer(addr), size);
+}
+
+const void* nvm_pointer(uint32_t addr) {
+    // Flash memory-mapped through XIP, valid until the next write to it.
+    return (const void*)(XIP_BASE + addr);
+}
+
+// ============================================================================
+// Commits.
+// Same as nvm_write, but split into steps (an erase, or a few page programs)
+// so the time interrupts are disabled in a single tick is bounded. The buffer
+// must not be modified until the commit is finished.
+
+uint32_t commit_addr = 0;
+const uint8_t *commit_buffer = NULL;
+uint32_t commit_size = 0;
+uint32_t commit_offset = 0;
+bool commit_erased = false;
+bool commit_busy = false;
+
+void nvm_commit_start(uint32_t addr, const uint8_t* buffer, uint32_t size) {
+    commit_addr = addr;
+    commit_buffer = buffer;
+    commit_size = size;
+    commit_offset = 0;
+    commit_erased = false;
+    commit_busy = true;
+}
+
+bool nvm_commit_step() {
+    // Returns true when the commit is finished.
+    if (!commit_busy) return true;
+    if (!commit_erased) {
+        uint32_t sectors = (commit_size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+        nvm_flash_erase(commit_addr, sectors * FLASH_SECTOR_SIZE);
+        commit_erased = true;
+        return false;
+    }
+    for(uint8_t i=0; i<NVM_COMMIT_PAGES_PER_STEP && commit_offset<commit_size; i++) {
+        uint8_t page[FLASH_PAGE_SIZE];
+        uint32_t len = min(commit_size - commit_offset, FLASH_PAGE_SIZE);
+        memset(page, 0xFF, FLASH_PAGE_SIZE);
+        memcpy(page, commit_buffer + commit_offset, len);
+        nvm_flash_program(commit_addr + commit_offset, page, FLASH_PAGE_SIZE);
+        commit_offset += FLASH_PAGE_SIZE;
+    }
+    if (commit_offset >= commit_size) commit_busy = false;
+    return !commit_busy;
+}
+
+bool nvm_commit_is_busy() {
+    return commit_busy;
+}
+
+// ============================================================================
+// Journal.
+// Records are only ever appended, programming a single page at a time. When
+// the current sector is full, the latest record of each key is copied into the
+// next sector (which is erased first), except for the profile sections, which
+// are written into their profiles before. Records that do not pass the CRC
+// (eg: power cut while programming) are ignored, and a garbage collection that
+// was interrupted is completed on the next boot.
+
+uint8_t journal_sector = 0;  // Sector currently being appended to.
+uint8_t journal_head = 0;  // Next free record in the current sector.
+uint32_t journal_seq = 0;
+
+uint32_t nvm_journal_addr(uint8_t sector, uint8_t index) {
+    return (
+        NVM_JOURNAL_ADDR +
+        (sector * NVM_JOURNAL_SECTOR_SIZE) +
+        (index * NVM_JOURNAL_RECORD_SIZE)
+    );
+}
+
+const NvmRecord* nvm_journal_record(uint8_t sector, uint8_t index) {
+    return nvm_pointer(nvm_journal_addr(sector, index));
+}
+
+uint16_t nvm_journal_crc(const NvmRecord *record) {
+    // Sequence, key and length are contiguous (8 bytes).
+    uint16_t crc = crc16(CRC16_INIT, (const uint8_t*)&record->seq, 8);
+    return crc16(crc, record->payload, record->len);
+}
+
+bool nvm_journal_is_valid(const NvmRecord *record) {
+    return (
+        record->magic == NVM_JOURNAL_MAGIC &&
+        record->len <= NVM_JOURNAL_PAYLOAD &&
+        record->crc == nvm_journal_crc(record)
+    );
+}
+
+bool nvm_journal_is_erased(const NvmRecord *record) {
+    const uint8_t *bytes = (const uint8_t*)record;
+    for(uint16_t i=0; i<NVM_JOURNAL_RECORD_SIZE; i++) {
+        if (bytes[i] != 0xFF) return false;
+    }
+    return true;
+}
+
+// Latest valid record of a key in any sector, or NULL if none.
+const NvmRecord* nvm_journal_find(NvmKey key, uint8_t *sector) {
+    const NvmRecord *found = NULL;
+    for(uint8_t s=0; s<NVM_JOURNAL_SECTORS; s++) {
+        for(uint8_t i=0; i<NVM_JOURNAL_RECORDS; i++) {
+            const NvmRecord *record = nvm_journal_record(s, i);
+            if (record->key != key || !nvm_journal_is_valid(record)) continue;
+            if (found && record->seq < found->seq) continue;
+            found = record;
+            if (sector) *sector = s;
+        }
+    }
+    return found;
+}
+
+void nvm_journal_program(const NvmRecord *record) {
+    uint32_t addr = nvm_journal_addr(journal_sector, journal_head);
+    nvm_flash_program(addr, (const uint8_t*)record, NVM_JOURNAL_RECORD_SIZE);
+    journal_head++;
+}
+
+void nvm_journal_append(NvmKey key, const void *buffer, uint8_t size) {
+    NvmRecord record;
+    memset(&record, 0xFF, sizeof(NvmRecord));
+    record.magic = NVM_JOURNAL_MAGIC;
+    record.seq = ++journal_seq;
+    record.key = key;
+    record.len = size;
+    memcpy(record.payload, buffer, size);
+    record.crc = nvm_journal_crc(&record);
+    nvm_journal_program(&record);
+}
+
+// Copy the latest record of every carried key into the current sector.
+void nvm_journal_carry(bool all) {
+    for(uint8_t key=0; key<NVM_JOURNAL_KEYS; key++) {
+        uint8_t sector;
+        const NvmRecord *found = nvm_journal_find(key, &sector);
+        if (!found) continue;
+        if (!all && sector == journal_sector) continue;
+        NvmRecord record = *found;  // Copy out, the source may be erased.
+        nvm_journal_append(key, record.payload, record.len);
     }
 }
+
+void nvm_journal_collect() {
+    config_profile_compact();
+    journal_sector = (journal_sector + 1) % NVM_JOURNAL_SECTORS;
+    journal_head = 0;
+    debug("NVM: Journal collect into sector %i\n", journal_sector);
+    nvm_flash_erase(nvm_journal_addr(journal_sector, 0), NVM_JOURNAL_SECTOR_SIZE);
+    nvm_journal_carry(true);
+}
+
+void nvm_journal_init() {
+    // Find the sector with the latest record.
+    journal_seq = 0;
+    journal_sector = 0;
+    for(uint8_t s=0; s<NVM_JOURNAL_SECTORS; s++) {
+        for(uint8_t i=0; i<NVM_JOURNAL_RECORDS; i++) {
+            const NvmRecord *record = nvm_journal_record(s, i);
+            if (!nvm_journal_is_valid(record)) continue;
+            if (record->seq < journal_seq) continue;
+            journal_seq = record->seq;
+            journal_sector = s;
+        }
+    }
+    // Append after the last used record, even if it is not valid, since it
+    // can not be programmed again without an erase.
+    journal_head = 0;
+    for(uint8_t i=0; i<NVM_JOURNAL_RECORDS; i++) {
+        if (!nvm_journal_is_erased(nvm_journal_record(journal_sector, i))) {
+            journal_head = i + 1;
+        }
+    }
+    // Complete any interrupted garbage collection.
+    if (journal_head + NVM_JOURNAL_KEYS <= NVM_JOURNAL_RECORDS) nvm_journal_carry(false);
+    else nvm_journal_collect();
+    debug(
+        "NVM: Journal sector=%i head=%i seq=%lu\n",
+        journal_sector,
+        journal_head,
+        journal_seq
+    );
+}
+
+uint32_t nvm_journal_read(NvmKey key, void *buffer, uint8_t size) {
+    // Returns the sequence of the record read, or zero if not found.
+    const NvmRecord *record = nvm_journal_find(key, NULL);
+    if (!record) return 0;
+    memcpy(buffer, record->payload, min(size, record->len));
+    return record->seq;
+}
+
+void nvm_journal_write(NvmKey key, const void *buffer, uint8_t size) {
+    if (journal_head >= NVM_JOURNAL_RECORDS) nvm_journal_collect();
+    nvm_journal_append(key, buffer, min(size, NVM_JOURNAL_PAYLOAD));
+}
+
+uint32_t nvm_journal_latest(NvmKey first, uint16_t count) {
+    // Highest sequence of any of the keys in the range, or zero if none.
+    uint32_t latest = 0;
+    for(uint8_t s=0; s<NVM_JOURNAL_SECTORS; s++) {
+        for(uint8_t i=0; i<NVM_JOURNAL_RECORDS; i++) {
+            const NvmRecord *record = nvm_journal_record(s, i);
+            if (record->key < first || record->key >= first + count) continue;
+            if (record->seq <= latest || !nvm_journal_is_valid(record)) continue;
+            latest = record->seq;
+        }
+    }
+    return latest;
+}
+
+uint32_t nvm_journal_get_seq() {
+    return journal_seq;
+}
@@ -17,7 +17,8 @@
 #include "power.h"
 #include "wireless.h"
 
-Profile profiles[PROFILE_SLOTS];
+Profile profile_pool[PROFILE_POOL_SIZE];
+uint8_t profile_pool_index[PROFILE_POOL_SIZE];  // Profile index in each slot.
 uint8_t profile_active_index = -1;
 Protocol profile_protocol_was_changed = PROTOCOL_UNDEFINED;
 bool profile_reported_inputs = false;
@@ -37,9 +38,17 @@ bool enabled_all = true;
 bool enabled_abxy = true;
 bool profile_led_lock = false;  // Extern.
 
+// Layers.
+uint8_t layer_momentary = 0;  // Profile index, zero if none.
+uint8_t layer_toggled = 0;  // Profile index, zero if none.
+uint64_t layer_input_prev = 0;
+Profile *layer_profile = NULL;  // Built layer being reported, if any.
+
 void Profile__report(Profile *self) {
     if (!enabled_all) return;
-    bus_i2c_io_cache_update();
+    for(uint8_t i=0; i<CHORD_MAX; i++) {
+        self->chords[i].report(&self->chords[i]);
+    }
     home.report(&home);
     if (enabled_abxy) {
         self->a.report(&self->a);
@@ -95,9 +104,37 @@ void Profile__reset(Profile *self) {
     self->left_thumbstick.reset(&self->left_thumbstick);
     self->right_thumbstick.reset(&self->right_thumbstick);
     self->gyro.reset(&self->gyro);
+    for(uint8_t i=0; i<CHORD_MAX; i++) {
+        self->chords[i].reset(&self->chords[i]);
+    }
+}
+
+// Input pin of the button defined in a given section, if any.
+uint8_t profile_section_pin(uint8_t section) {
+    switch(section) {
+        case SECTION_A: return PIN_A;
+        case SECTION_B: return PIN_B;
+        case SECTION_X: return PIN_X;
+        case SECTION_Y: return PIN_Y;
+        case SECTION_DPAD_LEFT: return PIN_DPAD_LEFT;
+        case SECTION_DPAD_RIGHT: return PIN_DPAD_RIGHT;
+        case SECTION_DPAD_UP: return PIN_DPAD_UP;
+        case SECTION_DPAD_DOWN: return PIN_DPAD_DOWN;
+        case SECTION_SELECT_1: return PIN_SELECT_1;
+        case SECTION_SELECT_2: return PIN_SELECT_2;
+        case SECTION_START_1: return PIN_START_1;
+        case SECTION_START_2: return PIN_START_2;
+        case SECTION_L1: return PIN_L1;
+        case SECTION_L2: return PIN_L2;
+        case SECTION_R1: return PIN_R1;
+        case SECTION_R2: return PIN_R2;
+        case SECTION_L4: return PIN_L4;
+        case SECTION_R4: return PIN_R4;
+        default: return PIN_NONE;
+    }
 }
 
-void Profile__load_from_config(Profile *self, CtrlProfile *profile) {
+void Profile__load_from_config(Profile *self, const CtrlProfile *profile) {
     // Buttons.
     self->a =          Button_from_ctrl(PIN_A,          profile->sections[SECTION_A]);
     self->b =          Button_from_ctrl(PIN_B,          profile->sections[SECTION_B]);
@@ -172,6 +209,33 @@ void Profile__load_from_config(Profile *self, CtrlProfile *profile) {
         ctrl_gyro_z.actions_neg,
         ctrl_gyro_z.actions_pos
     );
+    // Chords.
+    CtrlChords ctrl_chords = profile->sections[SECTION_CHORDS].chords;
+    for(uint8_t i=0; i<CHORD_MAX; i++) {
+        CtrlChord ctrl_chord = ctrl_chords.chords[i];
+        self->chords[i] = Chord_(
+            button_input_mask(profile_section_pin(ctrl_chord.section_a)),
+            button_input_mask(profile_section_pin(ctrl_chord.section_b)),
+            ctrl_chord.actions,
+            ctrl_chords.window,
+            ctrl_chords.speculative
+        );
+    }
+    // Layers.
+    CtrlLayers ctrl_layers = profile->sections[SECTION_LAYERS].layers;
+    for(uint8_t i=0; i<PROFILE_LAYERS; i++) {
+        CtrlLayer ctrl_layer = ctrl_layers.layers[i];
+        bool valid = (
+            ctrl_layer.mode != LAYER_NONE &&
+            ctrl_layer.mode <= LAYER_TOGGLE &&
+            is_between(ctrl_layer.profile, 1, PROFILE_SLOTS-1)
+        );
+        self->layers[i] = (Layer){
+            .mask = valid ? button_input_mask(profile_section_pin(ctrl_layer.section)) : 0,
+            .mode = ctrl_layer.mode,
+            .profile = ctrl_layer.profile,
+        };
+    }
 }
 
 Profile Profile_ () {
@@ -187,11 +251,61 @@ Profile Profile_ () {
 
 void profile_reset_all_profiles() {
     config_tune_set_mode(0);
-    for(uint8_t i=0; i<PROFILE_SLOTS; i++) {
-        profiles[i].reset(&profiles[i]);
+    for(uint8_t i=0; i<PROFILE_POOL_SIZE; i++) {
+        if (profile_pool_index[i] == PROFILE_NONE) continue;
+        profile_pool[i].reset(&profile_pool[i]);
+    }
+}
+
+// Build the given profile into a pool slot, unless it is already there.
+Profile* profile_materialize(ProfilePoolSlot slot, uint8_t index) {
+    Profile *profile = &profile_pool[slot];
+    if (profile_pool_index[slot] != index) {
+        uint64_t start = time_us_64();
+        *profile = Profile_();
+        profile->load_from_config(profile, config_profile_read(index));
+        profile_pool_index[slot] = index;
+        debug(
+            "Profile: Built %i in slot %i (%llu us)\n",
+            index,
+            slot,
+            time_us_64() - start
+        );
+    }
+    return profile;
+}
+
+// Build every profile the active profile can switch to as a layer, so layers
+// are switched without building anything.
+void profile_materialize_layers() {
+    Profile *active = &profile_pool[PROFILE_POOL_ACTIVE];
+    for(uint8_t i=0; i<PROFILE_LAYERS; i++) {
+        Layer *layer = &(active->layers[i]);
+        ProfilePoolSlot slot = PROFILE_POOL_LAYER + i;
+        if (!layer->mask || layer->profile == profile_active_index) {
+            profile_pool_index[slot] = PROFILE_NONE;
+            continue;
+        }
+        profile_materialize(slot, layer->profile);
     }
 }
 
+// Build the active profile and its layers, if it was switched.
+void profile_materialize_active() {
+    if (profile_pool_index[PROFILE_POOL_ACTIVE] == profile_active_index) return;
+    profile_materialize(PROFILE_POOL_ACTIVE, profile_active_index);
+    profile_materialize_layers();
+}
+
+// Built layer slot of the given profile, or NULL if none (or the active).
+Profile* profile_get_layer(uint8_t index) {
+    if (!index) return NULL;
+    for(uint8_t i=PROFILE_POOL_LAYER; i<PROFILE_POOL_SIZE; i++) {
+        if (profile_pool_index[i] == index) return &profile_pool[i];
+    }
+    return NULL;
+}
+
 void profile_update_leds() {
     if (profile_led_lock) return;
     if (home_is_active) {
@@ -251,6 +365,42 @@ void profile_check_home_sleep() {
     }
 }
 
+// Evaluate the layer triggers of the active (base) profile. Triggers are
+// always hidden from the buttons. Layers are switched by swapping the profile
+// that is reported, without building anything (see profile_materialize_layers).
+void profile_update_layers() {
+    if (home_is_active || home_gamepad_is_active) return;
+    Profile *base = &profile_pool[PROFILE_POOL_ACTIVE];
+    uint8_t momentary = 0;
+    uint8_t toggled = layer_toggled;
+    uint64_t input = 0;
+    for(uint8_t i=0; i<PROFILE_LAYERS; i++) {
+        Layer *layer = &(base->layers[i]);
+        if (!layer->mask) continue;
+        button_input_suppress |= layer->mask;
+        bool pressed = button_input & layer->mask;
+        if (pressed) input |= layer->mask;
+        if (layer->mode == LAYER_MOMENTARY) {
+            if (pressed && !momentary) momentary = layer->profile;
+        }
+        if (layer->mode == LAYER_TOGGLE) {
+            if (pressed && !(layer_input_prev & layer->mask)) {
+                toggled = (toggled == layer->profile) ? 0 : layer->profile;
+            }
+        }
+    }
+    layer_input_prev = input;
+    uint8_t prev = layer_momentary ? layer_momentary : layer_toggled;
+    uint8_t next = momentary ? momentary : toggled;
+    layer_momentary = momentary;
+    layer_toggled = toggled;
+    if (next != prev) {
+        debug("Profile: Layer %i\n", next);
+        layer_profile = profile_get_layer(next);
+        pending_reset = true;
+    }
+}
+
 void profile_report_active() {
     // If protocol was changed.
     if (profile_protocol_was_changed >= 0 && !home_is_active) {
@@ -261,6 +411,12 @@ void profile_report_active() {
         #endif
         power_restart();
     }
+    // Build the active profile if it was just switched to. Not done directly
+    // in profile_set_active since that may be called while it is reporting.
+    profile_materialize_active();
+    // Sample inputs and evaluate layers.
+    button_input_update();
+    profile_update_layers();
     // Reset all profiles (state) if needed.
     if (pending_reset) profile_reset_all();
     // Report active profile.
@@ -307,6 +463,10 @@ void profile_set_active(uint8_t index) {
     if (index != profile_active_index) {
         info("Profile: Profile %i\n", index);
         profile_active_index = index;
+        layer_toggled = 0;
+        layer_momentary = 0;
+        layer_input_prev = 0;
+        layer_profile = NULL;
         config_set_profile(index);
     }
     // Update frontal leds.
@@ -314,17 +474,29 @@ void profile_set_active(uint8_t index) {
 }
 
 Profile* profile_get_active(bool strict) {
+    Profile *active = &profile_pool[PROFILE_POOL_ACTIVE];
     if (strict) {
-        return &profiles[profile_active_index];
+        return active;
     } else {
-        if (home_is_active) return &profiles[PROFILE_HOME];
-        else if (home_gamepad_is_active) return &profiles[PROFILE_HOME_GAMEPAD];
-        else return &profiles[profile_active_index];
+        if (home_is_active) return &profile_pool[PROFILE_POOL_HOME];
+        else if (home_gamepad_is_active) return &profile_pool[PROFILE_POOL_HOME_GAMEPAD];
+        else if (layer_profile) return layer_profile;
+        else return active;
     }
 }
 
-Profile* profile_get(uint8_t index) {
-    return &profiles[index];
+// Rebuild every built copy of the given profile, after its config changed.
+void profile_reload(uint8_t index) {
+    for(uint8_t i=0; i<PROFILE_POOL_SIZE; i++) {
+        if (profile_pool_index[i] != index) continue;
+        profile_pool[i].load_from_config(&profile_pool[i], config_profile_read(index));
+        if (i == PROFILE_POOL_ACTIVE) {
+            // Layer targets may have changed.
+            profile_materialize_layers();
+            uint8_t layer = layer_momentary ? layer_momentary : layer_toggled;
+            layer_profile = profile_get_layer(layer);
+        }
+    }
 }
 
 uint8_t profile_get_active_index(bool strict) {
@@ -360,10 +532,17 @@ void profile_init() {
     Actions actions_secondary = {0, 0, 0, 0};
     Actions actions_terciary = {GAMEPAD_HOME, PROC_HOME_GAMEPAD, PROC_IGNORE_LED_WARNINGS};
     home = Button_(PIN_HOME, DOUBLE|IMMEDIATE, actions, actions_secondary, actions_terciary);
-    // Profiles setup.
-    for(uint8_t i=0; i<PROFILE_SLOTS; i++) {
-        profiles[i] = Profile_();
-        profiles[i].load_from_config(&(profiles[i]), config_profile_read(i));
-    }
+    // Profiles setup, only home profiles and the active one are built now.
+    uint64_t start = time_us_64();
+    memset(profile_pool_index, PROFILE_NONE, sizeof(profile_pool_index));
+    profile_materialize(PROFILE_POOL_HOME, PROFILE_HOME);
+    profile_materialize(PROFILE_POOL_HOME_GAMEPAD, PROFILE_HOME_GAMEPAD);
     profile_set_active(config_get_profile());
+    profile_materialize_active();
+    info(
+        "  Built in %llu us, %i bytes (%i bytes if all built)\n",
+        time_us_64() - start,
+        (int)sizeof(profile_pool),
+        (int)(sizeof(Profile) * PROFILE_SLOTS)
+    );
 }
@@ -13,7 +13,7 @@ void self_test_button_press(const char *buttonName, Button* button) {
     info("Press button '%s': WAITING", buttonName);
     while (!button->is_pressed(button)) {
         uart_listen_serial_limited();
-        bus_i2c_io_cache_update();
+        button_input_update();
         sleep_ms(1);
     }
     info("\rPress button '%s': OK     \n", buttonName);
@@ -68,7 +68,7 @@ void self_test_dhat_press(Dhat* dhat, const char *buttonName, Button* button) {
     info("Press DHat '%s': WAITING", buttonName);
     while (!button->is_pressed(button)) {
         uart_listen_serial_limited();
-        bus_i2c_io_cache_update();
+        button_input_update();
         dhat->update(dhat);
         sleep_ms(1);
     }
@@ -0,0 +1,149 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+/*
+Telemetry streams raw sensor readings and processed outputs to the app at up
+to the full tick rate, for tuning purposes. The app subscribes to a set of
+channels with a TELEMETRY_SET message, and the controller then sends a
+TELEMETRY_FRAME message every N ticks, with only the subscribed channels
+packed in fixed order (see TelemetryChannel).
+
+Sources push their values when they are read (so telemetry never triggers
+additional reads), and frames are built once per tick and queued until the
+WebUSB link (or the wireless relay) has room for them. If the queue is full
+the frame is dropped and counted, the counter is included in every frame.
+*/
+
+#include <string.h>
+#include <pico/time.h>
+#include "telemetry.h"
+#include "common.h"
+#include "logging.h"
+
+static uint8_t telemetry_channels = 0;
+static uint8_t telemetry_divider = 1;
+static uint16_t telemetry_seq = 0;
+static uint16_t telemetry_dropped = 0;
+
+static Ctrl telemetry_queue[TELEMETRY_QUEUE_SIZE];
+static uint8_t telemetry_head = 0;
+static uint8_t telemetry_tail = 0;
+
+// Latest values.
+static int16_t telemetry_gyro_0[3] = {0,};
+static int16_t telemetry_gyro_1[3] = {0,};
+static int16_t telemetry_accel_[3] = {0,};
+static int16_t telemetry_thumbstick_[4] = {0,};
+static float telemetry_touch_[2] = {0,};
+static int16_t telemetry_mouse_[2] = {0,};  // Accumulated since last frame.
+static float telemetry_axes[6] = {0,};  // Accumulated in the current tick.
+
+static int16_t telemetry_int16(float value) {
+    return constrain(value, INT16_MIN, INT16_MAX);
+}
+
+void telemetry_set(uint8_t channels, uint8_t divider) {
+    info("Telemetry: channels=%i divider=%i\n", channels, divider);
+    telemetry_channels = channels;
+    telemetry_divider = max(divider, 1);
+    telemetry_seq = 0;
+    telemetry_dropped = 0;
+    telemetry_head = 0;
+    telemetry_tail = 0;
+    telemetry_mouse_[0] = 0;
+    telemetry_mouse_[1] = 0;
+}
+
+void telemetry_gyro(Vector gyro0, Vector gyro1) {
+    if (!telemetry_channels) return;
+    telemetry_gyro_0[0] = telemetry_int16(gyro0.x);
+    telemetry_gyro_0[1] = telemetry_int16(gyro0.y);
+    telemetry_gyro_0[2] = telemetry_int16(gyro0.z);
+    telemetry_gyro_1[0] = telemetry_int16(gyro1.x);
+    telemetry_gyro_1[1] = telemetry_int16(gyro1.y);
+    telemetry_gyro_1[2] = telemetry_int16(gyro1.z);
+}
+
+void telemetry_accel(Vector accel) {
+    if (!telemetry_channels) return;
+    telemetry_accel_[0] = telemetry_int16(accel.x);
+    telemetry_accel_[1] = telemetry_int16(accel.y);
+    telemetry_accel_[2] = telemetry_int16(accel.z);
+}
+
+void telemetry_thumbstick(uint8_t channel, float value) {
+    if (!telemetry_channels || channel >= 4) return;
+    telemetry_thumbstick_[channel] = telemetry_int16(value * BIT_15);
+}
+
+void telemetry_touch(float elapsed, float threshold) {
+    if (!telemetry_channels) return;
+    telemetry_touch_[0] = elapsed;
+    telemetry_touch_[1] = threshold;
+}
+
+void telemetry_mouse(int16_t x, int16_t y) {
+    if (!telemetry_channels) return;
+    telemetry_mouse_[0] += x;
+    telemetry_mouse_[1] += y;
+}
+
+void telemetry_axis(uint8_t axis, double value) {
+    if (!telemetry_channels || axis >= 6) return;
+    telemetry_axes[axis] += value;
+}
+
+static void telemetry_pack(Ctrl *ctrl, uint8_t channel, void *data, uint8_t len) {
+    if (!(telemetry_channels & channel)) return;
+    memcpy(&ctrl->payload[ctrl->len], data, len);
+    ctrl->len += len;
+}
+
+// Build the frame of the current tick, called once per tick after the
+// profile is reported.
+void telemetry_report() {
+    if (!telemetry_channels) return;
+    static uint8_t tick = 0;
+    tick++;
+    if (tick >= telemetry_divider) {
+        tick = 0;
+        if ((uint8_t)(telemetry_head - telemetry_tail) >= TELEMETRY_QUEUE_SIZE) {
+            if (telemetry_dropped < UINT16_MAX) telemetry_dropped++;
+        } else {
+            Ctrl *ctrl = &telemetry_queue[telemetry_head % TELEMETRY_QUEUE_SIZE];
+            ctrl->protocol_flags = CTRL_FLAG_NONE;
+            ctrl->device_id = ALPAKKA;
+            ctrl->message_type = TELEMETRY_FRAME;
+            uint32_t timestamp = time_us_32();
+            memcpy(&ctrl->payload[0], &telemetry_seq, 2);
+            memcpy(&ctrl->payload[2], &timestamp, 4);
+            ctrl->payload[6] = telemetry_channels;
+            memcpy(&ctrl->payload[7], &telemetry_dropped, 2);
+            ctrl->len = TELEMETRY_HEADER_SIZE;
+            int16_t axes[6];
+            for(uint8_t i=0; i<6; i++) {
+                axes[i] = telemetry_int16(constrain(telemetry_axes[i], -1, 1) * BIT_15);
+            }
+            telemetry_pack(ctrl, TELEMETRY_GYRO_0, telemetry_gyro_0, 6);
+            telemetry_pack(ctrl, TELEMETRY_GYRO_1, telemetry_gyro_1, 6);
+            telemetry_pack(ctrl, TELEMETRY_ACCEL, telemetry_accel_, 6);
+            telemetry_pack(ctrl, TELEMETRY_THUMBSTICK, telemetry_thumbstick_, 8);
+            telemetry_pack(ctrl, TELEMETRY_TOUCH, telemetry_touch_, 8);
+            telemetry_pack(ctrl, TELEMETRY_MOUSE, telemetry_mouse_, 4);
+            telemetry_pack(ctrl, TELEMETRY_AXES, axes, 12);
+            telemetry_head++;
+            telemetry_mouse_[0] = 0;
+            telemetry_mouse_[1] = 0;
+        }
+        telemetry_seq++;
+    }
+    for(uint8_t i=0; i<6; i++) telemetry_axes[i] = 0;
+}
+
+// Take the oldest frame waiting to be sent, if any.
+bool telemetry_pop(Ctrl *ctrl) {
+    if (telemetry_tail == telemetry_head) return false;
+    *ctrl = telemetry_queue[telemetry_tail % TELEMETRY_QUEUE_SIZE];
+    telemetry_tail++;
+    return true;
+}
@@ -11,9 +11,11 @@
 #include "button.h"
 #include "thumbstick.h"
 #include "common.h"
+#include "vector.h"
 #include "hid.h"
 #include "profile.h"
 #include "logging.h"
+#include "telemetry.h"
 
 float offset_lx = 0;
 float offset_ly = 0;
@@ -35,6 +37,7 @@ float thumbstick_adc(uint8_t pin) {
     uint8_t channel = pin - PIN_ADC_FIRST;
     adc_select_input(channel);
     float value = ((float)adc_read() - BIT_11) / BIT_11;
+    telemetry_thumbstick(channel, value);
     return value * THUMBSTICK_BASELINE_SATURATION;
 }
 
@@ -141,7 +144,7 @@ uint8_t thumbstick_get_direction(float angle, float overlap) {
     return mask;
 }
 
-void thumbstick_from_ctrl(Thumbstick *thumbstick, CtrlProfile *ctrl, uint8_t index) {
+void thumbstick_from_ctrl(Thumbstick *thumbstick, const CtrlProfile *ctrl, uint8_t index) {
     const uint8_t SECTION_STICK_SETTINGS = index ? SECTION_RSTICK_SETTINGS : SECTION_LSTICK_SETTINGS;
     const uint8_t SECTION_STICK_LEFT = index ? SECTION_RSTICK_LEFT : SECTION_LSTICK_LEFT;
     const uint8_t SECTION_STICK_RIGHT = index ? SECTION_RSTICK_RIGHT : SECTION_LSTICK_RIGHT;
@@ -459,8 +462,8 @@ void Thumbstick__report(Thumbstick *self) {
     float deadzone = self->deadzone_override ? self->deadzone : config_deadzone;
     deadzone /= self->saturation;
     // Calculate trigonometry.
-    float angle = atan2(x, -y) * (180 / M_PI);
-    float radius = sqrt(powf(x, 2) + powf(y, 2));
+    float angle = degrees(atan2f(x, -y));
+    float radius = sqrtf((x*x) + (y*y));
     radius = constrain(radius, 0, 1);
     if (radius < deadzone) {
         radius = 0;
@@ -468,8 +471,10 @@ void Thumbstick__report(Thumbstick *self) {
         radius = ramp_low(radius, deadzone);
         radius = ramp_inv(radius, self->antideadzone);
     }
-    x = sin(radians(angle)) * radius;
-    y = -cos(radians(angle)) * radius;
+    float angle_sin, angle_cos;
+    sincosf(radians(angle), &angle_sin, &angle_cos);
+    x = angle_sin * radius;
+    y = -angle_cos * radius;
     ThumbstickPosition pos = {x, y, angle, radius};
     // Report.
     if (self->mode == THUMBSTICK_MODE_4DIR) {
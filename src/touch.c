@@ -22,6 +22,11 @@ many microseconds passed from the moment the first GPIO was set as pull up/down
 to the moment it was confirmed by the other GPIO the circuit was effectively
 driven up/down.
 
+The measurement is done by a PIO state machine (see touch.pio) that repeats it
+continuously at system clock resolution, and the results are written by DMA
+into a ring buffer. So reading the touch status is just averaging the most
+recent measurements, without any busy-wait.
+
 The more parasitic capacitance the circuit has, the slower this process is,
 therefore when the user touch the surface, their whole body capacitance makes
 the measurement result to increase significantly, and can be determined as
@@ -34,23 +39,49 @@ the defined timeout, the surface is also considered touched.
 There are 2 modes of operation:
 - Fixed: The threshold is a fixed number of microseconds defined by
   the controller configuration (touch sensitivity preset).
-- Dynamic (automatic): The threshold changes dynamically based on recursive
-  self-assessment of the system, with a relatively simple logic / algorithm.
+- Dynamic (automatic): The mean and the noise (variance) of the untouched
+  signal are tracked with slow rolling averages, which also follows the slow
+  drift caused by temperature, humidity or a change of return path (wired vs
+  wireless). The surface is engaged when the signal is a given number of
+  standard deviations above the mean (depending on the sensitivity preset),
+  and released when it drops below a lower threshold (hysteresis).
+  Since the model is only updated while disengaged, a surface engaged with a
+  signal as flat as the untouched one is re-baselined (drift while engaged),
+  and a signal well below the baseline is followed immediately (drift down, or
+  a re-baseline while touched).
+
+Additionally a confidence value (0 to 1) is provided, expressing how close the
+signal is to the engage threshold, used by the gyro to get ready before it is
+engaged.
 */
 
 #include <stdio.h>
 #include <math.h>
 #include <pico/stdlib.h>
+#include <hardware/pio.h>
+#include <hardware/dma.h>
+#include <hardware/clocks.h>
+#include "touch.pio.h"
 #include "config.h"
 #include "touch.h"
-#include "loop.h"
 #include "pin.h"
 #include "common.h"
 #include "logging.h"
+#include "telemetry.h"
 
 uint8_t polarity_mode = 0;
 int8_t sens_from_config = 0;
-float baseline = 0;
+float baseline = 0;  // Untouched signal mean.
+float variance = 0;  // Untouched signal noise.
+float confidence = 0;
+
+// PIO timing engine.
+PIO touch_pio;
+uint touch_sm;
+uint touch_dma;
+uint32_t touch_timeout_loops = 0;  // Counting loop iterations until timeout.
+float touch_loop_us = 0;  // Microseconds per counting loop iteration.
+uint32_t touch_ring[TOUCH_RING_SIZE] __attribute__((aligned(TOUCH_RING_SIZE * 4)));
 
 void touch_load_from_config() {
     // Load sensitivity presets.
@@ -59,7 +90,12 @@ void touch_load_from_config() {
     // Load polarity.
     Config *config = config_read();
     polarity_mode = !config->touch_invert_polarity;
+    // The PIO program is written for the default polarity.
+    uint override = polarity_mode ? GPIO_OVERRIDE_NORMAL : GPIO_OVERRIDE_INVERT;
+    gpio_set_outover(PIN_TOUCH_OUT, override);
+    gpio_set_inover(PIN_TOUCH_IN, override);
     // Reset to initial baseline.
+    variance = 0;
     baseline = TOUCH_AUTO_START_V1_GEN0;
     #ifdef DEVICE_ALPAKKA_V0
         baseline = (
@@ -70,104 +106,132 @@ void touch_load_from_config() {
     #endif
 }
 
-// Perform the time measurement (charge / discharge).
-uint8_t touch_get_elapsed() {
-    bool timedout = false;
-    // Make sure it is settled.
-    uint32_t timer_start = time_us_32();
-    gpio_put(PIN_TOUCH_OUT, polarity_mode);
-    while(gpio_get(PIN_TOUCH_IN) != polarity_mode) {
-        if ((time_us_32() - timer_start) > TOUCH_TIMEOUT) {
-            return TOUCH_TIMEOUT;
-        }
-    }
-    // Request change and measure.
-    uint32_t timer_settled = time_us_32();
-    gpio_put(PIN_TOUCH_OUT, !polarity_mode);
-    while(gpio_get(PIN_TOUCH_IN) == polarity_mode) {
-        if ((time_us_32() - timer_start) > TOUCH_TIMEOUT) {
-            timedout = true;
-            break;
-        }
-    };
-    // Request settle for next cycle.
-    gpio_put(PIN_TOUCH_OUT, polarity_mode);
-    // Calculate elapsed (ignore settling time).
-    if (timedout) return TOUCH_TIMEOUT;
-    else return time_us_32() - timer_settled;
+// Convert a ring buffer entry (remaining loop iterations) into microseconds.
+// On timeout the counter wraps to 0xFFFFFFFF, which converts to the timeout.
+float touch_entry_to_elapsed(uint32_t entry) {
+    return (touch_timeout_loops - entry) * touch_loop_us;
 }
 
-// Take as many samples as possible within the available time (timeout).
+// Average of the most recent measurements done by the PIO engine.
 float touch_get_elapsed_multisample() {
+    // The DMA transfer count is finite, rearm if it ever runs out.
+    if (!dma_channel_is_busy(touch_dma)) {
+        dma_channel_set_trans_count(touch_dma, UINT32_MAX, true);
+    }
+    // Find the latest entry written.
+    uint32_t write_addr = dma_channel_hw_addr(touch_dma)->write_addr;
+    uint8_t head = (write_addr - (uintptr_t)touch_ring) / 4;
     float total = 0;
-    float expected_next = 0;
-    uint8_t samples = 0;
-    while (expected_next < TOUCH_TIMEOUT) {
-        uint8_t elapsed = touch_get_elapsed();
-        total += elapsed;
-        expected_next = total + elapsed;
-        samples++;
+    for(uint8_t i=1; i<=TOUCH_SAMPLES; i++) {
+        uint8_t index = (head + TOUCH_RING_SIZE - i) % TOUCH_RING_SIZE;
+        total += touch_entry_to_elapsed(touch_ring[index]);
     }
-    return total / samples;
+    return total / TOUCH_SAMPLES;
 }
 
-float touch_get_threshold_ratio() {
+float touch_get_sigma() {
     // When the touch sensitivity is negative it means the touch detection is
     // in "dynamic" mode.
-    // When the controller is in wireless mode (working on battery) the return
-    // path is much sorter and the timing is different; so the ratio has to be
-    // adjusted when the mode changes from wired to wireless (and viceversa).
-    if (loop_get_device_mode() == WIRED) {
-        if (sens_from_config == -1) return TOUCH_AUTO_RATIO_WIRED_PRESET1;
-        if (sens_from_config == -2) return TOUCH_AUTO_RATIO_WIRED_PRESET2;
-        if (sens_from_config == -3) return TOUCH_AUTO_RATIO_WIRED_PRESET3;
-    }
-    if (loop_get_device_mode() == WIRELESS) {
-        if (sens_from_config == -1) return TOUCH_AUTO_RATIO_WIRELESS_PRESET1;
-        if (sens_from_config == -2) return TOUCH_AUTO_RATIO_WIRELESS_PRESET2;
-        if (sens_from_config == -3) return TOUCH_AUTO_RATIO_WIRELESS_PRESET3;
-    }
-    return 0.0f;  // Prevent undefined behavior.
+    if (sens_from_config == -1) return TOUCH_AUTO_SIGMA_PRESET1;
+    if (sens_from_config == -2) return TOUCH_AUTO_SIGMA_PRESET2;
+    if (sens_from_config == -3) return TOUCH_AUTO_SIGMA_PRESET3;
+    return TOUCH_AUTO_SIGMA_PRESET1;  // Prevent undefined behavior.
 }
 
-// Calculate dynamic threshold.
-float touch_get_auto_threshold(float elapsed, float ratio) {
-    // Calculate threshold based on current baseline and factor.
-    float threshold = baseline * ratio;
-    // Update baseline (with smoothing) if the surface is considered disengaged.
-    bool engaged = elapsed >= threshold;
-    if (!engaged) {
-        baseline = smooth(baseline, elapsed, TOUCH_AUTO_SMOOTH);
+// Update the untouched signal model, only called if disengaged.
+void touch_model_update(float elapsed) {
+    float delta = elapsed - baseline;
+    baseline += delta / TOUCH_AUTO_SMOOTH;
+    // Limit the influence of outliers (eg: finger approaching) on the noise.
+    float delta_sq = min(delta * delta, variance * TOUCH_AUTO_NOISE_CLAMP);
+    variance += (delta_sq - variance) / TOUCH_AUTO_NOISE_SMOOTH;
+    variance = max(variance, TOUCH_AUTO_NOISE_MIN * TOUCH_AUTO_NOISE_MIN);
+}
+
+// Distance from the baseline to the engage threshold.
+float touch_get_auto_margin() {
+    float margin_noise = touch_get_sigma() * sqrtf(variance);
+    float margin_min = baseline * TOUCH_AUTO_MARGIN_MIN;
+    return max(margin_noise, margin_min);
+}
+
+// Determine if the engaged signal is just the untouched signal drifted above
+// the threshold, by its variance over a window (compared with the noise that
+// the engage margin allows for, which is at least the untouched noise).
+bool touch_drift_check(float smoothed, bool engaged) {
+    static uint32_t window_start_ts = 0;
+    static uint32_t count = 0;
+    static float mean = 0;
+    static float m2 = 0;
+    if (engaged) {
+        count++;
+        float delta = smoothed - mean;
+        mean += delta / count;
+        m2 += delta * (smoothed - mean);
+        if (time_us_32() - window_start_ts < TOUCH_AUTO_DRIFT_WINDOW * 1000000) {
+            return false;
+        }
     }
-    // Return.
-    return threshold;
+    float noise = touch_get_auto_margin() / touch_get_sigma();
+    bool drift = engaged && (m2 / count) <= noise * noise * TOUCH_AUTO_DRIFT_NOISE;
+    // Start a new window.
+    window_start_ts = time_us_32();
+    count = 0;
+    mean = 0;
+    m2 = 0;
+    return drift;
+}
+
+// How close the signal is to be considered touched, from 0 to 1.
+float touch_confidence() {
+    return confidence;
 }
 
 // Determine if the surface is touched or not.
 bool touch_status() {
     static bool engaged_prev = false;
     static uint32_t disengaged_last_ts = 0;
-    static float elapsed_prev = 0;
+    static float elapsed_prev = -1;
     // Measure and smooth.
     float elapsed = touch_get_elapsed_multisample();
+    if (elapsed_prev < 0) elapsed_prev = elapsed;
     float smoothed = (elapsed + elapsed_prev) / 2;
     elapsed_prev = elapsed;
-    // Determine threshold.
-    float threshold_ratio = touch_get_threshold_ratio();
-    float threshold = (
-        sens_from_config > 0 ?
-        sens_from_config / 10.0 :
-        touch_get_auto_threshold(smoothed, threshold_ratio)
-    );
-    // Determine if the surface is considered engaged.
-    bool engaged = smoothed >= threshold;
+    // Determine thresholds and if the surface is considered engaged.
+    float threshold;
+    bool engaged;
+    if (sens_from_config > 0) {
+        threshold = sens_from_config / 10.0;
+        engaged = smoothed >= threshold;
+        confidence = constrain(smoothed / threshold, 0, 1);
+    } else {
+        float margin = touch_get_auto_margin();
+        float threshold_engage = baseline + margin;
+        float threshold_release = baseline + (margin * TOUCH_AUTO_HYSTERESIS);
+        threshold = engaged_prev ? threshold_release : threshold_engage;
+        engaged = smoothed >= threshold;
+        // Untouched signal drifted above the threshold, so the current level
+        // becomes the baseline.
+        if (touch_drift_check(smoothed, engaged && engaged_prev)) {
+            warn("Touch: Flat signal while engaged, re-baseline\n");
+            baseline = smoothed;
+            engaged = false;
+        }
+        // Untouched signal drifted down (or re-baselined while touched).
+        if (smoothed < baseline - margin) baseline = smoothed;
+        confidence = constrain((smoothed - baseline) / margin, 0, 1);
+        if (!engaged) touch_model_update(smoothed);
+    }
+    telemetry_touch(elapsed, threshold);
     // Periodic debug log.
     if (logging_has_mask(LOG_TOUCH_SENS)) {
         static uint32_t log_last_ts = 0;
         if (time_us_32() > (log_last_ts + (TOUCH_DEBUG_FREQ * 1000))) {
             log_last_ts = time_us_32();
-            float ratio = sens_from_config < 0 ? threshold_ratio : 0;
-            info("e=%.1f t=%.1f r=%.2f\n", elapsed, threshold, ratio);
+            info(
+                "e=%.2f t=%.2f b=%.2f n=%.3f c=%.2f\n",
+                elapsed, threshold, baseline, sqrtf(variance), confidence
+            );
         }
     }
     // Debounce check (prioritize stay up to avoid microcuts).
@@ -184,8 +248,10 @@ bool touch_status() {
     // Debug log triggered by state change.
     if (engaged != engaged_prev) {
         if (logging_has_mask(LOG_TOUCH_SENS)) {
-            float ratio = sens_from_config < 0 ? threshold_ratio : 0;
-            info("e=%.1f t=%.1f r=%.2f", elapsed, threshold, ratio);
+            info(
+                "e=%.2f t=%.2f b=%.2f n=%.3f c=%.2f",
+                elapsed, threshold, baseline, sqrtf(variance), confidence
+            );
             if (engaged) info(" TOUCH\n");
             else info(" LIFT\n");
         }
@@ -197,23 +263,68 @@ bool touch_status() {
 
 // Probe timings and show them in the startup log.
 void touch_log_probe() {
-    uint8_t t0 = touch_get_elapsed();
+    float t0 = touch_get_elapsed_multisample();
     sleep_ms(CFG_TICK_INTERVAL_IN_MS);
-    uint8_t t1 = touch_get_elapsed();
+    float t1 = touch_get_elapsed_multisample();
     sleep_ms(CFG_TICK_INTERVAL_IN_MS);
-    uint8_t t2 = touch_get_elapsed();
+    float t2 = touch_get_elapsed_multisample();
     sleep_ms(CFG_TICK_INTERVAL_IN_MS);
-    uint8_t t3 = touch_get_elapsed();
-    info("  Touch readings: %ius %ius %ius %ius\n", t0, t1, t2, t3);
+    float t3 = touch_get_elapsed_multisample();
+    info("  Touch readings: %.2fus %.2fus %.2fus %.2fus\n", t0, t1, t2, t3);
+}
+
+void touch_pio_init() {
+    // Timing.
+    float clock_mhz = clock_get_hz(clk_sys) / 1000000.0;
+    touch_loop_us = 2 / clock_mhz;
+    touch_timeout_loops = TOUCH_TIMEOUT * clock_mhz / 2;
+    for(uint8_t i=0; i<TOUCH_RING_SIZE; i++) touch_ring[i] = touch_timeout_loops;
+    // State machine.
+    touch_pio = pio0;
+    touch_sm = pio_claim_unused_sm(touch_pio, true);
+    uint offset = pio_add_program(touch_pio, &touch_program);
+    pio_gpio_init(touch_pio, PIN_TOUCH_OUT);
+    pio_sm_set_consecutive_pindirs(touch_pio, touch_sm, PIN_TOUCH_OUT, 1, true);
+    pio_sm_config config = touch_program_get_default_config(offset);
+    sm_config_set_set_pins(&config, PIN_TOUCH_OUT, 1);
+    sm_config_set_jmp_pin(&config, PIN_TOUCH_IN);
+    sm_config_set_clkdiv(&config, 1);
+    pio_sm_init(touch_pio, touch_sm, offset, &config);
+    // Load the timeout into Y while the TX FIFO is still there, then join the
+    // FIFOs so the RX side (measurements) gets the whole 8 entries.
+    pio_sm_put(touch_pio, touch_sm, touch_timeout_loops);
+    pio_sm_exec(touch_pio, touch_sm, pio_encode_pull(false, true));
+    pio_sm_exec(touch_pio, touch_sm, pio_encode_mov(pio_y, pio_osr));
+    sm_config_set_fifo_join(&config, PIO_FIFO_JOIN_RX);
+    pio_sm_set_config(touch_pio, touch_sm, &config);
+    // DMA from the state machine into the ring buffer.
+    touch_dma = dma_claim_unused_channel(true);
+    dma_channel_config dma_config = dma_channel_get_default_config(touch_dma);
+    channel_config_set_transfer_data_size(&dma_config, DMA_SIZE_32);
+    channel_config_set_read_increment(&dma_config, false);
+    channel_config_set_write_increment(&dma_config, true);
+    channel_config_set_ring(&dma_config, true, TOUCH_RING_BITS);
+    channel_config_set_dreq(&dma_config, pio_get_dreq(touch_pio, touch_sm, false));
+    dma_channel_configure(
+        touch_dma,
+        &dma_config,
+        touch_ring,
+        &touch_pio->rxf[touch_sm],
+        UINT32_MAX,
+        true
+    );
+    // Start.
+    pio_sm_set_enabled(touch_pio, touch_sm, true);
 }
 
 void touch_init() {
     info("INIT: Touch\n");
-    gpio_init(PIN_TOUCH_OUT);
-    gpio_set_dir(PIN_TOUCH_OUT, GPIO_OUT);
     gpio_init(PIN_TOUCH_IN);
     gpio_set_dir(PIN_TOUCH_IN, GPIO_IN);
     gpio_set_pulls(PIN_TOUCH_IN, false, false);
+    // PIO init resets the pin function, and with it the GPIO overrides, so the
+    // config (polarity) must be loaded after.
+    touch_pio_init();
     touch_load_from_config();
     touch_log_probe();
 }
@@ -3,15 +3,22 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <pico/stdio.h>
 #include <pico/bootrom.h>
 #include <hardware/watchdog.h>
+#include <hardware/dma.h>
+#include <hardware/uart.h>
+#include <hardware/irq.h>
+#include <hardware/sync.h>
 #include "uart.h"
 #include "config.h"
 #include "self_test.h"
 #include "logging.h"
 #include "power.h"
 #include "esp.h"
+#include "common.h"
 
 void uart_listen_serial_do(bool limited) {
     char input = getchar_timeout_us(0);
@@ -62,60 +69,98 @@ void uart_listen_serial_limited() {
     uart_listen_serial_do(true);
 }
 
-// Ring buffer since RP2040 hardware FIFO is only 32 bytes.
-uint8_t rx_buffer[UART_RX_BUFFER_SIZE];
-static volatile uint16_t write_pos;
-static volatile uint16_t read_pos;
+// Ring buffer since RP2040 hardware FIFO is only 32 bytes. The ring is filled
+// by DMA (address-wrapped) directly from the UART, so there is no interrupt
+// per received byte. The amount of bytes written is derived from the DMA
+// transfer count, and the consumer (main loop) only moves the read position,
+// so no locking is needed.
+static uint8_t rx_buffer[UART_RX_BUFFER_SIZE] __attribute__((aligned(UART_RX_BUFFER_SIZE)));
+static int rx_dma = -1;
+static uint32_t rx_base = 0;  // Bytes received before the last DMA rearm.
+static uint32_t read_pos = 0;  // Bytes consumed, wraps with the ring.
+
+static UartLinkStats stats = {0,};
+static uint8_t rx_seq = 0;
+static bool rx_seq_valid = false;
+static uint8_t tx_seq = 0;
+static uint8_t link_version = UART_LINK_UNKNOWN;
+static uint8_t link_hellos = 0;  // Sent while negotiating.
+static uint32_t link_hello_ts = 0;
 
 void uart_rx_buffer_init() {
-    write_pos = 0;
+    if (rx_dma < 0) rx_dma = dma_claim_unused_channel(true);
+    dma_channel_abort(rx_dma);
+    dma_channel_config dma_config = dma_channel_get_default_config(rx_dma);
+    channel_config_set_transfer_data_size(&dma_config, DMA_SIZE_8);
+    channel_config_set_read_increment(&dma_config, false);
+    channel_config_set_write_increment(&dma_config, true);
+    channel_config_set_ring(&dma_config, true, UART_RX_BUFFER_BITS);
+    channel_config_set_dreq(&dma_config, uart_get_dreq(ESP_UART, false));
+    dma_channel_configure(
+        rx_dma,
+        &dma_config,
+        rx_buffer,
+        &uart_get_hw(ESP_UART)->dr,
+        UINT32_MAX,
+        true
+    );
+    rx_base = 0;
     read_pos = 0;
+    rx_seq_valid = false;
 }
 
-bool uart_rx_buffer_is_empty() {
-    // printf("W %i R %i\n", write_pos, read_pos);
-    return write_pos == read_pos;
+void uart_rx_buffer_deinit() {
+    if (rx_dma >= 0) dma_channel_abort(rx_dma);
 }
 
-bool uart_rx_buffer_is_full() {
-    return ((write_pos + 1) % UART_RX_BUFFER_SIZE) == read_pos;
+// Total bytes written by the DMA since init.
+static uint32_t uart_rx_buffer_received() {
+    if (rx_dma < 0) return read_pos;
+    // The DMA transfer count is finite, rearm if it ever runs out.
+    if (!dma_channel_is_busy(rx_dma)) {
+        rx_base += UINT32_MAX;
+        dma_channel_set_trans_count(rx_dma, UINT32_MAX, true);
+    }
+    return rx_base + (UINT32_MAX - dma_channel_hw_addr(rx_dma)->transfer_count);
 }
 
 uint16_t uart_rx_buffer_available() {
-    if (write_pos >= read_pos) {
-        return write_pos - read_pos;
-    } else {
-        return UART_RX_BUFFER_SIZE - (read_pos - write_pos);
+    uint32_t available = uart_rx_buffer_received() - read_pos;
+    if (available > UART_RX_BUFFER_SIZE) {
+        // The DMA lapped the reader, the oldest data was overwritten. Skip to
+        // the oldest data still valid.
+        warn("UART: RX buffer overrun (%lu bytes lost)\n", available - UART_RX_BUFFER_SIZE);
+        read_pos += available - UART_RX_BUFFER_SIZE;
+        available = UART_RX_BUFFER_SIZE;
     }
+    return available;
 }
 
-void uart_rx_buffer_consume(uint16_t len) {
-    read_pos = (read_pos + len) % UART_RX_BUFFER_SIZE;
+bool uart_rx_buffer_is_empty() {
+    return uart_rx_buffer_available() == 0;
 }
 
-bool uart_rx_buffer_putc(uint8_t byte) {
-    if (uart_rx_buffer_is_full()) {
-        warn("UART: RX buffer full\n");
-        return false;
-    }
-    rx_buffer[write_pos] = byte;
-    write_pos = (write_pos + 1) % UART_RX_BUFFER_SIZE;
-    return true;
+bool uart_rx_buffer_is_full() {
+    return uart_rx_buffer_available() == UART_RX_BUFFER_SIZE;
+}
+
+void uart_rx_buffer_consume(uint16_t len) {
+    read_pos += len;
 }
 
 uint8_t uart_rx_buffer_getc() {
-    uint8_t byte = rx_buffer[read_pos];
+    uint8_t byte = rx_buffer[read_pos & UART_RX_BUFFER_MASK];
     uart_rx_buffer_consume(1);
     return byte;
 }
 
 uint8_t uart_rx_buffer_peekc() {
-    return rx_buffer[read_pos];
+    return rx_buffer[read_pos & UART_RX_BUFFER_MASK];
 }
 
 void uart_rx_buffer_get(uint8_t *dest, uint16_t len) {
-    for(uint8_t i=0; i<len; i++) {
-        dest[i] = rx_buffer[read_pos + i];
+    for(uint16_t i=0; i<len; i++) {
+        dest[i] = rx_buffer[(read_pos + i) & UART_RX_BUFFER_MASK];
     }
     uart_rx_buffer_consume(len);
 }
@@ -123,14 +168,312 @@ void uart_rx_buffer_get(uint8_t *dest, uint16_t len) {
 bool uart_rx_buffer_match(uint8_t *pattern, uint8_t len) {
     if (len > uart_rx_buffer_available()) return false;
     for(uint8_t i=0; i<len; i++) {
-        if (rx_buffer[read_pos+i] != pattern[i]) return false;
+        if (rx_buffer[(read_pos + i) & UART_RX_BUFFER_MASK] != pattern[i]) return false;
     }
     return true;
 }
 
-void uart_rx_irq_callback() {
-    while(uart_is_readable(ESP_UART)) {
-        char c = uart_getc(ESP_UART);
-        uart_rx_buffer_putc(c);
+// Same as get, but without consuming.
+void uart_rx_buffer_peek(uint8_t *dest, uint16_t len) {
+    for(uint16_t i=0; i<len; i++) {
+        dest[i] = rx_buffer[(read_pos + i) & UART_RX_BUFFER_MASK];
+    }
+}
+
+#ifdef UART_FAULT_INJECT
+    static void uart_rx_fault_inject() {
+        static uint32_t injected = 0;
+        uint32_t received = uart_rx_buffer_received();
+        if ((int32_t)(injected - read_pos) < 0) injected = read_pos;
+        for(; injected != received; injected++) {
+            if (rand() % UART_FAULT_INJECT) continue;
+            rx_buffer[injected & UART_RX_BUFFER_MASK] ^= 1 << (rand() % 8);
+        }
     }
+#endif
+
+// Bytes out of frames are log output of the ESP, logged by lines.
+static void uart_rx_log(uint8_t c) {
+    static char line[UART_LOG_LINE_LEN + 1];
+    static uint8_t len = 0;
+    if (c != '\n' && c != '\r') line[len++] = c;
+    if ((c == '\n' && len > 0) || len == UART_LOG_LINE_LEN) {
+        line[len] = 0;
+        info("ESP: %s\n", line);
+        len = 0;
+    }
+}
+
+static void uart_rx_sequence(uint8_t seq) {
+    uint8_t gap = seq - (uint8_t)(rx_seq + 1);
+    if (rx_seq_valid && gap < UART_SEQ_RESTART) stats.rx_lost += gap;
+    rx_seq = seq;
+    rx_seq_valid = true;
+}
+
+// Payload length of a legacy message, zero if not a legacy AT command.
+static uint8_t uart_legacy_len(uint8_t command) {
+    if (command == AT_HID) return AT_HID_LEN;
+    if (command == AT_WEBUSB) return AT_WEBUSB_LEN;
+    if (command == AT_BATTERY) return AT_BATTERY_LEN;
+    if (command == AT_USB_PROTOCOL) return AT_USB_PROTOCOL_LEN;
+    return 0;
+}
+
+// Sequence number of the last valid frame received.
+uint8_t uart_rx_get_seq() {
+    return rx_seq;
+}
+
+// Get the next valid frame received, if any. Invalid frames are skipped only
+// by their SOF byte, so the parser resyncs on the very next SOF candidate
+// (which may be within the corrupted frame) instead of losing the frames that
+// follow.
+bool uart_rx_frame(uint8_t *command, uint8_t *payload, uint8_t *len) {
+    #ifdef UART_FAULT_INJECT
+        uart_rx_fault_inject();
+    #endif
+    uint8_t frame[UART_FRAME_MAX_LEN];
+    while(true) {
+        uint16_t available = uart_rx_buffer_available();
+        if (available == 0) return false;
+        uint8_t c = uart_rx_buffer_peekc();
+        // Link frame.
+        if (c == UART_SOF) {
+            if (available < UART_FRAME_HEADER_LEN) return false;
+            uart_rx_buffer_peek(frame, UART_FRAME_HEADER_LEN);
+            uint8_t size = frame[1];
+            if (size <= AT_WEBUSB_LEN) {
+                uint16_t total = UART_FRAME_HEADER_LEN + size + UART_FRAME_CRC_LEN;
+                if (available < total) return false;  // Wait for the rest.
+                uart_rx_buffer_peek(frame, total);
+                uint16_t crc = frame[total-2] | (frame[total-1] << 8);
+                if (crc == crc16(CRC16_INIT, &frame[1], total - UART_FRAME_CRC_LEN - 1)) {
+                    uart_rx_buffer_consume(total);
+                    uart_rx_sequence(frame[3]);
+                    stats.rx_frames++;
+                    *command = frame[2];
+                    *len = size;
+                    memcpy(payload, &frame[UART_FRAME_HEADER_LEN], size);
+                    return true;
+                }
+            }
+            stats.rx_corrupted++;
+            uart_rx_buffer_consume(1);
+        }
+        // Legacy header (older peers, and ESP battery report).
+        else if (c == UART_CONTROL_0) {
+            uint8_t control[] = {UART_CONTROL_BYTES};
+            bool matched = uart_rx_buffer_match(control, min(available, sizeof(control)));
+            if (matched && available < AT_HEADER_LEN) return false;  // Wait for the rest.
+            uint8_t size = 0;
+            if (matched) {
+                uart_rx_buffer_peek(frame, AT_HEADER_LEN);
+                size = uart_legacy_len(frame[3]);
+            }
+            if (size) {
+                if (available < AT_HEADER_LEN + size) return false;  // Wait for the rest.
+                uart_rx_buffer_consume(AT_HEADER_LEN);
+                uart_rx_buffer_get(payload, size);
+                *command = frame[3];
+                *len = size;
+                return true;
+            }
+            uart_rx_buffer_consume(1);
+        }
+        // Log.
+        else {
+            uart_rx_buffer_consume(1);
+            uart_rx_log(c);
+        }
+    }
+}
+
+// Outbound frames are queued and sent by DMA, so the main loop never waits for
+// the UART. The DMA completion interrupt starts the next frame in the queue.
+typedef struct UartTxFrame_struct {
+    uint8_t len;
+    uint8_t data[UART_FRAME_MAX_LEN];
+} UartTxFrame;
+
+static UartTxFrame tx_queue[UART_TX_QUEUE_SIZE];
+static volatile uint8_t tx_head = 0;  // Next frame to be queued.
+static volatile uint8_t tx_tail = 0;  // Frame being sent, or next to be sent.
+static volatile bool tx_busy = false;
+static bool tx_enabled = false;
+static int tx_dma = -1;
+
+// Start sending the next frame, if any. Must be called with the DMA idle.
+static void uart_tx_start() {
+    if (tx_tail == tx_head) {
+        tx_busy = false;
+        return;
+    }
+    UartTxFrame *frame = &tx_queue[tx_tail % UART_TX_QUEUE_SIZE];
+    tx_busy = true;
+    dma_channel_transfer_from_buffer_now(tx_dma, frame->data, frame->len);
+}
+
+static void uart_tx_irq_callback() {
+    if (!dma_channel_get_irq0_status(tx_dma)) return;
+    dma_channel_acknowledge_irq0(tx_dma);
+    tx_tail++;
+    uart_tx_start();
+}
+
+void uart_tx_init() {
+    if (tx_dma < 0) {
+        tx_dma = dma_claim_unused_channel(true);
+        irq_set_exclusive_handler(DMA_IRQ_0, uart_tx_irq_callback);
+    }
+    dma_channel_abort(tx_dma);
+    dma_channel_config dma_config = dma_channel_get_default_config(tx_dma);
+    channel_config_set_transfer_data_size(&dma_config, DMA_SIZE_8);
+    channel_config_set_read_increment(&dma_config, true);
+    channel_config_set_write_increment(&dma_config, false);
+    channel_config_set_dreq(&dma_config, uart_get_dreq(ESP_UART, true));
+    dma_channel_configure(
+        tx_dma,
+        &dma_config,
+        &uart_get_hw(ESP_UART)->dr,
+        NULL,
+        0,
+        false
+    );
+    tx_head = 0;
+    tx_tail = 0;
+    tx_busy = false;
+    tx_seq = 0;
+    tx_enabled = true;
+    link_version = UART_LINK_UNKNOWN;
+    link_hellos = 0;
+    dma_channel_set_irq0_enabled(tx_dma, true);
+    irq_set_enabled(DMA_IRQ_0, true);
+}
+
+void uart_tx_deinit() {
+    if (tx_dma < 0) return;
+    tx_enabled = false;
+    dma_channel_set_irq0_enabled(tx_dma, false);
+    dma_channel_abort(tx_dma);
+    tx_head = 0;
+    tx_tail = 0;
+    tx_busy = false;
+}
+
+// Compute the CRC of a frame, once the header and payload are in place.
+void uart_frame_seal(uint8_t *frame) {
+    uint8_t size = frame[1];
+    uint16_t crc = crc16(CRC16_INIT, &frame[1], UART_FRAME_HEADER_LEN - 1 + size);
+    frame[UART_FRAME_HEADER_LEN + size] = crc & 0xFF;
+    frame[UART_FRAME_HEADER_LEN + size + 1] = crc >> 8;
+}
+
+// Frame and queue a message to be sent, returns false (and the frame is
+// dropped) if the queue is full. The sequence number is used even if dropped,
+// so the other end accounts for it as lost. Unless the link is framed, it is
+// sent in the legacy format, and commands without legacy format are dropped.
+bool uart_tx_send(uint8_t command, uint8_t *payload, uint8_t len) {
+    len = min(len, AT_WEBUSB_LEN);
+    uint8_t frame[UART_FRAME_MAX_LEN] = {0,};
+    uint8_t total = 0;
+    if (link_version == UART_LINK_FRAMED || command == AT_LINK) {
+        uint8_t header[UART_FRAME_HEADER_LEN] = {UART_SOF, len, command, tx_seq++};
+        memcpy(frame, header, UART_FRAME_HEADER_LEN);
+        memcpy(&frame[UART_FRAME_HEADER_LEN], payload, len);
+        uart_frame_seal(frame);
+        total = UART_FRAME_HEADER_LEN + len + UART_FRAME_CRC_LEN;
+    } else {
+        // Zero-padded to the fixed length of the command.
+        uint8_t size = uart_legacy_len(command);
+        if (!size) return false;
+        uint8_t header[AT_HEADER_LEN] = {UART_CONTROL_BYTES, command};
+        memcpy(frame, header, AT_HEADER_LEN);
+        memcpy(&frame[AT_HEADER_LEN], payload, min(len, size));
+        total = AT_HEADER_LEN + size;
+    }
+    if (!tx_enabled) {
+        // Not in data mode.
+        uart_write_blocking(ESP_UART, frame, total);
+        return true;
+    }
+    if (uart_tx_free() == 0) {
+        stats.tx_dropped++;
+        return false;
+    }
+    UartTxFrame *slot = &tx_queue[tx_head % UART_TX_QUEUE_SIZE];
+    slot->len = total;
+    memcpy(slot->data, frame, total);
+    stats.tx_frames++;
+    uint32_t interrupts = save_and_disable_interrupts();
+    tx_head++;
+    if (!tx_busy) uart_tx_start();
+    restore_interrupts(interrupts);
+    return true;
+}
+
+// Newest queued frame (not yet being sent) with the given AT command and first
+// payload byte, so it can be updated in place (and sealed again). Must be
+// called with interrupts disabled.
+uint8_t* uart_tx_pending(uint8_t command, uint8_t id) {
+    uint8_t first = tx_busy ? tx_tail + 1 : tx_tail;
+    for(uint8_t i=tx_head; i!=first; i--) {
+        UartTxFrame *frame = &tx_queue[(uint8_t)(i - 1) % UART_TX_QUEUE_SIZE];
+        if (
+            frame->data[0] == UART_SOF &&
+            frame->data[2] == command &&
+            frame->data[UART_FRAME_HEADER_LEN] == id
+        ) {
+            return frame->data;
+        }
+    }
+    return NULL;
+}
+
+// Sequence number of the last frame sent.
+uint8_t uart_tx_get_seq() {
+    return tx_seq - 1;
+}
+
+uint8_t uart_tx_free() {
+    return UART_TX_QUEUE_SIZE - (uint8_t)(tx_head - tx_tail);
+}
+
+UartLinkStats uart_get_stats() {
+    stats.version = link_version;
+    return stats;
+}
+
+static void uart_link_hello(bool reply) {
+    uint8_t payload[AT_LINK_LEN] = {UART_LINK_VERSION, reply};
+    uart_tx_send(AT_LINK, payload, AT_LINK_LEN);
+}
+
+// Negotiate the link format (see UART_LINK_UNKNOWN), to be called every tick
+// in data mode.
+void uart_link_task() {
+    if (link_version != UART_LINK_UNKNOWN) return;
+    uint32_t now = time_us_32();
+    if (link_hellos && now - link_hello_ts < UART_LINK_HELLO_INTERVAL * 1000) return;
+    if (link_hellos == UART_LINK_HELLO_MAX) {
+        warn("UART: Link hello not answered, using legacy format (outdated dongle?)\n");
+        link_version = UART_LINK_LEGACY;
+        return;
+    }
+    uart_link_hello(false);
+    link_hellos++;
+    link_hello_ts = now;
+}
+
+// Hello from the other end, which is always a frame. Requests are answered
+// even if already negotiated, since the other end may have restarted.
+void uart_link_handle(uint8_t *payload) {
+    uint8_t version = min(payload[0], UART_LINK_VERSION);
+    if (version != link_version) info("UART: Link version %i\n", version);
+    link_version = version;
+    if (!payload[1]) uart_link_hello(true);
+}
+
+uint8_t uart_link_get_version() {
+    return link_version;
 }
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <tusb.h>
 #include <device/usbd_pvt.h>
 #include "webusb.h"
@@ -16,17 +17,51 @@
 #include "power.h"
 #include "loop.h"
 #include "wireless.h"
+#include "telemetry.h"
 
 uint8_t webusb_buffer[WEBUSB_BUFFER_SIZE] = {0,};
 uint16_t webusb_ptr_in = 0;
 uint16_t webusb_ptr_out = 0;
 bool webusb_timedout = false;
 
-static bool webusb_pending_empty = false;
-static bool webusb_pending_status_share = false;
-static uint8_t webusb_pending_config_share = 0;
-static uint8_t webusb_pending_profile_share = 0;
-static uint8_t webusb_pending_section_share = 0;
+// Outbound queue of control messages (responses to the app), described by
+// kind and arguments, and only built into the transfer buffer when sent.
+// Streamed data (telemetry, bulk profile GET, then logs) is sent when the queue
+// is empty.
+static WebusbTx webusb_tx_queue[WEBUSB_TX_QUEUE_SIZE];
+static uint8_t webusb_tx_queue_len = 0;
+static uint32_t webusb_tx_queue_overflows = 0;
+
+// Messages from the controller relayed by the dongle as they are.
+static Ctrl webusb_tx_relay[WEBUSB_TX_RELAY_SIZE];
+static bool webusb_tx_relay_used[WEBUSB_TX_RELAY_SIZE] = {0,};
+
+// Transfer buffer, several messages can be sent in a single (multi-packet)
+// transfer. Must live until the transfer is completed.
+static Ctrl webusb_tx_buffer[WEBUSB_TX_BATCH];
+// Telemetry alternates with the bulk GET and the logs, so a continuous stream
+// does not starve them (eg: wireless, with a single message per tick).
+static bool webusb_tx_telemetry_turn = true;
+
+// Messages received from the app, waiting to be handled.
+static Ctrl webusb_rx_ring[WEBUSB_RX_RING_SIZE];
+static uint8_t webusb_rx_head = 0;
+static uint8_t webusb_rx_tail = 0;
+
+// Bulk profile GET, sections are streamed with up to a window of them sent
+// ahead of the last acknowledged one.
+static uint8_t bulk_get_profile = PROFILE_NONE;
+static uint8_t bulk_get_next = 0;  // Next section to send.
+static uint8_t bulk_get_acked = 0;  // All sections up to this one received.
+static uint8_t bulk_get_window = 0;
+
+// Bulk profile SET, sections are staged and only applied once all of them are
+// received and the CRC matches.
+static CtrlProfile bulk_set_staging;
+static uint8_t bulk_set_profile = PROFILE_NONE;
+static uint64_t bulk_set_received = 0;  // Bitmap of sections.
+static uint8_t bulk_set_acked = 0;  // Last contiguous section acknowledged.
+static uint8_t bulk_set_window = CTRL_BULK_WINDOW;  // Sender window.
 
 void webusb_flush_force() {
     uint16_t i = 0;
@@ -45,88 +80,159 @@ void webusb_flush_force() {
     }
 }
 
-bool webusb_transfer_wired(Ctrl ctrl) {
-    // Check if TinyUSB device is ready (connected).
-    if (!tud_ready()) return false;
-    // Check if USB endpoint is free.
-    if (usbd_edpt_busy(0, ADDR_WEBUSB_IN)) return false;
+void webusb_queue(WebusbTxKind kind, WebusbTxPriority priority, uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+    WebusbTx tx = {kind, priority, {a, b, c, d}};
+    // Already queued, no need to send it twice.
+    for(uint8_t i=0; i<webusb_tx_queue_len; i++) {
+        if (!memcmp(&webusb_tx_queue[i], &tx, sizeof(WebusbTx))) return;
+    }
+    if (webusb_tx_queue_len == WEBUSB_TX_QUEUE_SIZE) {
+        webusb_tx_queue_overflows++;
+        debug("WebUSB: TX queue full, %lu dropped\n", webusb_tx_queue_overflows);
+        return;
+    }
+    webusb_tx_queue[webusb_tx_queue_len++] = tx;
+}
+
+void webusb_queue_relay(Ctrl *ctrl) {
+    for(uint8_t i=0; i<WEBUSB_TX_RELAY_SIZE; i++) {
+        if (webusb_tx_relay_used[i]) continue;
+        memcpy(&webusb_tx_relay[i], ctrl, sizeof(Ctrl));
+        webusb_tx_relay_used[i] = true;
+        webusb_queue(WEBUSB_TX_RELAY, WEBUSB_TX_NORMAL, i, 0, 0, 0);
+        return;
+    }
+    webusb_tx_queue_overflows++;
+}
+
+bool webusb_queue_pop(WebusbTx *tx) {
+    // Take the first message with the highest priority.
+    if (webusb_tx_queue_len == 0) return false;
+    uint8_t selected = 0;
+    for(uint8_t i=1; i<webusb_tx_queue_len; i++) {
+        if (webusb_tx_queue[i].priority < webusb_tx_queue[selected].priority) {
+            selected = i;
+        }
+    }
+    *tx = webusb_tx_queue[selected];
+    webusb_tx_queue_len--;
+    memmove(
+        &webusb_tx_queue[selected],
+        &webusb_tx_queue[selected+1],
+        (webusb_tx_queue_len - selected) * sizeof(WebusbTx)
+    );
+    return true;
+}
+
+void webusb_tx_build(WebusbTx *tx, Ctrl *ctrl) {
+    uint8_t *arg = tx->args;
+    if (tx->kind == WEBUSB_TX_EMPTY) *ctrl = ctrl_empty();
+    else if (tx->kind == WEBUSB_TX_STATUS) *ctrl = ctrl_status_share();
+    else if (tx->kind == WEBUSB_TX_LINK) *ctrl = ctrl_link_share();
+    else if (tx->kind == WEBUSB_TX_CONFIG) *ctrl = ctrl_config_share(arg[0]);
+    else if (tx->kind == WEBUSB_TX_SECTION) *ctrl = ctrl_section_share(arg[0], arg[1]);
+    else if (tx->kind == WEBUSB_TX_PROFILE_ACK) *ctrl = ctrl_profile_ack(arg[0], arg[1]);
+    else if (tx->kind == WEBUSB_TX_PROFILE_END) {
+        *ctrl = ctrl_profile_end(arg[0], arg[2] | (arg[3] << 8), arg[1]);
+    }
+    else if (tx->kind == WEBUSB_TX_RELAY) {
+        memcpy(ctrl, &webusb_tx_relay[arg[0]], sizeof(Ctrl));
+        webusb_tx_relay_used[arg[0]] = false;
+    }
+}
+
+bool webusb_tx_build_bulk_get(Ctrl *ctrl) {
+    // Build the next message of a bulk profile GET, if any.
+    if (bulk_get_profile == PROFILE_NONE) return false;
+    // Waiting for acks.
+    if (bulk_get_next > bulk_get_acked + bulk_get_window) return false;
+    // Stream sections.
+    if (bulk_get_next <= CTRL_BULK_LAST) {
+        *ctrl = ctrl_profile_share(bulk_get_profile, bulk_get_next);
+        bulk_get_next++;
+        return true;
+    }
+    // All sections acknowledged, end of transfer.
+    if (bulk_get_acked >= CTRL_BULK_LAST) {
+        uint16_t crc = ctrl_profile_crc(config_profile_read(bulk_get_profile));
+        *ctrl = ctrl_profile_end(bulk_get_profile, crc, CTRL_BULK_OK);
+        bulk_get_profile = PROFILE_NONE;
+        return true;
+    }
+    return false;
+}
+
+bool webusb_tx_build_log(Ctrl *ctrl) {
+    if (webusb_ptr_in == 0) return false;
+    uint8_t len = constrain(webusb_ptr_in-webusb_ptr_out, 0, CTRL_MAX_PAYLOAD_SIZE);
+    *ctrl = ctrl_log(webusb_buffer + webusb_ptr_out, len);
+    #ifdef LOGGING_BINARY
+        ctrl->message_type = LOG_BINARY;
+    #endif
+    webusb_ptr_out += len;
+    if (webusb_ptr_out >= webusb_ptr_in) {
+        webusb_ptr_in = 0;
+        webusb_ptr_out = 0;
+    }
+    return true;
+}
+
+bool webusb_tx_ready_wired() {
+    // Check if TinyUSB device is ready (connected), and endpoint is free.
+    return tud_ready() && !usbd_edpt_busy(0, ADDR_WEBUSB_IN);
+}
+
+bool webusb_transfer_wired(Ctrl *ctrl, uint8_t count) {
     // Claim USB endpoint.
     if (!usbd_edpt_claim(0, ADDR_WEBUSB_IN)) return false;
-    // Transfer data.
-    bool success = usbd_edpt_xfer(0, ADDR_WEBUSB_IN, (uint8_t*)&ctrl, ctrl.len+4);
+    // Transfer data. A single message is sent as a short packet, several
+    // messages are sent as full packets so the app reads them one by one.
+    uint16_t len = (count == 1) ? ctrl->len + 4 : count * sizeof(Ctrl);
+    bool success = usbd_edpt_xfer(0, ADDR_WEBUSB_IN, (uint8_t*)ctrl, len);
     // Release USB endpoint.
     usbd_edpt_release(0, ADDR_WEBUSB_IN);
     return success;
 }
 
-bool webusb_transfer(Ctrl ctrl) {
+bool webusb_flush() {
+    // Check if it is possible to send now, and how many messages.
+    uint8_t batch = 0;
+    bool wired = true;
     #if defined DEVICE_IS_ALPAKKA
-        if (loop_get_device_mode() == WIRED) {
-            return webusb_transfer_wired(ctrl);
-        }
-        if (loop_get_device_mode() == WIRELESS) {
-            wireless_send_webusb(ctrl);
-            return true;
-        }
-    #elif defined DEVICE_DONGLE
-        return webusb_transfer_wired(ctrl);
+        wired = loop_get_device_mode() == WIRED;
+        if (loop_get_device_mode() == WIRELESS && wireless_tx_ready()) batch = 1;
     #endif
-    return false;  // Prevent undefined behavior.
-}
-
-bool webusb_flush() {
-    // Check if there is anything to flush.
-    if (
-        webusb_ptr_in == 0 &&
-        !webusb_pending_status_share &&
-        !webusb_pending_config_share &&
-        !webusb_pending_profile_share &&
-        !webusb_pending_section_share
-    ) {
-        return true;
+    if (wired && webusb_tx_ready_wired()) batch = WEBUSB_TX_BATCH;
+    // Build messages in place into the transfer buffer, by priority.
+    uint8_t count = 0;
+    while(count < batch) {
+        Ctrl *ctrl = &webusb_tx_buffer[count];
+        memset(ctrl, 0, sizeof(Ctrl));
+        WebusbTx tx;
+        if (webusb_queue_pop(&tx)) webusb_tx_build(&tx, ctrl);
+        else if (webusb_tx_telemetry_turn && telemetry_pop(ctrl)) webusb_tx_telemetry_turn = false;
+        else if (webusb_tx_build_bulk_get(ctrl)) webusb_tx_telemetry_turn = true;
+        else if (webusb_tx_build_log(ctrl)) webusb_tx_telemetry_turn = true;
+        else if (telemetry_pop(ctrl)) {}
+        else break;
+        count++;
     }
-    // Using static to ensure the variable lives long enough in memory to be
-    // referenced by the transfer underlying mechanisms.
-    static Ctrl ctrl;
-    // Generate message.
-    if (webusb_pending_empty) {
-        ctrl = ctrl_empty();
-        bool sent = webusb_transfer(ctrl);
-        if (sent) webusb_pending_empty = false;
-    } else if (webusb_pending_status_share) {
-        ctrl = ctrl_status_share();
-        bool sent = webusb_transfer(ctrl);
-        if (sent) webusb_pending_status_share = false;
-    } else if (webusb_pending_config_share) {
-        ctrl = ctrl_config_share(webusb_pending_config_share);
-        bool sent = webusb_transfer(ctrl);
-        if (sent) webusb_pending_config_share = 0;
-    } else if (webusb_pending_profile_share || webusb_pending_section_share) {
-        ctrl = ctrl_section_share(webusb_pending_profile_share, webusb_pending_section_share);
-        bool sent = webusb_transfer(ctrl);
-        if (sent) {
-            webusb_pending_profile_share = 0;
-            webusb_pending_section_share = 0;
-        }
+    if (count == 0) return true;
+    // Send.
+    if (wired) {
+        webusb_transfer_wired(webusb_tx_buffer, count);
     } else {
-        uint8_t len = constrain(webusb_ptr_in-webusb_ptr_out, 0, CTRL_MAX_PAYLOAD_SIZE);
-        uint8_t *offset_ptr = webusb_buffer + webusb_ptr_out;
-        ctrl = ctrl_log(offset_ptr, len);
-        bool sent = webusb_transfer(ctrl);
-        if (sent) {
-            webusb_ptr_out += len;
-            if (webusb_ptr_out >= webusb_ptr_in) {
-                webusb_ptr_in = 0;
-                webusb_ptr_out = 0;
-            }
-        }
+        for(uint8_t i=0; i<count; i++) wireless_send_webusb(webusb_tx_buffer[i]);
     }
     return true;
 }
 
 // Queue data to be sent (flushed) to the app later.
 void webusb_write(char *msg) {
-    uint16_t len = strlen(msg);
+    webusb_write_raw((uint8_t*)msg, strlen(msg));
+}
+
+void webusb_write_raw(uint8_t *msg, uint16_t len) {
     // If the buffer is full, ignore the latest messages.
     if (webusb_ptr_in + len >= WEBUSB_BUFFER_SIZE-64-1) {
         return;
@@ -148,8 +254,8 @@ void webusb_write(char *msg) {
 
 void webusb_handle_status_get() {
     debug("WebUSB: Received status GET from app\n");
-    webusb_pending_empty = true;
-    webusb_pending_status_share = true;
+    webusb_queue(WEBUSB_TX_EMPTY, WEBUSB_TX_HIGH, 0, 0, 0, 0);
+    webusb_queue(WEBUSB_TX_STATUS, WEBUSB_TX_HIGH, 0, 0, 0, 0);
 }
 
 void webusb_handle_status_set(uint8_t time[8]) {
@@ -167,26 +273,110 @@ void webusb_handle_proc(uint8_t proc) {
 }
 
 void webusb_handle_config_get(Ctrl_cfg_type key) {
-    webusb_pending_config_share = key;
+    webusb_queue(WEBUSB_TX_CONFIG, WEBUSB_TX_NORMAL, key, 0, 0, 0);
 }
 
 void webusb_handle_section_get(uint8_t profile, uint8_t section) {
-    webusb_pending_profile_share = profile;
-    webusb_pending_section_share = section;
+    if (profile >= NVM_PROFILE_SLOTS || section >= CTRL_PROFILE_SECTIONS) return;
+    webusb_queue(WEBUSB_TX_SECTION, WEBUSB_TX_NORMAL, profile, section, 0, 0);
 }
 
 void webusb_handle_section_set(uint8_t profileIndex, uint8_t sectionIndex, uint8_t section[58]) {
     debug("WebUSB: Handle profile SET %i %i\n", profileIndex, sectionIndex);
-    // Update profile in config.
-    CtrlProfile *profile_cfg = config_profile_read(profileIndex);
-    memcpy(&profile_cfg->sections[sectionIndex], section, sizeof(CtrlSection));
-    // Update profile runtime.
-    Profile *profile = profile_get(profileIndex);
-    profile->load_from_config(profile, profile_cfg);
-    config_profile_set_sync(profileIndex, false);
+    // Out of range requests are dropped without confirmation.
+    if (profileIndex >= NVM_PROFILE_SLOTS || sectionIndex >= CTRL_PROFILE_SECTIONS) return;
+    // Update profile in config (saved later on sync).
+    bool changed = config_profile_set_section(profileIndex, sectionIndex, section);
+    // Update profile runtime, if currently built.
+    if (changed) profile_reload(profileIndex);
     // Send back data as confirmation.
-    webusb_pending_profile_share = profileIndex;
-    webusb_pending_section_share = sectionIndex;
+    webusb_queue(WEBUSB_TX_SECTION, WEBUSB_TX_NORMAL, profileIndex, sectionIndex, 0, 0);
+}
+
+void webusb_handle_profile_get(uint8_t profile, uint8_t window, uint8_t first) {
+    // Start (or restart from a given section) a bulk profile GET.
+    debug("WebUSB: Handle profile GET %i\n", profile);
+    if (profile >= NVM_PROFILE_SLOTS) return;
+    bulk_get_profile = profile;
+    bulk_get_next = max(first, CTRL_BULK_FIRST);
+    bulk_get_acked = bulk_get_next - 1;
+    bulk_get_window = window ? window : CTRL_BULK_WINDOW;
+}
+
+void webusb_handle_profile_ack(uint8_t profile, uint8_t section) {
+    if (profile != bulk_get_profile) return;
+    bulk_get_acked = max(bulk_get_acked, section);
+}
+
+void webusb_handle_profile_set_start(uint8_t profile, uint8_t window) {
+    debug("WebUSB: Handle profile SET %i window=%i\n", profile, window);
+    memcpy(&bulk_set_staging, config_profile_read(profile), sizeof(CtrlProfile));
+    bulk_set_profile = profile;
+    bulk_set_received = 0;
+    bulk_set_acked = CTRL_BULK_FIRST - 1;
+    bulk_set_window = window ? window : CTRL_BULK_WINDOW;
+}
+
+void webusb_handle_profile_set(uint8_t profile, uint8_t section, uint8_t data[58]) {
+    if (profile >= NVM_PROFILE_SLOTS) return;
+    // Section zero is not transferred, it (re)starts a transfer carrying the
+    // sender window. Otherwise a new transfer uses the default window.
+    if (section == 0) {
+        webusb_handle_profile_set_start(profile, data[0]);
+        return;
+    }
+    if (!is_between(section, CTRL_BULK_FIRST, CTRL_BULK_LAST)) return;
+    if (profile != bulk_set_profile) webusb_handle_profile_set_start(profile, 0);
+    // A section received twice means the sender is retransmitting (eg: the
+    // last ack was lost), so it is acknowledged again.
+    bool duplicate = bulk_set_received & ((uint64_t)1 << section);
+    memcpy(&bulk_set_staging.sections[section], data, sizeof(CtrlSection));
+    bulk_set_received |= (uint64_t)1 << section;
+    // Acknowledge once a whole window of the sender is received, and when all
+    // sections are received.
+    uint8_t contiguous = CTRL_BULK_FIRST - 1;
+    while(
+        contiguous < CTRL_BULK_LAST &&
+        (bulk_set_received & ((uint64_t)1 << (contiguous + 1)))
+    ) {
+        contiguous++;
+    }
+    bool complete = contiguous == CTRL_BULK_LAST;
+    if (complete || duplicate || contiguous >= bulk_set_acked + bulk_set_window) {
+        webusb_queue(WEBUSB_TX_PROFILE_ACK, WEBUSB_TX_HIGH, profile, contiguous, 0, 0);
+        bulk_set_acked = contiguous;
+    }
+}
+
+void webusb_handle_profile_end(uint8_t profile, uint16_t crc) {
+    if (profile != bulk_set_profile) return;
+    uint64_t all = (UINT64_MAX >> (63 - CTRL_BULK_LAST)) & ~((1ULL << CTRL_BULK_FIRST) - 1);
+    uint16_t staged_crc = ctrl_profile_crc(&bulk_set_staging);
+    uint8_t status = CTRL_BULK_OK;
+    if ((bulk_set_received & all) != all) {
+        warn("WebUSB: Profile SET %i missing sections\n", profile);
+        status = CTRL_BULK_ERROR_MISSING;
+    } else if (staged_crc != crc) {
+        warn("WebUSB: Profile SET %i CRC mismatch\n", profile);
+        status = CTRL_BULK_ERROR_CRC;
+    } else {
+        // Apply all sections at once, only modified ones are tracked as dirty.
+        bool changed = false;
+        for(uint8_t i=CTRL_BULK_FIRST; i<=CTRL_BULK_LAST; i++) {
+            uint8_t *section = (uint8_t*)&bulk_set_staging.sections[i];
+            changed |= config_profile_set_section(profile, i, section);
+        }
+        if (changed) profile_reload(profile);
+    }
+    webusb_queue(
+        WEBUSB_TX_PROFILE_END,
+        WEBUSB_TX_HIGH,
+        profile,
+        status,
+        staged_crc & 0xFF,
+        staged_crc >> 8
+    );
+    bulk_set_profile = PROFILE_NONE;
 }
 
 // Handle incomming message.
@@ -196,7 +386,8 @@ void webusb_handle(Ctrl ctrl) {
     if (ctrl.message_type == STATUS_SET) webusb_handle_status_set(ctrl.payload);
     if (ctrl.message_type == CONFIG_GET) webusb_handle_config_get(ctrl.payload[0]);
     if (ctrl.message_type == CONFIG_SET) {
-        webusb_pending_config_share = ctrl.payload[0];  // Echo / confirmation.
+        // Echo / confirmation.
+        webusb_queue(WEBUSB_TX_CONFIG, WEBUSB_TX_NORMAL, ctrl.payload[0], 0, 0, 0);
         ctrl_config_set(
             ctrl.payload[0],  // Config index.
             ctrl.payload[1],  // Preset index.
@@ -216,27 +407,94 @@ void webusb_handle(Ctrl ctrl) {
     if (ctrl.message_type == PROFILE_OVERWRITE) {
         config_profile_overwrite(ctrl.payload[0], ctrl.payload[1]);
     }
+    if (ctrl.message_type == PROFILE_GET) {
+        webusb_handle_profile_get(ctrl.payload[0], ctrl.payload[1], ctrl.payload[2]);
+    }
+    if (ctrl.message_type == PROFILE_ACK) {
+        webusb_handle_profile_ack(ctrl.payload[0], ctrl.payload[1]);
+    }
+    if (ctrl.message_type == PROFILE_SET) {
+        webusb_handle_profile_set(ctrl.payload[0], ctrl.payload[1], &ctrl.payload[2]);
+    }
+    if (ctrl.message_type == PROFILE_END) {
+        uint16_t crc = ctrl.payload[2] | (ctrl.payload[3] << 8);
+        webusb_handle_profile_end(ctrl.payload[0], crc);
+    }
+    if (ctrl.message_type == TELEMETRY_SET) {
+        telemetry_set(ctrl.payload[0], ctrl.payload[1]);
+    }
+    if (ctrl.message_type == LINK_GET) {
+        webusb_queue(WEBUSB_TX_LINK, WEBUSB_TX_NORMAL, 0, 0, 0, 0);
+    }
+}
+
+void webusb_rx_pull() {
+    // Move received packets from the vendor interface FIFO into the ring. The
+    // FIFO holds a single packet, so each read is exactly one message. If the
+    // ring is full the packet is left in the FIFO, which keeps the endpoint
+    // NAKing until there is room (backpressure to the app).
+    while(
+        tud_vendor_n_available(0) > 0 &&
+        (uint8_t)(webusb_rx_head - webusb_rx_tail) < WEBUSB_RX_RING_SIZE
+    ) {
+        Ctrl *ctrl = &webusb_rx_ring[webusb_rx_head % WEBUSB_RX_RING_SIZE];
+        memset(ctrl, 0, sizeof(Ctrl));
+        tud_vendor_n_read(0, ctrl, sizeof(Ctrl));
+        webusb_rx_head++;
+    }
+}
+
+// TinyUSB callback, invoked (from tud_task) when a transfer is completed.
+void tud_vendor_rx_cb(uint8_t itf, uint8_t const* buffer, uint16_t bufsize) {
+    webusb_rx_pull();
+}
+
+bool webusb_is_heavy(Ctrl *ctrl) {
+    // Messages that may take several milliseconds to handle.
+    return (
+        ctrl->message_type == PROC ||
+        ctrl->message_type == PROFILE_OVERWRITE ||
+        ctrl->message_type == PROFILE_END
+    );
 }
 
 void webusb_read() {
-    // Parse data coming from the app.
-    if (!tud_ready() || usbd_edpt_busy(0, ADDR_WEBUSB_OUT)) return;
-    // Using static to ensure the variable lives long enough in memory to be
-    // referenced by the transfer underlying mechanisms.
-    static Ctrl ctrl;
-    usbd_edpt_claim(0, ADDR_WEBUSB_OUT);
-    usbd_edpt_xfer(0, ADDR_WEBUSB_OUT, (uint8_t*)&ctrl, 64);
-    usbd_edpt_release(0, ADDR_WEBUSB_OUT);
-    // Wireless switch.
-    if (ctrl.protocol_flags == CTRL_FLAG_WIRELESS) {
-        // Redirect to wireless controller.
-        wireless_send_webusb(ctrl);
-    } else {
-        // Handle locally.
-        webusb_handle(ctrl);
+    // Handle messages received from the app, within a budget per tick.
+    webusb_rx_pull();
+    uint8_t budget = WEBUSB_RX_BUDGET;
+    while(budget > 0 && webusb_rx_tail != webusb_rx_head) {
+        Ctrl *ctrl = &webusb_rx_ring[webusb_rx_tail % WEBUSB_RX_RING_SIZE];
+        // Messages to be relayed wait while the UART link is behind.
+        if (ctrl->protocol_flags == CTRL_FLAG_WIRELESS && !wireless_tx_ready()) break;
+        // Messages to be handled wait while there is no room for their
+        // responses, so the ring fills and the endpoint NAKs instead of the
+        // responses being dropped.
+        bool room = WEBUSB_TX_QUEUE_SIZE - webusb_tx_queue_len >= WEBUSB_TX_QUEUE_RESERVE;
+        if (ctrl->protocol_flags != CTRL_FLAG_WIRELESS && !room) break;
+        // Heavy messages are handled alone in a tick.
+        if (webusb_is_heavy(ctrl)) {
+            if (budget < WEBUSB_RX_BUDGET) break;
+            budget = 0;
+        } else {
+            budget--;
+        }
+        // Wireless switch.
+        if (ctrl->protocol_flags == CTRL_FLAG_WIRELESS) {
+            // Redirect to wireless controller.
+            wireless_send_webusb(*ctrl);
+        } else {
+            // Handle locally.
+            webusb_handle(*ctrl);
+        }
+        webusb_rx_tail++;
     }
+    webusb_rx_pull();
+}
+
+uint32_t webusb_get_tx_overflows() {
+    return webusb_tx_queue_overflows;
 }
 
-void webusb_set_pending_config_share(bool value) {
-    webusb_pending_config_share = value;
+void webusb_set_pending_config_share(uint8_t key) {
+    webusb_queue(WEBUSB_TX_CONFIG, WEBUSB_TX_NORMAL, key, 0, 0, 0);
 }
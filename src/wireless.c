@@ -2,9 +2,11 @@
 // Copyright (C) 2022, Input Labs Oy.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <pico/time.h>
 #include <hardware/uart.h>
+#include <hardware/sync.h>
 #include "wireless.h"
 #include "config.h"
 #include "pin.h"
@@ -19,6 +21,11 @@
 
 static bool uart_data_mode = false;
 
+// Latest state-changing report of each type, until acknowledged by the dongle.
+// Indexed by ReportType.
+static WirelessPending wireless_pending[REPORT_XINPUT + 1];
+static WirelessStats wireless_stats = {.rto = WIRELESS_RTO_INIT};
+
 void wireless_set_uart_data_mode(bool mode) {
     info("RF: data_mode=%i\n", mode);
     uart_data_mode = mode;
@@ -28,10 +35,11 @@ void wireless_set_uart_data_mode(bool mode) {
         uart_init(ESP_UART, ESP_DATA_BAUD);
         info("RF: UART1 init (%i)\n", ESP_DATA_BAUD);
         uart_rx_buffer_init();
-        irq_set_exclusive_handler(UART1_IRQ, uart_rx_irq_callback);
-        irq_set_enabled(UART1_IRQ, true);
-        uart_set_irq_enables(ESP_UART, true, false);  // RX - TX
+        uart_tx_init();
+        memset(wireless_pending, 0, sizeof(wireless_pending));
     } else {
+        uart_rx_buffer_deinit();
+        uart_tx_deinit();
         uart_deinit(ESP_UART);
         uart_init(ESP_UART, ESP_BOOTLOADER_BAUD);
         info("RF: UART1 init (%i)\n", ESP_BOOTLOADER_BAUD);
@@ -51,118 +59,254 @@ void wireless_init() {
     #endif
 }
 
+// If the link is behind, and a mouse report is still waiting in the queue,
+// add the new deltas into it instead of queuing another report. Only if the
+// buttons are the same, so button changes (eg: a fast click) are never lost.
+bool wireless_coalesce_mouse(MouseReport *report, uint8_t *seq) {
+    bool coalesced = false;
+    uint32_t interrupts = save_and_disable_interrupts();
+    uint8_t *pending = uart_tx_pending(AT_HID, REPORT_MOUSE);
+    uint8_t *payload = pending ? &pending[UART_FRAME_HEADER_LEN + 1] : NULL;
+    if (pending && ((MouseReport*)payload)->buttons == report->buttons) {
+        *seq = pending[3];
+        MouseReport merged;
+        memcpy(&merged, payload, sizeof(MouseReport));
+        merged.x = constrain(merged.x + report->x, INT16_MIN, INT16_MAX);
+        merged.y = constrain(merged.y + report->y, INT16_MIN, INT16_MAX);
+        merged.scroll = constrain(merged.scroll + report->scroll, INT8_MIN, INT8_MAX);
+        merged.pan = constrain(merged.pan + report->pan, INT8_MIN, INT8_MAX);
+        memcpy(payload, &merged, sizeof(MouseReport));
+        uart_frame_seal(pending);
+        coalesced = true;
+    }
+    restore_interrupts(interrupts);
+    return coalesced;
+}
+
+void wireless_rtt_sample(uint32_t rtt) {
+    // Smoothed RTT and variation, and the timeout derived from them, same as
+    // TCP (RFC 6298).
+    WirelessStats *stats = &wireless_stats;
+    if (!stats->srtt) {
+        stats->srtt = rtt;
+        stats->rttvar = rtt / 2;
+    } else {
+        int32_t error = (int32_t)rtt - (int32_t)stats->srtt;
+        int32_t variation = abs(error) - (int32_t)stats->rttvar;
+        stats->rttvar += variation / 4;
+        stats->srtt += error / 8;
+    }
+    stats->rto = constrain(stats->srtt + (4 * stats->rttvar), WIRELESS_RTO_MIN, WIRELESS_RTO_MAX);
+}
+
+// Keep the latest report of each type until acknowledged. Mouse reports are
+// only kept when buttons change, and without deltas, since lost movement is
+// not worth retransmitting.
+void wireless_track(uint8_t report_id, void *payload, uint8_t len, uint8_t seq) {
+    if (!is_between(report_id, REPORT_KEYBOARD, REPORT_XINPUT)) return;
+    // Nothing is acknowledged over the legacy format, hid.c replays instead.
+    if (uart_link_get_version() != UART_LINK_FRAMED) return;
+    WirelessPending *pending = &wireless_pending[report_id];
+    MouseReport stripped;
+    if (report_id == REPORT_MOUSE) {
+        MouseReport *report = payload;
+        MouseReport *last = (MouseReport*)pending->report;
+        if (report->buttons == last->buttons && !pending->pending) return;
+        stripped = (MouseReport){report->buttons, 0, 0, 0, 0};
+        payload = &stripped;
+        len = sizeof(MouseReport);
+    }
+    pending->pending = true;
+    pending->seq = seq;
+    pending->retries = 0;
+    pending->len = len;
+    pending->sent_ts = time_us_32();
+    memcpy(pending->report, payload, len);
+    wireless_stats.tracked++;
+}
+
 void wireless_send_hid(uint8_t report_id, void *payload, uint8_t len) {
-    uint8_t message[AT_HEADER_LEN+AT_HID_LEN] = {UART_CONTROL_BYTES, AT_HID, report_id,};
-    memcpy(&message[AT_HEADER_LEN+1], payload, len);
-    uart_write_blocking(ESP_UART, message, AT_HEADER_LEN+AT_HID_LEN);
+    len = min(len, AT_HID_LEN - 1);
+    uint8_t seq = 0;
+    if (report_id == REPORT_MOUSE && wireless_coalesce_mouse(payload, &seq)) {
+        // Merged into a report still in the queue.
+    } else {
+        uint8_t message[AT_HID_LEN] = {report_id,};
+        memcpy(&message[1], payload, len);
+        uart_tx_send(AT_HID, message, len + 1);
+        seq = uart_tx_get_seq();
+    }
+    wireless_track(report_id, payload, len, seq);
+}
+
+// Retransmit the reports not acknowledged in time, with exponential backoff.
+void wireless_retransmit() {
+    uint32_t now = time_us_32();
+    for(uint8_t i=REPORT_KEYBOARD; i<=REPORT_XINPUT; i++) {
+        WirelessPending *pending = &wireless_pending[i];
+        if (!pending->pending) continue;
+        uint32_t timeout = min(wireless_stats.rto << pending->retries, WIRELESS_RTO_MAX);
+        if (now - pending->sent_ts < timeout) continue;
+        if (pending->retries >= WIRELESS_RETRANSMIT_MAX) {
+            pending->pending = false;
+            wireless_stats.failed++;
+            continue;
+        }
+        if (!wireless_tx_ready()) return;
+        uint8_t message[AT_HID_LEN] = {i,};
+        memcpy(&message[1], pending->report, pending->len);
+        uart_tx_send(AT_HID, message, pending->len + 1);
+        pending->seq = uart_tx_get_seq();
+        pending->sent_ts = now;
+        pending->retries++;
+        wireless_stats.retransmits++;
+    }
+}
+
+void wireless_handle_ack(uint8_t seq) {
+    uint32_t now = time_us_32();
+    for(uint8_t i=REPORT_KEYBOARD; i<=REPORT_XINPUT; i++) {
+        WirelessPending *pending = &wireless_pending[i];
+        if (!pending->pending || pending->seq != seq) continue;
+        pending->pending = false;
+        wireless_stats.acked++;
+        // Only the first transmissions are valid RTT samples, since it is not
+        // known which transmission an acknowledge belongs to (Karn's algorithm).
+        if (pending->retries == 0) wireless_rtt_sample(now - pending->sent_ts);
+    }
+}
+
+void wireless_send_ack(uint8_t seq) {
+    uart_tx_send(AT_ACK, &seq, 1);
+}
+
+WirelessStats wireless_get_stats() {
+    return wireless_stats;
 }
 
 void wireless_send_webusb(Ctrl ctrl) {
     ctrl.protocol_flags = CTRL_FLAG_WIRELESS;
-    uint8_t message[AT_HEADER_LEN+AT_WEBUSB_LEN] = {UART_CONTROL_BYTES, AT_WEBUSB,};
-    memcpy(&message[AT_HEADER_LEN], (uint8_t*)&ctrl, AT_WEBUSB_LEN);
-    uart_write_blocking(ESP_UART, message, AT_HEADER_LEN+AT_WEBUSB_LEN);
+    // Only the used part of the message is sent.
+    uint8_t len = CTRL_NON_PAYLOAD_SIZE + min(ctrl.len, CTRL_MAX_PAYLOAD_SIZE);
+    uart_tx_send(AT_WEBUSB, (uint8_t*)&ctrl, len);
 }
 
 void wireless_send_usb_protocol(Protocol protocol) {
-    uint8_t message[AT_HEADER_LEN+AT_USB_PROTOCOL_LEN] = {UART_CONTROL_BYTES, AT_USB_PROTOCOL,};
-    message[AT_HEADER_LEN] = protocol;
-    uart_write_blocking(ESP_UART, message, AT_HEADER_LEN+AT_USB_PROTOCOL_LEN);
+    uint8_t message[AT_USB_PROTOCOL_LEN] = {protocol};
+    uart_tx_send(AT_USB_PROTOCOL, message, AT_USB_PROTOCOL_LEN);
 }
 
-void wireless_uart_commands() {
-    static uint8_t i = 0;
-    static uint8_t command = 0;
-    static uint8_t payload[AT_PAYLOAD_MAX_LEN] = {0,};
-    while(!uart_rx_buffer_is_empty()) {
-        char c = uart_rx_buffer_getc();
-        // Check control bytes.
-        if (i < 3) {
-            if (
-                (i==0 && c==UART_CONTROL_0) ||
-                (i==1 && c==UART_CONTROL_1) ||
-                (i==2 && c==UART_CONTROL_2)
-            ) {
-                i += 1;
-            } else {
-                i = 0;
-                // Redirect to RP2040 uart log.
-                info("%c", c);
-            }
+// Backpressure, if the outbound queue is behind new reports should wait.
+bool wireless_tx_ready() {
+    return uart_tx_free() >= UART_TX_READY_MIN;
+}
+
+void wireless_handle_battery(uint8_t *payload) {
+    #ifdef DEVICE_ALPAKKA_V1
+        // Convert to 32 bit.
+        uint32_t battery_level = 0;
+        memcpy(&battery_level, payload, 4);
+        // Optional logging.
+        if (logging_has_mask(LOG_WIRELESS)) {
+            float normalized = ((float)battery_level - BATTERY_MIN) / BATTERY_CAPACITY;
+            float percentage = fmax(0, fmin(100, normalized * 100));
+            info("RF: Battery at %.0f%% (%lu)\n", percentage, battery_level);
         }
-        // Get AT command.
-        else if (i == 3) {
-            if (c >= AT_HID && c <= AT_USB_PROTOCOL) {
-                command = c;
-                i += 1;
-            } else {
-                i = 0;
-                warn("UART: AT command unknown %i\n", c);
+        if (battery_level < BATTERY_LOW_THRESHOLD) {
+            loop_set_battery_low(true);
+            static bool battery_low_was_triggered = false;
+            if (!battery_low_was_triggered) {
+                config_set_problem(PROBLEM_LOW_BATTERY, true);
+                battery_low_was_triggered = true;
             }
+        } else {
+            loop_set_battery_low(false);
+        }
+    #endif
+}
+
+void wireless_uart_commands() {
+    uint8_t command = 0;
+    uint8_t len = 0;
+    uint8_t payload[AT_WEBUSB_LEN];
+    while(true) {
+        // Shorter messages are zero-padded.
+        memset(payload, 0, AT_WEBUSB_LEN);
+        if (!uart_rx_frame(&command, payload, &len)) break;
+        if (command == AT_HID) {
+            hid_report_dongle(payload[0], &payload[1]);
+            wireless_send_ack(uart_rx_get_seq());
+        }
+        else if (command == AT_WEBUSB) {
+            Ctrl ctrl = {0,};
+            memcpy(&ctrl, payload, AT_WEBUSB_LEN);
+            #ifdef DEVICE_DONGLE
+                // Ctrl message from controller, gets read at dongle uart,
+                // and queued to be sent to the USB.
+                webusb_queue_relay(&ctrl);
+            #else
+                // Ctrl message from dongle, gets read at controller uart,
+                // and is handled as if received via USB.
+                webusb_handle(ctrl);
+            #endif
+        }
+        else if (command == AT_BATTERY) {
+            wireless_handle_battery(payload);
+        }
+        else if (command == AT_USB_PROTOCOL) {
+            config_set_protocol(payload[0]);
+        }
+        else if (command == AT_ACK) {
+            wireless_handle_ack(payload[0]);
+        }
+        else if (command == AT_LINK) {
+            uart_link_handle(payload);
         }
-        // Get payload.
         else {
-            payload[i-AT_HEADER_LEN] = c;
-            i += 1;
-            // Payload complete.
-            if (command==AT_HID && i==AT_HEADER_LEN+AT_HID_LEN) {
-                hid_report_dongle(payload[0], &payload[1]);
-                i = 0;
-                command = 0;
-            }
-            else if (command==AT_WEBUSB && i==AT_HEADER_LEN+AT_WEBUSB_LEN) {
-                Ctrl ctrl = {0,};
-                memcpy(&ctrl, payload, AT_WEBUSB_LEN);
-                #ifdef DEVICE_DONGLE
-                    // Ctrl message from controller, gets read at dongle uart,
-                    // and sent to the USB.
-                    webusb_transfer_wired(ctrl);
-                #else
-                    // Ctrl message from dongle, gets read at controller uart,
-                    // and is handled as if received via USB.
-                    webusb_handle(ctrl);
-                #endif
-                i = 0;
-                command = 0;
-            }
-            else if (command==AT_BATTERY && i==AT_HEADER_LEN+AT_BATTERY_LEN) {
-                #ifdef DEVICE_ALPAKKA_V1
-                    // Convert to 32 bit.
-                    uint32_t battery_level = 0;
-                    memcpy(&battery_level, payload, 4);
-                    // Optional logging.
-                    if (logging_has_mask(LOG_WIRELESS)) {
-                        float normalized = ((float)battery_level - BATTERY_MIN) / BATTERY_CAPACITY;
-                        float percentage = fmax(0, fmin(100, normalized * 100));
-                        info("RF: Battery at %.0f%% (%lu)\n", percentage, battery_level);
-                    }
-                    if (battery_level < BATTERY_LOW_THRESHOLD) {
-                        loop_set_battery_low(true);
-                        static bool battery_low_was_triggered = false;
-                        if (!battery_low_was_triggered) {
-                            config_set_problem(PROBLEM_LOW_BATTERY, true);
-                            battery_low_was_triggered = true;
-                        }
-                    } else {
-                        loop_set_battery_low(false);
-                    }
-                #endif
-                i = 0;
-                command = 0;
-            }
-            else if (command==AT_USB_PROTOCOL && i==AT_HEADER_LEN+AT_USB_PROTOCOL_LEN) {
-                config_set_protocol(payload[0]);
-            }
+            warn("UART: AT command unknown %i\n", command);
         }
     }
 }
 
+void wireless_log_stats() {
+    if (!logging_has_mask(LOG_WIRELESS)) return;
+    static uint16_t i = 0;
+    i++;
+    // Once every 5 seconds.
+    if (i % (CFG_TICK_FREQUENCY * 5)) return;
+    UartLinkStats stats = uart_get_stats();
+    info(
+        "RF: link=%lu tx=%lu dropped=%lu rx=%lu corrupted=%lu lost=%lu\n",
+        stats.version,
+        stats.tx_frames,
+        stats.tx_dropped,
+        stats.rx_frames,
+        stats.rx_corrupted,
+        stats.rx_lost
+    );
+    #ifdef DEVICE_IS_ALPAKKA
+        info(
+            "RF: srtt=%luus rto=%luus tracked=%lu retransmits=%lu failed=%lu\n",
+            wireless_stats.srtt,
+            wireless_stats.rto,
+            wireless_stats.tracked,
+            wireless_stats.retransmits,
+            wireless_stats.failed
+        );
+    #endif
+}
+
 void wireless_controller_task() {
+    uart_link_task();
     hid_report_wireless();
     wireless_uart_commands();
+    wireless_retransmit();
+    wireless_log_stats();
 }
 
 void wireless_dongle_task() {
     // led_task();
+    uart_link_task();
     wireless_uart_commands();
+    wireless_log_stats();
 }
@@ -0,0 +1,368 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+/*
+Fake implementations of the SDK functions and of the firmware modules that are
+not under test, so firmware modules can be built natively and driven from the
+host tests.
+
+Time only moves when the test advances it (fake_advance), and the HID layer
+records every press and release (including the delayed ones, which are applied
+when the time reaches them) so the tests can check the actions engaged.
+
+The DMA channels do not run: the tests write the received data into their
+destinations, and the transfers from buffers (UART output) are recorded at once
+(fake_uart_tx), with the completion interrupt run by fake_dma_irq0().
+
+Flash is an array mapped at XIP_BASE, with the granularity of the real one:
+whole sectors are erased to 0xFF, and programming whole pages can only clear
+bits. A power cut can be set at any operation, which is then only applied up
+to a number of bytes before jumping back to the test (fake_flash_cut).
+*/
+
+#include <stdarg.h>
+#include <string.h>
+#include "sdk.h"
+#include "fakes.h"
+#include "hid.h"
+#include "mapping.h"
+
+int test_failures = 0;
+uint64_t fake_time = 0;
+uint32_t fake_gpio = 0xFFFFFFFF;  // Pulled up, nothing pressed.
+FakeHidEvent fake_hid_log[FAKE_HID_LOG_SIZE];
+uint8_t fake_hid_log_len = 0;
+
+typedef struct FakeHidLater_struct {
+    bool pending;
+    uint64_t ts;
+    uint8_t key;
+    bool press;
+} FakeHidLater;
+
+static FakeHidLater fake_hid_later[FAKE_HID_LATER_SIZE];
+static int8_t fake_hid_state[256];
+
+uint8_t fake_uart_tx[FAKE_UART_TX_SIZE];
+uint16_t fake_uart_tx_len = 0;
+
+uint8_t fake_flash[FAKE_FLASH_SIZE];
+uint32_t fake_flash_ops = 0;  // Erase and program operations done.
+jmp_buf fake_flash_cut;
+uint32_t fake_flash_cut_addr = 0;  // Operation during which the power was cut.
+static uint32_t fake_flash_cut_op = FAKE_FLASH_CUT_NONE;
+static uint16_t fake_flash_cut_bytes = 0;
+static uint32_t fake_flash_erase_count[FAKE_FLASH_SIZE / FLASH_SECTOR_SIZE];
+
+void fake_reset() {
+    fake_time = 1000000;
+    fake_gpio = 0xFFFFFFFF;
+    fake_hid_log_len = 0;
+    fake_uart_tx_len = 0;
+    memset(fake_hid_later, 0, sizeof(fake_hid_later));
+    memset(fake_hid_state, 0, sizeof(fake_hid_state));
+}
+
+static void fake_hid_record(uint8_t key, bool press) {
+    fake_hid_state[key] = press;
+    if (fake_hid_log_len == FAKE_HID_LOG_SIZE) return;
+    fake_hid_log[fake_hid_log_len++] = (FakeHidEvent){fake_time, key, press};
+}
+
+static void fake_hid_schedule(uint8_t key, bool press, uint16_t delay) {
+    for(uint8_t i=0; i<FAKE_HID_LATER_SIZE; i++) {
+        if (fake_hid_later[i].pending) continue;
+        fake_hid_later[i] = (FakeHidLater){true, fake_time + (delay * 1000), key, press};
+        return;
+    }
+    printf("  FAIL: Too many delayed HID actions\n");
+    test_failures++;
+}
+
+void fake_advance(uint64_t us) {
+    fake_time += us;
+    for(uint8_t i=0; i<FAKE_HID_LATER_SIZE; i++) {
+        FakeHidLater *later = &fake_hid_later[i];
+        if (!later->pending || later->ts > fake_time) continue;
+        later->pending = false;
+        fake_hid_record(later->key, later->press);
+    }
+}
+
+uint8_t fake_hid_count(uint8_t key, bool press) {
+    uint8_t count = 0;
+    for(uint8_t i=0; i<fake_hid_log_len; i++) {
+        if (fake_hid_log[i].key == key && fake_hid_log[i].press == press) count++;
+    }
+    return count;
+}
+
+bool fake_hid_pressed(uint8_t key) {
+    return fake_hid_state[key];
+}
+
+void fake_flash_reset() {
+    memset(fake_flash, 0xFF, sizeof(fake_flash));
+    memset(fake_flash_erase_count, 0, sizeof(fake_flash_erase_count));
+    fake_flash_ops = 0;
+    fake_flash_cut_op = FAKE_FLASH_CUT_NONE;
+}
+
+// Cut the power during the given operation (counting from fake_flash_ops),
+// after only the given number of bytes are erased or programmed.
+void fake_flash_cut_at(uint32_t op, uint16_t bytes) {
+    fake_flash_cut_op = op;
+    fake_flash_cut_bytes = bytes;
+}
+
+uint32_t fake_flash_erases(uint32_t addr) {
+    return fake_flash_erase_count[addr / FLASH_SECTOR_SIZE];
+}
+
+static bool fake_flash_check(uint32_t addr, size_t count, uint32_t align) {
+    if (addr % align || count % align || addr + count > FAKE_FLASH_SIZE) {
+        printf("  FAIL: Flash operation not aligned (%lu, %lu)\n", (unsigned long)addr, (unsigned long)count);
+        test_failures++;
+        return false;
+    }
+    return true;
+}
+
+// Number of bytes to apply of the current operation, jumping back to the
+// test after them if the power is cut.
+static size_t fake_flash_op(uint32_t addr, size_t count) {
+    if (fake_flash_ops++ != fake_flash_cut_op) return count;
+    fake_flash_cut_addr = addr;
+    return fake_flash_cut_bytes < count ? fake_flash_cut_bytes : count;
+}
+
+static void fake_flash_op_end() {
+    if (fake_flash_ops - 1 != fake_flash_cut_op) return;
+    fake_flash_cut_op = FAKE_FLASH_CUT_NONE;
+    longjmp(fake_flash_cut, 1);
+}
+
+int test_result() {
+    if (test_failures) printf("FAILED (%d)\n", test_failures);
+    else printf("OK\n");
+    return test_failures ? 1 : 0;
+}
+
+// SDK.
+
+uint32_t time_us_32() {
+    return fake_time;
+}
+
+uint64_t time_us_64() {
+    return fake_time;
+}
+
+void sleep_ms(uint32_t ms) {
+    fake_advance(ms * 1000);
+}
+
+void sleep_us(uint64_t us) {
+    fake_advance(us);
+}
+
+void gpio_init(uint gpio) {}
+void gpio_set_dir(uint gpio, bool out) {}
+void gpio_pull_up(uint gpio) {}
+
+uint32_t gpio_get_all() {
+    return fake_gpio;
+}
+
+uint32_t get_rand_32() {
+    return rand();
+}
+
+void pico_get_unique_board_id_string(char *id_out, uint len) {
+    snprintf(id_out, len, "FAKE");
+}
+
+uint32_t save_and_disable_interrupts() {
+    return 0;
+}
+
+void restore_interrupts(uint32_t status) {}
+
+void gpio_set_pulls(uint gpio, bool up, bool down) {}
+void gpio_set_outover(uint gpio, uint value) {}
+void gpio_set_inover(uint gpio, uint value) {}
+
+uint32_t clock_get_hz(enum clock_index clk_index) {
+    return 125000000;
+}
+
+pio_hw_t fake_pio0;
+
+int pio_claim_unused_sm(PIO pio, bool required) { return 0; }
+uint pio_add_program(PIO pio, const pio_program_t *program) { return 0; }
+void pio_gpio_init(PIO pio, uint pin) {}
+void pio_sm_set_consecutive_pindirs(PIO pio, uint sm, uint pin, uint count, bool is_out) {}
+void sm_config_set_set_pins(pio_sm_config *c, uint base, uint count) {}
+void sm_config_set_jmp_pin(pio_sm_config *c, uint pin) {}
+void sm_config_set_clkdiv(pio_sm_config *c, float div) {}
+void sm_config_set_fifo_join(pio_sm_config *c, uint join) {}
+void pio_sm_init(PIO pio, uint sm, uint initial_pc, const pio_sm_config *config) {}
+void pio_sm_set_config(PIO pio, uint sm, const pio_sm_config *config) {}
+void pio_sm_put(PIO pio, uint sm, uint32_t data) {}
+void pio_sm_exec(PIO pio, uint sm, uint instr) {}
+void pio_sm_set_enabled(PIO pio, uint sm, bool enabled) {}
+uint pio_get_dreq(PIO pio, uint sm, bool is_tx) { return 0; }
+uint pio_encode_pull(bool if_empty, bool block) { return 0; }
+uint pio_encode_mov(enum pio_src_dest dest, enum pio_src_dest src) { return 0; }
+
+dma_channel_hw_t fake_dma_channels[FAKE_DMA_CHANNELS];
+static uint8_t fake_dma_claimed = 0;
+static bool fake_dma_irq0_pending[FAKE_DMA_CHANNELS];
+static irq_handler_t fake_dma_irq0_handler = NULL;
+
+int dma_claim_unused_channel(bool required) {
+    return fake_dma_claimed++;
+}
+
+dma_channel_config dma_channel_get_default_config(uint channel) { return (dma_channel_config){0}; }
+void channel_config_set_transfer_data_size(dma_channel_config *c, uint size) {}
+void channel_config_set_read_increment(dma_channel_config *c, bool incr) {}
+void channel_config_set_write_increment(dma_channel_config *c, bool incr) {}
+void channel_config_set_ring(dma_channel_config *c, bool write, uint size_bits) {}
+void channel_config_set_dreq(dma_channel_config *c, uint dreq) {}
+
+void dma_channel_configure(
+    uint channel,
+    const dma_channel_config *config,
+    volatile void *write_addr,
+    const volatile void *read_addr,
+    uint transfer_count,
+    bool trigger
+) {
+    fake_dma_channels[channel].write_addr = (uintptr_t)write_addr;
+    fake_dma_channels[channel].read_addr = (uintptr_t)read_addr;
+    fake_dma_channels[channel].transfer_count = transfer_count;
+}
+
+void dma_channel_abort(uint channel) {
+    fake_dma_irq0_pending[channel] = false;
+}
+
+bool dma_channel_is_busy(uint channel) { return true; }
+void dma_channel_set_trans_count(uint channel, uint32_t trans_count, bool trigger) {}
+
+dma_channel_hw_t *dma_channel_hw_addr(uint channel) {
+    return &fake_dma_channels[channel];
+}
+
+void dma_channel_transfer_from_buffer_now(uint channel, const volatile void *read_addr, uint32_t transfer_count) {
+    uart_write_blocking(uart1, (const uint8_t*)read_addr, transfer_count);
+    fake_dma_irq0_pending[channel] = true;
+}
+
+bool dma_channel_get_irq0_status(uint channel) {
+    return fake_dma_irq0_pending[channel];
+}
+
+void dma_channel_acknowledge_irq0(uint channel) {
+    fake_dma_irq0_pending[channel] = false;
+}
+
+void dma_channel_set_irq0_enabled(uint channel, bool enabled) {}
+
+void irq_set_exclusive_handler(uint num, irq_handler_t handler) {
+    if (num == DMA_IRQ_0) fake_dma_irq0_handler = handler;
+}
+
+void irq_set_enabled(uint num, bool enabled) {}
+
+// Run the DMA completion interrupt until no transfer is pending.
+void fake_dma_irq0() {
+    bool pending = true;
+    while(pending && fake_dma_irq0_handler) {
+        pending = false;
+        for(uint8_t i=0; i<FAKE_DMA_CHANNELS; i++) pending |= fake_dma_irq0_pending[i];
+        if (pending) fake_dma_irq0_handler();
+    }
+}
+
+uart_inst_t fake_uart1;
+
+uart_hw_t *uart_get_hw(uart_inst_t *uart) {
+    return &uart->hw;
+}
+
+uint uart_get_dreq(uart_inst_t *uart, bool is_tx) { return 0; }
+
+void uart_write_blocking(uart_inst_t *uart, const uint8_t *src, size_t len) {
+    for(size_t i=0; i<len && fake_uart_tx_len<FAKE_UART_TX_SIZE; i++) {
+        fake_uart_tx[fake_uart_tx_len++] = src[i];
+    }
+}
+
+int getchar_timeout_us(uint32_t timeout_us) {
+    return -1;
+}
+
+void flash_range_erase(uint32_t flash_offs, size_t count) {
+    if (!fake_flash_check(flash_offs, count, FLASH_SECTOR_SIZE)) return;
+    size_t len = fake_flash_op(flash_offs, count);
+    memset(&fake_flash[flash_offs], 0xFF, len);
+    for(size_t i=0; i<count; i+=FLASH_SECTOR_SIZE) {
+        fake_flash_erase_count[(flash_offs + i) / FLASH_SECTOR_SIZE]++;
+    }
+    fake_flash_op_end();
+}
+
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count) {
+    if (!fake_flash_check(flash_offs, count, FLASH_PAGE_SIZE)) return;
+    size_t len = fake_flash_op(flash_offs, count);
+    for(size_t i=0; i<len; i++) fake_flash[flash_offs + i] &= data[i];
+    fake_flash_op_end();
+}
+
+// Logging.
+
+void info(char *msg, ...) {}
+void warn(char *msg, ...) {}
+void error(char *msg, ...) {}
+void debug(char *msg, ...) {}
+
+// IO expanders (no expander inputs).
+
+uint16_t io_cache_0 = 0;
+uint16_t io_cache_1 = 0;
+
+void bus_i2c_io_cache_update() {}
+
+// HID.
+
+void hid_press(uint8_t key) {
+    fake_hid_record(key, true);
+}
+
+void hid_release(uint8_t key) {
+    fake_hid_record(key, false);
+}
+
+void hid_press_multiple(uint8_t *keys) {
+    for(uint8_t i=0; i<ACTIONS_LEN; i++) {
+        if (keys[i] == KEY_NONE) break;
+        hid_press(keys[i]);
+    }
+}
+
+void hid_release_multiple(uint8_t *keys) {
+    for(uint8_t i=0; i<ACTIONS_LEN; i++) {
+        if (keys[i] == KEY_NONE) break;
+        hid_release(keys[i]);
+    }
+}
+
+void hid_press_later(uint8_t key, uint16_t delay) {
+    fake_hid_schedule(key, true, delay);
+}
+
+void hid_release_later(uint8_t key, uint16_t delay) {
+    fake_hid_schedule(key, false, delay);
+}
@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+// Fake hardware and HID layer for the host tests, see fakes.c.
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <setjmp.h>
+
+#define FAKE_HID_LOG_SIZE 64
+#define FAKE_HID_LATER_SIZE 16
+#define FAKE_FLASH_CUT_NONE UINT32_MAX
+#define FAKE_UART_TX_SIZE 4096
+
+// Check a condition, counting and printing the failures instead of aborting,
+// so all the cases of a test are reported.
+#define CHECK(cond)  do { \
+    if (!(cond)) { \
+        printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        test_failures++; \
+    } \
+} while(0)
+
+#define RUN(test)  do { printf("%s\n", #test); test(); } while(0)
+
+typedef struct FakeHidEvent_struct {
+    uint64_t ts;
+    uint8_t key;
+    bool press;
+} FakeHidEvent;
+
+extern int test_failures;
+extern uint64_t fake_time;
+extern uint32_t fake_gpio;
+extern FakeHidEvent fake_hid_log[FAKE_HID_LOG_SIZE];
+extern uint8_t fake_hid_log_len;
+extern uint8_t fake_uart_tx[FAKE_UART_TX_SIZE];
+extern uint16_t fake_uart_tx_len;
+extern uint32_t fake_flash_ops;
+extern jmp_buf fake_flash_cut;
+extern uint32_t fake_flash_cut_addr;
+
+void fake_reset();
+void fake_advance(uint64_t us);
+uint8_t fake_hid_count(uint8_t key, bool press);
+bool fake_hid_pressed(uint8_t key);
+void fake_dma_irq0();
+void fake_flash_reset();
+void fake_flash_cut_at(uint32_t op, uint16_t bytes);
+uint32_t fake_flash_erases(uint32_t addr);
+int test_result();
@@ -0,0 +1,246 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+/*
+USB endpoints and config store for the WebUSB layer built natively.
+
+The host side of the OUT endpoint is a queue of messages, that the device only
+takes one by one when it reads the vendor FIFO (the endpoint NAKs otherwise),
+so the backpressure of the RX ring applies to the host as in the real USB
+stack. Every IN transfer is completed immediately, and its messages are queued
+for the host to receive.
+
+Time is the device tick, each loopback_tick runs webusb_read and webusb_flush
+as the main loop does, and then advances the fake time by a tick interval.
+
+Also built as a shared library (build/libloopback.so) for scripts/ctrl.py.
+*/
+
+#include <string.h>
+#include "sdk.h"
+#include "fakes.h"
+#include "loopback.h"
+#include "webusb.h"
+#include "config.h"
+#include "profile.h"
+#include "loop.h"
+#include "uart.h"
+#include "wireless.h"
+
+static Ctrl loopback_out[LOOPBACK_OUT_SIZE];
+static uint8_t loopback_out_head = 0;
+static uint8_t loopback_out_tail = 0;
+static uint8_t loopback_out_len = 0;
+
+static Ctrl loopback_in[LOOPBACK_IN_SIZE];
+static uint16_t loopback_in_head = 0;
+static uint16_t loopback_in_tail = 0;
+static uint16_t loopback_in_len = 0;
+
+static bool loopback_in_stalled = false;  // Host not reading the IN endpoint.
+static bool loopback_wireless_mode = false;  // Through the dongle, one message per tick.
+static bool loopback_telemetry_stream = false;  // A telemetry frame always pending.
+static uint32_t loopback_tick_count = 0;
+static CtrlProfile loopback_profiles[NVM_PROFILE_SLOTS];
+static Config loopback_config;
+
+void loopback_reset() {
+    // The WebUSB layer state is not reset, transfers (re)start on their own.
+    loopback_out_head = loopback_out_tail = loopback_out_len = 0;
+    loopback_in_head = loopback_in_tail = loopback_in_len = 0;
+    loopback_in_stalled = false;
+    loopback_wireless_mode = false;
+    loopback_telemetry_stream = false;
+    loopback_tick_count = 0;
+    memset(loopback_profiles, 0, sizeof(loopback_profiles));
+    memset(&loopback_config, 0, sizeof(loopback_config));
+}
+
+bool loopback_send(const uint8_t *message) {
+    if (loopback_out_len == LOOPBACK_OUT_SIZE) return false;
+    memcpy(&loopback_out[loopback_out_head], message, sizeof(Ctrl));
+    loopback_out_head = (loopback_out_head + 1) % LOOPBACK_OUT_SIZE;
+    loopback_out_len++;
+    return true;
+}
+
+void loopback_tick() {
+    webusb_read();
+    webusb_flush();
+    loopback_tick_count++;
+    fake_advance(CFG_TICK_INTERVAL_IN_US);
+}
+
+void loopback_in_stall(bool stall) {
+    loopback_in_stalled = stall;
+}
+
+void loopback_wireless(bool wireless) {
+    loopback_wireless_mode = wireless;
+}
+
+void loopback_telemetry(bool stream) {
+    loopback_telemetry_stream = stream;
+}
+
+bool loopback_receive(uint8_t *message) {
+    if (loopback_in_len == 0) return false;
+    memcpy(message, &loopback_in[loopback_in_tail], sizeof(Ctrl));
+    loopback_in_tail = (loopback_in_tail + 1) % LOOPBACK_IN_SIZE;
+    loopback_in_len--;
+    return true;
+}
+
+uint32_t loopback_ticks() {
+    return loopback_tick_count;
+}
+
+uint32_t loopback_tick_interval() {
+    return CFG_TICK_INTERVAL_IN_US;
+}
+
+void loopback_profile_fill(uint8_t index, uint8_t seed) {
+    uint8_t *bytes = (uint8_t*)&loopback_profiles[index];
+    for(uint16_t i=0; i<sizeof(CtrlProfile); i++) bytes[i] = seed + (i * 7);
+}
+
+const uint8_t* loopback_profile(uint8_t index) {
+    return (const uint8_t*)&loopback_profiles[index];
+}
+
+// TinyUSB.
+
+void tud_task() {}
+
+bool tud_ready() {
+    return true;
+}
+
+uint32_t tud_vendor_n_available(uint8_t itf) {
+    return loopback_out_len ? sizeof(Ctrl) : 0;
+}
+
+uint32_t tud_vendor_n_read(uint8_t itf, void *buffer, uint32_t bufsize) {
+    if (loopback_out_len == 0) return 0;
+    uint32_t len = bufsize < sizeof(Ctrl) ? bufsize : sizeof(Ctrl);
+    memcpy(buffer, &loopback_out[loopback_out_tail], len);
+    loopback_out_tail = (loopback_out_tail + 1) % LOOPBACK_OUT_SIZE;
+    loopback_out_len--;
+    return len;
+}
+
+bool usbd_edpt_busy(uint8_t rhport, uint8_t ep_addr) {
+    return loopback_in_stalled;
+}
+
+bool usbd_edpt_claim(uint8_t rhport, uint8_t ep_addr) {
+    return true;
+}
+
+bool usbd_edpt_release(uint8_t rhport, uint8_t ep_addr) {
+    return true;
+}
+
+bool usbd_edpt_xfer(uint8_t rhport, uint8_t ep_addr, uint8_t *buffer, uint16_t total_bytes) {
+    for(uint16_t offset=0; offset<total_bytes; offset+=sizeof(Ctrl)) {
+        if (loopback_in_len == LOOPBACK_IN_SIZE) return false;
+        Ctrl *ctrl = &loopback_in[loopback_in_head];
+        memset(ctrl, 0, sizeof(Ctrl));
+        uint16_t len = total_bytes - offset;
+        memcpy(ctrl, buffer + offset, len < sizeof(Ctrl) ? len : sizeof(Ctrl));
+        loopback_in_head = (loopback_in_head + 1) % LOOPBACK_IN_SIZE;
+        loopback_in_len++;
+    }
+    return true;
+}
+
+// Config store, profiles in RAM without overlays or commits.
+
+Config* config_read() {
+    return &loopback_config;
+}
+
+const CtrlProfile* config_profile_read(uint8_t index) {
+    return &loopback_profiles[index];
+}
+
+bool config_profile_set_section(uint8_t index, uint8_t section, const uint8_t *data) {
+    if (index >= NVM_PROFILE_SLOTS || section >= CTRL_PROFILE_SECTIONS) return false;
+    CtrlSection *current = &loopback_profiles[index].sections[section];
+    if (!memcmp(current, data, sizeof(CtrlSection))) return false;
+    memcpy(current, data, sizeof(CtrlSection));
+    return true;
+}
+
+void config_profile_overwrite(uint8_t indexTo, int8_t indexFrom) {
+    if (indexFrom < 0) memset(&loopback_profiles[indexTo], 0, sizeof(CtrlProfile));
+    else loopback_profiles[indexTo] = loopback_profiles[indexFrom];
+}
+
+uint8_t config_get_protocol() { return 0; }
+uint8_t config_get_touch_sens_preset() { return 0; }
+uint8_t config_get_mouse_sens_preset() { return 0; }
+uint8_t config_get_deadzone_preset() { return 0; }
+uint8_t config_get_touch_sens_value(uint8_t index) { return 0; }
+double config_get_mouse_sens_value(uint8_t index) { return 0; }
+float config_get_deadzone_value(uint8_t index) { return 0; }
+
+void config_calibrate() {}
+void config_reset_config() {}
+void config_reset_profiles() {}
+void config_reset_factory() {}
+void config_set_protocol(uint8_t preset) {}
+void config_set_touch_sens_preset(uint8_t preset, bool notify_webusb) {}
+void config_set_mouse_sens_preset(uint8_t preset, bool notify_webusb) {}
+void config_set_deadzone_preset(uint8_t preset, bool notify_webusb) {}
+void config_set_touch_sens_values(uint8_t* values) {}
+void config_set_mouse_sens_values(double* values) {}
+void config_set_deadzone_values(float* values) {}
+void config_set_long_calibration(bool value) {}
+void config_set_swap_gyros(bool value) {}
+void config_set_touch_invert_polarity(bool value) {}
+void config_set_gyro_user_offset(int8_t x, int8_t y, int8_t z) {}
+void config_set_thumbstick_smooth_samples(uint8_t value) {}
+
+// Other modules.
+
+void profile_reload(uint8_t index) {}
+void power_restart() {}
+void power_bootsel() {}
+bool logging_get_onloop() { return true; }
+void logging_set_mask(LogMask mask) {}
+uint32_t nvm_get_bytes_written() { return 0; }
+void telemetry_set(uint8_t channels, uint8_t divider) {}
+
+bool telemetry_pop(Ctrl *ctrl) {
+    if (!loopback_telemetry_stream) return false;
+    ctrl->protocol_flags = CTRL_FLAG_NONE;
+    ctrl->device_id = ALPAKKA;
+    ctrl->message_type = TELEMETRY_FRAME;
+    ctrl->len = 0;
+    return true;
+}
+
+DeviceMode loop_get_device_mode() {
+    return loopback_wireless_mode ? WIRELESS : WIRED;
+}
+
+void wireless_send_webusb(Ctrl ctrl) {
+    // Received by the host through the dongle, as single messages.
+    if (loopback_in_len == LOOPBACK_IN_SIZE) return;
+    loopback_in[loopback_in_head] = ctrl;
+    loopback_in_head = (loopback_in_head + 1) % LOOPBACK_IN_SIZE;
+    loopback_in_len++;
+}
+
+bool wireless_tx_ready() {
+    return loopback_wireless_mode && !loopback_in_stalled;
+}
+
+WirelessStats wireless_get_stats() {
+    return (WirelessStats){0,};
+}
+
+UartLinkStats uart_get_stats() {
+    return (UartLinkStats){0,};
+}
@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+// The firmware WebUSB layer (webusb.c and ctrl.c) built natively, with the USB
+// endpoints and the config store replaced by fakes (see loopback.c). Messages
+// are the encoded 64 bytes of a Ctrl.
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#define LOOPBACK_OUT_SIZE 64  // Messages the host can have pending to send.
+#define LOOPBACK_IN_SIZE 256  // Messages sent by the device not read yet.
+
+void loopback_reset();
+bool loopback_send(const uint8_t *message);
+void loopback_tick();
+void loopback_in_stall(bool stall);
+void loopback_wireless(bool wireless);
+void loopback_telemetry(bool stream);
+bool loopback_receive(uint8_t *message);
+uint32_t loopback_ticks();
+uint32_t loopback_tick_interval();
+void loopback_profile_fill(uint8_t index, uint8_t seed);
+const uint8_t* loopback_profile(uint8_t index);
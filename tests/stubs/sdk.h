@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+// Minimal subset of the Pico SDK needed to build firmware modules natively
+// for the host tests. Implemented in fakes.c.
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+typedef unsigned int uint;
+typedef int32_t alarm_id_t;
+typedef uint64_t absolute_time_t;
+
+#define __packed __attribute__((packed))
+
+#define GPIO_OUT 1
+#define GPIO_IN 0
+
+uint32_t time_us_32(void);
+uint64_t time_us_64(void);
+void sleep_ms(uint32_t ms);
+void sleep_us(uint64_t us);
+
+void gpio_init(uint gpio);
+void gpio_set_dir(uint gpio, bool out);
+void gpio_pull_up(uint gpio);
+uint32_t gpio_get_all(void);
+
+uint32_t get_rand_32(void);
+void pico_get_unique_board_id_string(char *id_out, uint len);
+
+uint32_t save_and_disable_interrupts(void);
+void restore_interrupts(uint32_t status);
+
+// Flash, simulated in RAM (fake_flash) and mapped at XIP_BASE.
+#define FLASH_PAGE_SIZE 256
+#define FLASH_SECTOR_SIZE 4096
+#define FAKE_FLASH_SIZE (2 * 1024 * 1024)
+
+extern uint8_t fake_flash[FAKE_FLASH_SIZE];
+#define XIP_BASE ((uintptr_t)fake_flash)
+
+void flash_range_erase(uint32_t flash_offs, size_t count);
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count);
+
+// GPIO overrides and pulls.
+#define GPIO_OVERRIDE_NORMAL 0
+#define GPIO_OVERRIDE_INVERT 1
+
+void gpio_set_pulls(uint gpio, bool up, bool down);
+void gpio_set_outover(uint gpio, uint value);
+void gpio_set_inover(uint gpio, uint value);
+
+// Clocks.
+enum clock_index {clk_sys = 5};
+
+uint32_t clock_get_hz(enum clock_index clk_index);
+
+// PIO, state machines do not run.
+#define PIO_FIFO_JOIN_RX 2
+
+typedef struct {uint32_t txf[4]; uint32_t rxf[4];} pio_hw_t;
+typedef pio_hw_t *PIO;
+typedef struct {uint32_t clkdiv, execctrl, shiftctrl, pinctrl;} pio_sm_config;
+typedef struct {const uint16_t *instructions; uint8_t length; int8_t origin;} pio_program_t;
+enum pio_src_dest {pio_y = 2, pio_osr = 7};
+
+extern pio_hw_t fake_pio0;
+#define pio0 (&fake_pio0)
+
+int pio_claim_unused_sm(PIO pio, bool required);
+uint pio_add_program(PIO pio, const pio_program_t *program);
+void pio_gpio_init(PIO pio, uint pin);
+void pio_sm_set_consecutive_pindirs(PIO pio, uint sm, uint pin, uint count, bool is_out);
+void sm_config_set_set_pins(pio_sm_config *c, uint base, uint count);
+void sm_config_set_jmp_pin(pio_sm_config *c, uint pin);
+void sm_config_set_clkdiv(pio_sm_config *c, float div);
+void sm_config_set_fifo_join(pio_sm_config *c, uint join);
+void pio_sm_init(PIO pio, uint sm, uint initial_pc, const pio_sm_config *config);
+void pio_sm_set_config(PIO pio, uint sm, const pio_sm_config *config);
+void pio_sm_put(PIO pio, uint sm, uint32_t data);
+void pio_sm_exec(PIO pio, uint sm, uint instr);
+void pio_sm_set_enabled(PIO pio, uint sm, bool enabled);
+uint pio_get_dreq(PIO pio, uint sm, bool is_tx);
+uint pio_encode_pull(bool if_empty, bool block);
+uint pio_encode_mov(enum pio_src_dest dest, enum pio_src_dest src);
+
+// DMA, channels do not run, the tests write into the destinations. Transfers
+// from a buffer are written into the UART output at once (fake_uart_tx), and
+// their completion interrupt is raised with fake_dma_irq0().
+#define DMA_SIZE_8 0
+#define DMA_SIZE_32 2
+#define FAKE_DMA_CHANNELS 4
+
+typedef struct {uint32_t ctrl;} dma_channel_config;
+typedef struct {uintptr_t read_addr, write_addr, transfer_count, ctrl_trig;} dma_channel_hw_t;
+
+extern dma_channel_hw_t fake_dma_channels[FAKE_DMA_CHANNELS];
+
+int dma_claim_unused_channel(bool required);
+void dma_channel_abort(uint channel);
+void dma_channel_transfer_from_buffer_now(uint channel, const volatile void *read_addr, uint32_t transfer_count);
+bool dma_channel_get_irq0_status(uint channel);
+void dma_channel_acknowledge_irq0(uint channel);
+void dma_channel_set_irq0_enabled(uint channel, bool enabled);
+dma_channel_config dma_channel_get_default_config(uint channel);
+void channel_config_set_transfer_data_size(dma_channel_config *c, uint size);
+void channel_config_set_read_increment(dma_channel_config *c, bool incr);
+void channel_config_set_write_increment(dma_channel_config *c, bool incr);
+void channel_config_set_ring(dma_channel_config *c, bool write, uint size_bits);
+void channel_config_set_dreq(dma_channel_config *c, uint dreq);
+void dma_channel_configure(
+    uint channel,
+    const dma_channel_config *config,
+    volatile void *write_addr,
+    const volatile void *read_addr,
+    uint transfer_count,
+    bool trigger
+);
+bool dma_channel_is_busy(uint channel);
+void dma_channel_set_trans_count(uint channel, uint32_t trans_count, bool trigger);
+dma_channel_hw_t *dma_channel_hw_addr(uint channel);
+
+// IRQ.
+#define DMA_IRQ_0 11
+
+typedef void (*irq_handler_t)(void);
+
+void irq_set_exclusive_handler(uint num, irq_handler_t handler);
+void irq_set_enabled(uint num, bool enabled);
+
+// UART, the output is recorded (fake_uart_tx).
+typedef struct {uint32_t dr;} uart_hw_t;
+typedef struct {uart_hw_t hw;} uart_inst_t;
+
+extern uart_inst_t fake_uart1;
+#define uart1 (&fake_uart1)
+
+uart_hw_t *uart_get_hw(uart_inst_t *uart);
+uint uart_get_dreq(uart_inst_t *uart, bool is_tx);
+void uart_write_blocking(uart_inst_t *uart, const uint8_t *src, size_t len);
+
+// Stdio.
+int getchar_timeout_us(uint32_t timeout_us);
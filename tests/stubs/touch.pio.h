@@ -0,0 +1,9 @@
+#pragma once
+#include "sdk.h"
+
+// Generated by pioasm in the firmware build.
+static const pio_program_t touch_program = {NULL, 0, -1};
+
+static inline pio_sm_config touch_program_get_default_config(uint offset) {
+    return (pio_sm_config){0};
+}
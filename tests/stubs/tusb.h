@@ -0,0 +1,13 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+// Minimal subset of TinyUSB needed to build the WebUSB module natively for the
+// host tests. Implemented in loopback.c.
+
+#pragma once
+#include "sdk.h"
+
+void tud_task(void);
+bool tud_ready(void);
+uint32_t tud_vendor_n_available(uint8_t itf);
+uint32_t tud_vendor_n_read(uint8_t itf, void *buffer, uint32_t bufsize);
@@ -0,0 +1,7 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+// Generated by scripts/version.sh in firmware builds.
+
+#pragma once
+#define VERSION "0.0.0-host"
@@ -0,0 +1,215 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+// Bulk profile transfers through the WebUSB layer (see loopback.c), as the app
+// does them, for several window sizes. Also reports the profiles per second
+// in device time (ticks).
+
+#include "fakes.h"
+#include "loopback.h"
+#include "ctrl.h"
+
+#define PROFILE 9
+#define TIMEOUT_TICKS 2000
+
+static uint32_t ticks_total = 0;
+
+static Ctrl message(Ctrl_msg_type type, uint8_t len) {
+    Ctrl ctrl = {
+        .protocol_flags = CTRL_FLAG_NONE,
+        .device_id = ALPAKKA,
+        .message_type = type,
+        .len = len
+    };
+    return ctrl;
+}
+
+static void send(Ctrl ctrl) {
+    // Retry as the host does while the endpoint NAKs.
+    while(!loopback_send((uint8_t*)&ctrl)) loopback_tick();
+}
+
+static bool receive(Ctrl *ctrl) {
+    return loopback_receive((uint8_t*)ctrl);
+}
+
+static void profile_ack(uint8_t profile, uint8_t section) {
+    Ctrl ctrl = message(PROFILE_ACK, 2);
+    ctrl.payload[0] = profile;
+    ctrl.payload[1] = section;
+    send(ctrl);
+}
+
+static void profile_end(uint8_t profile, uint16_t crc) {
+    Ctrl ctrl = message(PROFILE_END, 5);
+    ctrl.payload[0] = profile;
+    ctrl.payload[1] = CTRL_BULK_LAST - CTRL_BULK_FIRST + 1;
+    ctrl.payload[2] = crc & 0xFF;
+    ctrl.payload[3] = crc >> 8;
+    ctrl.payload[4] = CTRL_BULK_OK;
+    send(ctrl);
+}
+
+static void profile_set(uint8_t profile, uint8_t section, const CtrlSection *data) {
+    Ctrl ctrl = message(PROFILE_SET, 60);
+    ctrl.payload[0] = profile;
+    ctrl.payload[1] = section;
+    memcpy(&ctrl.payload[2], data, sizeof(CtrlSection));
+    send(ctrl);
+}
+
+static void profile_set_start(uint8_t profile, uint8_t window) {
+    CtrlSection start = {0,};
+    ((uint8_t*)&start)[0] = window;
+    profile_set(profile, 0, &start);
+}
+
+// Same as the app, returns the status of the PROFILE_END reply (zero if the
+// transfer stalled).
+static uint8_t transfer_set(uint8_t profile, const CtrlProfile *src, uint8_t window) {
+    uint32_t start = loopback_ticks();
+    profile_set_start(profile, window);
+    uint8_t next = CTRL_BULK_FIRST;
+    uint8_t acked = CTRL_BULK_FIRST - 1;
+    bool ended = false;
+    while(loopback_ticks() - start < TIMEOUT_TICKS) {
+        while(next <= CTRL_BULK_LAST && next <= acked + window) {
+            profile_set(profile, next, &src->sections[next]);
+            next++;
+        }
+        if (acked == CTRL_BULK_LAST && !ended) {
+            profile_end(profile, ctrl_profile_crc(src));
+            ended = true;
+        }
+        loopback_tick();
+        Ctrl ctrl;
+        while(receive(&ctrl)) {
+            if (ctrl.payload[0] != profile) continue;
+            if (ctrl.message_type == PROFILE_ACK) acked = max(acked, ctrl.payload[1]);
+            if (ctrl.message_type == PROFILE_END) {
+                ticks_total += loopback_ticks() - start;
+                return ctrl.payload[4];
+            }
+        }
+    }
+    return 0;
+}
+
+// Same as the app, returns true if the received profile matches the CRC.
+static bool transfer_get(uint8_t profile, CtrlProfile *dst, uint8_t window) {
+    uint32_t start = loopback_ticks();
+    Ctrl get = message(PROFILE_GET, 3);
+    get.payload[0] = profile;
+    get.payload[1] = window;
+    send(get);
+    uint8_t acked = CTRL_BULK_FIRST - 1;
+    while(loopback_ticks() - start < TIMEOUT_TICKS) {
+        loopback_tick();
+        Ctrl ctrl;
+        while(receive(&ctrl)) {
+            if (ctrl.payload[0] != profile) continue;
+            if (ctrl.message_type == PROFILE_SHARE) {
+                uint8_t section = ctrl.payload[1];
+                memcpy(&dst->sections[section], &ctrl.payload[2], sizeof(CtrlSection));
+                if (section >= acked + window || section == CTRL_BULK_LAST) {
+                    profile_ack(profile, section);
+                    acked = section;
+                }
+            }
+            if (ctrl.message_type == PROFILE_END) {
+                ticks_total += loopback_ticks() - start;
+                uint16_t crc = ctrl.payload[2] | (ctrl.payload[3] << 8);
+                return crc == ctrl_profile_crc(dst);
+            }
+        }
+    }
+    return false;
+}
+
+static void check_round_trip(uint8_t window) {
+    loopback_reset();
+    loopback_profile_fill(PROFILE, window);
+    CtrlProfile copy = {0,};
+    CHECK(transfer_get(PROFILE, &copy, window));
+    copy.sections[SECTION_META].meta.name[0] ^= 0xFF;
+    CHECK(transfer_set(PROFILE, &copy, window) == CTRL_BULK_OK);
+    const CtrlProfile *stored = (const CtrlProfile*)loopback_profile(PROFILE);
+    CHECK(!memcmp(
+        &stored->sections[CTRL_BULK_FIRST],
+        &copy.sections[CTRL_BULK_FIRST],
+        (CTRL_BULK_LAST - CTRL_BULK_FIRST + 1) * sizeof(CtrlSection)
+    ));
+}
+
+static void test_default_window() {
+    check_round_trip(CTRL_BULK_WINDOW);
+}
+
+static void test_small_windows() {
+    // Acks must follow the window of the sender, not the default one.
+    check_round_trip(1);
+    check_round_trip(4);
+    check_round_trip(5);
+}
+
+static void test_large_window() {
+    check_round_trip(CTRL_BULK_LAST);
+}
+
+static void test_crc_mismatch() {
+    loopback_reset();
+    CtrlProfile copy = {0,};
+    uint8_t window = CTRL_BULK_WINDOW;
+    CHECK(transfer_get(PROFILE, &copy, window));
+    // Send the sections but end with a wrong CRC.
+    profile_set_start(PROFILE, CTRL_BULK_LAST);
+    for(uint8_t i=CTRL_BULK_FIRST; i<=CTRL_BULK_LAST; i++) {
+        profile_set(PROFILE, i, &copy.sections[i]);
+    }
+    profile_end(PROFILE, ctrl_profile_crc(&copy) ^ 1);
+    uint8_t status = 0;
+    for(uint16_t i=0; i<TIMEOUT_TICKS && !status; i++) {
+        loopback_tick();
+        Ctrl ctrl;
+        while(receive(&ctrl)) {
+            if (ctrl.message_type == PROFILE_END) status = ctrl.payload[4];
+        }
+    }
+    CHECK(status == CTRL_BULK_ERROR_CRC);
+}
+
+static void bench(uint8_t window) {
+    loopback_reset();
+    loopback_profile_fill(PROFILE, 0);
+    ticks_total = 0;
+    uint8_t rounds = 10;
+    CtrlProfile copy = {0,};
+    for(uint8_t i=0; i<rounds; i++) transfer_get(PROFILE, &copy, window);
+    uint32_t get = ticks_total;
+    ticks_total = 0;
+    for(uint8_t i=0; i<rounds; i++) transfer_set(PROFILE, &copy, window);
+    uint32_t set = ticks_total;
+    CHECK(get && set);
+    if (!get || !set) return;
+    float tick_s = loopback_tick_interval() / 1000000.0;
+    printf(
+        "  Window %2i: GET %5.1f profiles/s (%3lu ticks), SET %5.1f profiles/s (%3lu ticks)\n",
+        window,
+        rounds / (get * tick_s),
+        (unsigned long)(get / rounds),
+        rounds / (set * tick_s),
+        (unsigned long)(set / rounds)
+    );
+}
+
+int main() {
+    RUN(test_default_window);
+    RUN(test_small_windows);
+    RUN(test_large_window);
+    RUN(test_crc_mismatch);
+    bench(1);
+    bench(4);
+    bench(CTRL_BULK_WINDOW);
+    bench(16);
+    return test_result();
+}
@@ -0,0 +1,256 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+// Every button mode and modifier combination in docs/button_logic.md, driving
+// a real button (button.c, fsm.c and mapping.c) from the debounced input.
+
+#include "fakes.h"
+#include "button.h"
+#include "config.h"
+#include "pin.h"
+
+#define PIN 1
+#define KEY_A 10  // Main, short or single actions.
+#define KEY_B 11  // Secondary, long or double actions.
+#define KEY_C 12  // Terciary, double actions when combined with hold.
+
+// Comfortably inside and outside of the time thresholds.
+#define SHORT_MS 60
+#define IDLE_MS (CFG_DOUBLE_PRESS_TIME * 3)
+
+extern uint64_t button_counter_0;
+extern uint64_t button_counter_1;
+
+static Button button;
+
+static void setup(ButtonMode mode) {
+    fake_reset();
+    button_input = 0;
+    button_counter_0 = 0;
+    button_counter_1 = 0;
+    Actions actions = {KEY_A,};
+    Actions actions_secondary = {KEY_B,};
+    Actions actions_terciary = {KEY_C,};
+    button = Button_(PIN, mode, actions, actions_secondary, actions_terciary);
+}
+
+// Run the same steps as a profile report, for a number of milliseconds.
+static void run(bool pressed, uint32_t ms) {
+    uint32_t n = ms * 1000 / CFG_TICK_INTERVAL_IN_US;
+    for(uint32_t i=0; i<n; i++) {
+        fake_gpio = 0xFFFFFFFF;
+        if (pressed) fake_gpio &= ~(1 << PIN);
+        button_input_update();
+        button.report(&button);
+        fake_advance(CFG_TICK_INTERVAL_IN_US);
+    }
+}
+
+static void tap() {
+    run(true, SHORT_MS);
+    run(false, SHORT_MS);
+}
+
+static void check_idle() {
+    CHECK(!fake_hid_pressed(KEY_A));
+    CHECK(!fake_hid_pressed(KEY_B));
+    CHECK(!fake_hid_pressed(KEY_C));
+}
+
+static void check_counts(uint8_t a, uint8_t b, uint8_t c) {
+    CHECK(fake_hid_count(KEY_A, true) == a);
+    CHECK(fake_hid_count(KEY_B, true) == b);
+    CHECK(fake_hid_count(KEY_C, true) == c);
+}
+
+static void test_normal() {
+    setup(NORMAL);
+    run(true, SHORT_MS);
+    CHECK(fake_hid_pressed(KEY_A));
+    run(true, CFG_HOLD_LONG_TIME);
+    CHECK(fake_hid_pressed(KEY_A));
+    run(false, IDLE_MS);
+    check_idle();
+    check_counts(1, 0, 0);
+}
+
+// Short press engages and disengages the short actions on release, long press
+// engages the long actions only, until release.
+static void check_hold(ButtonMode mode, uint32_t threshold) {
+    setup(mode);
+    run(true, threshold / 2);
+    CHECK(!fake_hid_pressed(KEY_A));
+    CHECK(!fake_hid_pressed(KEY_B));
+    run(false, IDLE_MS);
+    check_idle();
+    check_counts(1, 0, 0);
+    setup(mode);
+    run(true, threshold + SHORT_MS);
+    CHECK(!fake_hid_pressed(KEY_A));
+    CHECK(fake_hid_pressed(KEY_B));
+    run(false, IDLE_MS);
+    check_idle();
+    check_counts(0, 1, 0);
+}
+
+// Short actions engaged on press, long actions added after the threshold.
+static void check_hold_immediate(ButtonMode mode, uint32_t threshold) {
+    setup(mode);
+    run(true, threshold / 2);
+    CHECK(fake_hid_pressed(KEY_A));
+    CHECK(!fake_hid_pressed(KEY_B));
+    run(false, IDLE_MS);
+    check_idle();
+    check_counts(1, 0, 0);
+    setup(mode);
+    run(true, threshold + SHORT_MS);
+    CHECK(fake_hid_pressed(KEY_A));
+    CHECK(fake_hid_pressed(KEY_B));
+    run(false, IDLE_MS);
+    check_idle();
+    check_counts(1, 1, 0);
+}
+
+static void test_hold() {
+    check_hold(HOLD, CFG_HOLD_TIME);
+}
+
+static void test_hold_long() {
+    check_hold(HOLD | LONG, CFG_HOLD_LONG_TIME);
+}
+
+static void test_hold_immediate() {
+    check_hold_immediate(HOLD | IMMEDIATE, CFG_HOLD_TIME);
+}
+
+static void test_hold_immediate_long() {
+    check_hold_immediate(HOLD | IMMEDIATE | LONG, CFG_HOLD_LONG_TIME);
+}
+
+// Single press engages the single actions once the double press window has
+// passed, double press engages the double actions until release.
+static void check_double(ButtonMode mode, uint8_t key_double) {
+    bool immediate = mode & IMMEDIATE;
+    setup(mode);
+    run(true, SHORT_MS);
+    CHECK(fake_hid_pressed(KEY_A) == immediate);
+    run(false, SHORT_MS);
+    CHECK(fake_hid_count(KEY_A, true) == immediate);
+    run(false, IDLE_MS);
+    check_idle();
+    check_counts(1, 0, 0);
+    setup(mode);
+    tap();
+    run(true, CFG_HOLD_LONG_TIME);
+    CHECK(!fake_hid_pressed(KEY_A));
+    CHECK(fake_hid_pressed(key_double));
+    run(false, IDLE_MS);
+    check_idle();
+    CHECK(fake_hid_count(KEY_A, true) == immediate);
+    CHECK(fake_hid_count(key_double, true) == 1);
+}
+
+static void test_double() {
+    check_double(DOUBLE, KEY_B);
+}
+
+static void test_double_immediate() {
+    check_double(DOUBLE | IMMEDIATE, KEY_B);
+}
+
+// ((short OR long) OR double).
+static void check_hold_double(ButtonMode mode, uint32_t threshold) {
+    bool immediate = mode & IMMEDIATE;
+    if (immediate) check_hold_immediate(mode, threshold);
+    else check_hold(mode, threshold);
+    check_double(mode, KEY_C);
+    CHECK(fake_hid_count(KEY_B, true) == 0);
+}
+
+static void test_hold_double() {
+    check_hold_double(HOLD | DOUBLE, CFG_HOLD_TIME);
+}
+
+static void test_hold_double_long() {
+    check_hold_double(HOLD | DOUBLE | LONG, CFG_HOLD_LONG_TIME);
+}
+
+static void test_hold_double_immediate() {
+    check_hold_double(HOLD | DOUBLE | IMMEDIATE, CFG_HOLD_TIME);
+}
+
+static void test_hold_double_immediate_long() {
+    check_hold_double(HOLD | DOUBLE | IMMEDIATE | LONG, CFG_HOLD_LONG_TIME);
+}
+
+// Main actions stay engaged, cycle actions follow the button. Disengaging the
+// main actions on home release is done by the home button, not tested here.
+static void test_sticky() {
+    setup(STICKY);
+    run(true, SHORT_MS);
+    CHECK(fake_hid_pressed(KEY_A));
+    CHECK(fake_hid_pressed(KEY_B));
+    run(false, SHORT_MS);
+    CHECK(fake_hid_pressed(KEY_A));
+    CHECK(!fake_hid_pressed(KEY_B));
+    run(true, SHORT_MS);
+    CHECK(fake_hid_pressed(KEY_B));
+    run(false, SHORT_MS);
+    CHECK(fake_hid_pressed(KEY_A));
+    CHECK(!fake_hid_pressed(KEY_B));
+    CHECK(fake_hid_count(KEY_A, false) == 0);
+    CHECK(fake_hid_count(KEY_B, true) == 2);
+}
+
+static void test_input_mask() {
+    // Every existing input has its own bit.
+    uint8_t pins[] = {
+        PIN_GROUP_BOARD, BUTTON_INPUT_BOARD_LAST,
+        PIN_GROUP_IO_0, PIN_GROUP_IO_0 + BUTTON_INPUT_IO_PINS - 1,
+        PIN_GROUP_IO_1, PIN_GROUP_IO_1 + BUTTON_INPUT_IO_PINS - 1,
+    };
+    uint64_t all = 0;
+    for(uint8_t i=0; i<sizeof(pins); i++) {
+        uint64_t mask = button_input_mask(pins[i]);
+        CHECK(mask && !(mask & (mask - 1)));
+        CHECK(!(all & mask));
+        all |= mask;
+    }
+    CHECK(button_input_mask(BUTTON_INPUT_BOARD_LAST) == (uint64_t)1 << BUTTON_INPUT_BOARD_LAST);
+    CHECK(button_input_mask(PIN_GROUP_IO_1 + BUTTON_INPUT_IO_PINS - 1) == (uint64_t)1 << 63);
+    // Pins that do not exist have none.
+    CHECK(button_input_mask(0) == 0);
+    CHECK(button_input_mask(BUTTON_INPUT_BOARD_LAST + 1) == 0);
+    CHECK(button_input_mask(PIN_GROUP_BOARD_END) == 0);
+    CHECK(button_input_mask(PIN_GROUP_IO_0 + BUTTON_INPUT_IO_PINS) == 0);
+    CHECK(button_input_mask(PIN_GROUP_IO_0_END) == 0);
+    CHECK(button_input_mask(PIN_GROUP_IO_1 + BUTTON_INPUT_IO_PINS) == 0);
+    CHECK(button_input_mask(PIN_GROUP_IO_1_END) == 0);
+    CHECK(button_input_mask(PIN_VIRTUAL) == 0);
+    CHECK(button_input_mask(PIN_NONE) == 0);
+    // And are never pressed.
+    setup(NORMAL);
+    Actions actions = {KEY_A,};
+    Actions none = {0,};
+    button = Button_(PIN_GROUP_BOARD_END, NORMAL, actions, none, none);
+    fake_gpio = 0;
+    button_input_update();
+    CHECK(!button.is_pressed(&button));
+}
+
+int main() {
+    RUN(test_input_mask);
+    RUN(test_normal);
+    RUN(test_hold);
+    RUN(test_hold_long);
+    RUN(test_hold_immediate);
+    RUN(test_hold_immediate_long);
+    RUN(test_double);
+    RUN(test_double_immediate);
+    RUN(test_hold_double);
+    RUN(test_hold_double_long);
+    RUN(test_hold_double_immediate);
+    RUN(test_hold_double_immediate_long);
+    RUN(test_sticky);
+    return test_result();
+}
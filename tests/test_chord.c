@@ -0,0 +1,116 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+// Chords on the debounced input vector, driving real buttons (see chord.c).
+
+#include "fakes.h"
+#include "button.h"
+#include "chord.h"
+#include "config.h"
+
+#define PIN_A 1
+#define PIN_B 2
+#define KEY_A 10
+#define KEY_B 11
+#define KEY_CHORD 20
+
+extern uint64_t button_counter_0;
+extern uint64_t button_counter_1;
+
+static Button button_a;
+static Button button_b;
+static Chord chord;
+
+static void setup(bool speculative) {
+    fake_reset();
+    button_input = 0;
+    button_counter_0 = 0;
+    button_counter_1 = 0;
+    Actions none = {0,};
+    Actions actions_a = {KEY_A,};
+    Actions actions_b = {KEY_B,};
+    Actions actions_chord = {KEY_CHORD,};
+    button_a = Button_(PIN_A, NORMAL, actions_a, none, none);
+    button_b = Button_(PIN_B, NORMAL, actions_b, none, none);
+    chord = Chord_(
+        button_input_mask(PIN_A),
+        button_input_mask(PIN_B),
+        actions_chord,
+        0,
+        speculative
+    );
+}
+
+// Run the same steps as a profile report, for a number of ticks.
+static void ticks(uint8_t pressed_a, uint8_t pressed_b, uint16_t n) {
+    for(uint16_t i=0; i<n; i++) {
+        fake_gpio = 0xFFFFFFFF;
+        if (pressed_a) fake_gpio &= ~(1 << PIN_A);
+        if (pressed_b) fake_gpio &= ~(1 << PIN_B);
+        button_input_update();
+        chord.report(&chord);
+        button_a.report(&button_a);
+        button_b.report(&button_b);
+        fake_advance(CFG_TICK_INTERVAL_IN_US);
+    }
+}
+
+#define WINDOW_TICKS  (CHORD_WINDOW_DEFAULT * 1000 / CFG_TICK_INTERVAL_IN_US)
+
+static void test_tap_shorter_than_window() {
+    setup(false);
+    ticks(1, 0, 1);  // Single sample tap.
+    CHECK(!fake_hid_pressed(KEY_A));  // Held back.
+    ticks(0, 0, WINDOW_TICKS * 2);
+    CHECK(fake_hid_count(KEY_A, true) == 1);
+    CHECK(fake_hid_count(KEY_A, false) == 1);
+    CHECK(fake_hid_count(KEY_CHORD, true) == 0);
+    // The release is debounced, so the tap is longer than the press.
+    setup(false);
+    ticks(1, 0, WINDOW_TICKS / 2);
+    ticks(0, 0, WINDOW_TICKS * 2);
+    CHECK(fake_hid_count(KEY_A, true) == 1);
+    CHECK(fake_hid_count(KEY_A, false) == 1);
+    CHECK(!fake_hid_pressed(KEY_A));
+}
+
+static void test_hold_longer_than_window() {
+    setup(false);
+    ticks(1, 0, WINDOW_TICKS / 2);
+    CHECK(!fake_hid_pressed(KEY_A));
+    ticks(1, 0, WINDOW_TICKS);
+    CHECK(fake_hid_pressed(KEY_A));
+    ticks(0, 0, WINDOW_TICKS);
+    CHECK(!fake_hid_pressed(KEY_A));
+    CHECK(fake_hid_count(KEY_CHORD, true) == 0);
+}
+
+static void test_chord_within_window() {
+    setup(false);
+    ticks(1, 0, WINDOW_TICKS / 2);
+    ticks(1, 1, WINDOW_TICKS * 2);
+    CHECK(fake_hid_pressed(KEY_CHORD));
+    ticks(0, 0, WINDOW_TICKS);
+    CHECK(!fake_hid_pressed(KEY_CHORD));
+    CHECK(fake_hid_count(KEY_A, true) == 0);
+    CHECK(fake_hid_count(KEY_B, true) == 0);
+}
+
+static void test_speculative() {
+    setup(true);
+    ticks(1, 0, 2);
+    CHECK(fake_hid_pressed(KEY_A));  // Not held back.
+    ticks(1, 1, 2);
+    CHECK(!fake_hid_pressed(KEY_A));  // Disengaged by the chord.
+    CHECK(fake_hid_pressed(KEY_CHORD));
+    ticks(0, 0, WINDOW_TICKS);
+    CHECK(!fake_hid_pressed(KEY_CHORD));
+}
+
+int main() {
+    RUN(test_tap_shorter_than_window);
+    RUN(test_hold_longer_than_window);
+    RUN(test_chord_within_window);
+    RUN(test_speculative);
+    return test_result();
+}
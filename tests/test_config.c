@@ -0,0 +1,260 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+// Profile persistence (config.c) on the simulated flash: modified sections
+// written into the NVM journal, compacted into the profiles by the journal
+// garbage collection, and replayed over the profiles after a reboot. Including
+// a power cut at every flash operation of a sequence of edits, except for the
+// writes of whole profile sectors (which are not power cut safe).
+
+#include "fakes.h"
+#include "config.h"
+#include "nvm.h"
+#include "profile.h"
+#include "common.h"
+
+#define PROFILES 3  // Profiles edited, the first ones.
+#define SECTIONS 5  // Sections edited of each profile.
+// Enough edits to rotate through all the journal sectors twice.
+#define EDITS (NVM_JOURNAL_SECTORS * NVM_JOURNAL_RECORDS * 2)
+
+extern uint8_t config_profile_overlay_index[NVM_PROFILE_OVERLAYS];
+extern uint64_t config_profile_overlay_dirty[NVM_PROFILE_OVERLAYS];
+extern uint64_t config_profile_overlay_ts[NVM_PROFILE_OVERLAYS];
+extern int8_t config_profile_committing;
+extern bool commit_busy;
+
+static uint8_t committed[PROFILES][SECTIONS];  // Last value saved (0: default).
+static uint8_t pending_value;  // Value being saved when the power was cut.
+static uint8_t pending_profile;
+static uint8_t pending_section;
+
+// Firmware side.
+
+bool profile_led_lock = false;
+
+static void profile_default(CtrlProfile *profile) {
+    CtrlProfileMeta *meta = &profile->sections[SECTION_META].meta;
+    meta->control_byte = NVM_CONTROL_BYTE;
+    meta->version_major = 1;
+    meta->version_minor = 1;
+}
+
+void config_profile_default_home(CtrlProfile *profile) { profile_default(profile); }
+void config_profile_default_fps_fusion(CtrlProfile *profile) { profile_default(profile); }
+void config_profile_default_fps_wasd(CtrlProfile *profile) { profile_default(profile); }
+void config_profile_default_racing(CtrlProfile *profile) { profile_default(profile); }
+void config_profile_default_flight(CtrlProfile *profile) { profile_default(profile); }
+void config_profile_default_console(CtrlProfile *profile) { profile_default(profile); }
+void config_profile_default_console_legacy(CtrlProfile *profile) { profile_default(profile); }
+void config_profile_default_desktop(CtrlProfile *profile) { profile_default(profile); }
+void config_profile_default_rts(CtrlProfile *profile) { profile_default(profile); }
+void config_profile_default_custom(CtrlProfile *profile) { profile_default(profile); }
+
+void gyro_update_sensitivity() {}
+void imu_calibrate() {}
+void imu_init() {}
+void imu_load_calibration() {}
+void led_blink_mask(uint8_t mask) {}
+void led_set_mode(uint8_t mode) {}
+void led_show() {}
+void led_static_mask(uint8_t mask) {}
+void logging_load_from_config() {}
+void logging_set_onloop(bool value) {}
+void power_restart() {}
+void profile_notify_protocol_changed(Protocol protocol) {}
+void profile_reset_home_sleep(bool value) {}
+void thumbstick_calibrate() {}
+void thumbstick_update_deadzone() {}
+void thumbstick_update_smooth_samples() {}
+void touch_load_from_config() {}
+void webusb_set_pending_config_share(uint8_t key) {}
+
+// Profiles.
+
+// Sections after the meta section (the only one the defaults set), filled with a
+// value (zero: as the defaults).
+static void section_data(uint8_t value, CtrlSection *section) {
+    uint8_t *bytes = (uint8_t*)section;
+    for(uint8_t i=0; i<sizeof(CtrlSection); i++) bytes[i] = value ? value + (i * 7) : 0;
+}
+
+static uint8_t section_value(uint8_t profile, uint8_t section) {
+    // The value of a section, or UINT8_MAX if it does not match any.
+    const CtrlSection *current = &config_profile_read(profile)->sections[SECTION_META + 1 + section];
+    for(uint16_t value=0; value<UINT8_MAX; value++) {
+        CtrlSection expected;
+        section_data(value, &expected);
+        if (!memcmp(current, &expected, sizeof(CtrlSection))) return value;
+    }
+    return UINT8_MAX;
+}
+
+static void sync(uint32_t ms) {
+    for(uint32_t i=0; i<ms * 1000 / CFG_TICK_INTERVAL_IN_US; i++) {
+        config_sync();
+        fake_advance(CFG_TICK_INTERVAL_IN_US);
+    }
+}
+
+// Edit a section and wait until it is saved.
+static void edit(uint8_t profile, uint8_t section, uint8_t value) {
+    CtrlSection data;
+    section_data(value, &data);
+    pending_profile = profile;
+    pending_section = section;
+    pending_value = value;
+    config_profile_set_section(profile, SECTION_META + 1 + section, (uint8_t*)&data);
+    sync(NVM_PROFILE_QUIET_TIME * 2);
+    committed[profile][section] = value;
+    pending_value = 0;
+}
+
+// Each section must have its last saved value, or the one being saved.
+static bool check_sections() {
+    bool ok = true;
+    for(uint8_t p=0; p<PROFILES; p++) {
+        for(uint8_t s=0; s<SECTIONS; s++) {
+            uint8_t value = section_value(p, s);
+            if (value == committed[p][s]) continue;
+            if (pending_value && p == pending_profile && s == pending_section && value == pending_value) {
+                committed[p][s] = pending_value;
+                continue;
+            }
+            printf("  Profile %i section %i is %i, expected %i\n", p, s, value, committed[p][s]);
+            ok = false;
+        }
+    }
+    pending_value = 0;
+    return ok;
+}
+
+// Values from 1 to 250, edited in rotation over the sections of the profiles.
+static void edits(uint32_t first, uint32_t n) {
+    for(uint32_t i=first; i<first+n; i++) {
+        edit(i % PROFILES, (i / PROFILES) % SECTIONS, (i % 250) + 1);
+    }
+}
+
+static void reboot() {
+    for(uint8_t i=0; i<NVM_PROFILE_OVERLAYS; i++) {
+        config_profile_overlay_index[i] = PROFILE_NONE;
+        config_profile_overlay_dirty[i] = 0;
+        config_profile_overlay_ts[i] = 0;
+    }
+    config_profile_committing = -1;
+    commit_busy = false;
+    config_init();
+}
+
+static void setup() {
+    fake_reset();
+    fake_flash_reset();
+    memset(committed, 0, sizeof(committed));
+    pending_value = 0;
+    reboot();
+}
+
+static bool is_profile_addr(uint32_t addr) {
+    return addr >= NVM_CONFIG_ADDR + NVM_PROFILE_SIZE && addr < NVM_JOURNAL_ADDR;
+}
+
+// Tests.
+
+static void test_journal() {
+    // A modified section is a single page program, in the journal.
+    setup();
+    uint32_t ops = fake_flash_ops;
+    uint32_t erases = fake_flash_erases(NVM_CONFIG_ADDR + NVM_PROFILE_SIZE);
+    edit(0, 0, 42);
+    CHECK(fake_flash_ops == ops + 1);
+    CHECK(fake_flash_erases(NVM_CONFIG_ADDR + NVM_PROFILE_SIZE) == erases);
+    CHECK(section_value(0, 0) == 42);
+    // Unchanged sections are not written.
+    edit(0, 0, 42);
+    CHECK(fake_flash_ops == ops + 1);
+    // Replayed over the profile after a reboot, without writing it.
+    reboot();
+    CHECK(check_sections());
+    CHECK(fake_flash_ops == ops + 1);
+}
+
+static void test_compaction() {
+    setup();
+    edits(0, EDITS);
+    CHECK(check_sections());
+    reboot();
+    CHECK(check_sections());
+    // Journaled sections older than a whole profile write are not replayed.
+    config_profile_default(0, 0);
+    memset(committed[0], 0, SECTIONS);
+    CHECK(check_sections());
+    edit(0, 0, 99);
+    CHECK(check_sections());
+    reboot();
+    CHECK(check_sections());
+}
+
+static void test_whole_profile() {
+    // Most of the profile changed, written at once.
+    setup();
+    for(uint8_t s=0; s<SECTIONS; s++) edit(1, s, 10 + s);
+    uint32_t erases = fake_flash_erases(NVM_CONFIG_ADDR + (NVM_PROFILE_SIZE * 3));
+    config_profile_overwrite(2, 1);
+    sync(NVM_PROFILE_QUIET_TIME * 2);
+    CHECK(fake_flash_erases(NVM_CONFIG_ADDR + (NVM_PROFILE_SIZE * 3)) == erases + 1);
+    for(uint8_t s=0; s<SECTIONS; s++) committed[2][s] = 10 + s;
+    CHECK(check_sections());
+    reboot();
+    CHECK(check_sections());
+}
+
+// Edits with the power cut at the given operation, then reboots. Returns
+// false if not covered, a profile sector write is not power cut safe.
+static bool power_cut(uint32_t op, uint16_t bytes, bool *ok) {
+    setup();
+    if (!setjmp(fake_flash_cut)) {
+        fake_flash_cut_at(op, bytes);
+        edits(0, EDITS);
+        fake_flash_cut_at(FAKE_FLASH_CUT_NONE, 0);
+    }
+    if (is_profile_addr(fake_flash_cut_addr)) return false;
+    reboot();
+    *ok = check_sections();
+    // Still usable afterwards.
+    edits(EDITS, NVM_JOURNAL_RECORDS);
+    *ok &= check_sections();
+    reboot();
+    *ok &= check_sections();
+    return true;
+}
+
+static void test_power_cut() {
+    setup();
+    uint32_t first = fake_flash_ops;
+    edits(0, EDITS);
+    uint32_t ops = fake_flash_ops - first;
+    uint16_t amounts[] = {0, NVM_JOURNAL_RECORD_SIZE / 2};
+    uint32_t covered = 0;
+    for(uint8_t a=0; a<sizeof(amounts)/sizeof(amounts[0]); a++) {
+        for(uint32_t op=first; op<first+ops; op++) {
+            fake_flash_cut_addr = 0;
+            bool ok = true;
+            if (!power_cut(op, amounts[a], &ok)) continue;
+            covered++;
+            if (!ok) {
+                printf("  FAIL: Power cut at operation %lu (%i bytes)\n", (unsigned long)op, amounts[a]);
+                test_failures++;
+            }
+        }
+    }
+    printf("  %lu of %lu operations\n", (unsigned long)covered / 2, (unsigned long)ops);
+}
+
+int main() {
+    RUN(test_journal);
+    RUN(test_compaction);
+    RUN(test_whole_profile);
+    RUN(test_power_cut);
+    return test_result();
+}
@@ -0,0 +1,294 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+// Replay of gyro traces through the incremental gyro mouse (gyro.c), which
+// applies the slow-movement curve and the subpixel accumulation per batch
+// element, compared with the previous path that applied them once per tick on
+// the average of the whole IMU burst.
+//
+// Both are checked against the curve applied on every IMU sample (in double
+// precision, without rounding), which is the most faithful output possible.
+// The traces are synthetic, generated at the IMU multi-sampling rate. A trace
+// captured from a controller with scripts/telemetry_capture.py (gyro channel,
+// divider 1) is also replayed if given: build/test_gyro CAPTURE_FILE.
+
+#include "fakes.h"
+#include "button.h"
+#include "gyro.h"
+#include "imu.h"
+#include "hid.h"
+#include "pin.h"
+#include "config.h"
+#include "telemetry.h"
+
+#define TICKS 1000
+#define CURVE_K 0.5
+#define CAPTURE_MAGIC "ALPKTLM1"
+#define CAPTURE_TICKS 100000  // Longest capture replayed.
+
+double gyro_curve(double t, double k, double x);
+
+typedef float (*Trace)(uint32_t sample);  // Rate in pixels per tick.
+
+static Trace replay_trace;
+static uint32_t replay_tick;
+static int32_t replay_mouse_x;
+
+static const char *capture_path = NULL;
+static float capture_rates[CAPTURE_TICKS];  // Pixels per tick.
+static uint32_t capture_len = 0;
+
+// Traces.
+
+static float trace_slow(uint32_t sample) {
+    return 0.3;
+}
+
+static float trace_fast(uint32_t sample) {
+    return 5;
+}
+
+// Short and fast movements, lasting an eighth of a tick every 25 ticks.
+static float trace_flicks(uint32_t sample) {
+    return (sample % (CFG_IMU_TICK_SAMPLES * 25)) < (CFG_IMU_TICK_SAMPLES / 8) ? 6 : 0;
+}
+
+// Back and forth movements, from slow to fast.
+static float trace_sweep(uint32_t sample) {
+    float t = (float)sample / CFG_IMU_TICK_SAMPLES;
+    return 3 * sinf(t * t * 0.0005);
+}
+
+// Slow drifting movement with fast shaking on top.
+static float trace_shake(uint32_t sample) {
+    uint32_t hash = (sample * 1103515245) + 12345;
+    hash ^= hash >> 13;
+    hash *= 2654435761;
+    float noise = ((float)((hash >> 16) & 0x7FFF) / 0x7FFF) - 0.5;
+    return 0.2 + (noise * 4);
+}
+
+// Captured trace, the frames only have the tick average, so the samples are
+// interpolated between the middle of each tick.
+static float trace_capture(uint32_t sample) {
+    float position = (((float)sample + 0.5) / CFG_IMU_TICK_SAMPLES) - 0.5;
+    if (position <= 0) return capture_rates[0];
+    uint32_t i = position;
+    if (i + 1 >= capture_len) return capture_rates[capture_len - 1];
+    float fraction = position - i;
+    return (capture_rates[i] * (1 - fraction)) + (capture_rates[i + 1] * fraction);
+}
+
+// Firmware side.
+
+static float raw_rate(float rate) {
+    return rate / (CFG_GYRO_SENSITIVITY_X * config_get_mouse_sens_value(0));
+}
+
+void imu_read_gyro_batches(Vector *batches) {
+    // Each batch element is the average of its samples, as the IMU bursts.
+    uint8_t samples = CFG_IMU_TICK_SAMPLES / CFG_IMU_TICK_BATCHES;
+    for(uint8_t i=0; i<CFG_IMU_TICK_BATCHES; i++) {
+        double sum = 0;
+        for(uint8_t j=0; j<samples; j++) {
+            sum += replay_trace((replay_tick * CFG_IMU_TICK_SAMPLES) + (i * samples) + j);
+        }
+        batches[i] = (Vector){raw_rate(sum / samples), 0, 0};
+    }
+}
+
+float imu_gyro_dt_factor() { return 1; }
+Vector imu_read_gyro() { return (Vector){0, 0, 0}; }
+Vector imu_read_accel() { return (Vector){0, 0, BIT_14}; }
+void imu_bias_idle() {}
+bool touch_status() { return false; }
+float touch_confidence() { return 0; }
+uint8_t config_get_mouse_sens_preset() { return 0; }
+double config_get_mouse_sens_value(uint8_t index) { return 1; }
+
+bool hid_is_axis(uint8_t key) { return false; }
+void hid_gamepad_axis(GamepadAxis axis, double value) {}
+
+void hid_mouse_move(int16_t x, int16_t y) {
+    replay_mouse_x += x;
+}
+
+// Load a telemetry capture (see scripts/telemetry_capture.py), the X rate of
+// gyro 0 in each frame (or of gyro 1 in the same range, if only that one was
+// captured). Dropped frames (gaps in the sequence) repeat the previous one.
+// Returns false if it is not a capture, or it has no gyro frames.
+static bool capture_load(FILE *file) {
+    capture_len = 0;
+    char magic[8];
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, CAPTURE_MAGIC, 8)) return false;
+    uint16_t seq_prev = 0;
+    uint8_t size;
+    uint8_t payload[CTRL_MAX_PAYLOAD_SIZE];
+    while(capture_len < CAPTURE_TICKS && fread(&size, 1, 1, file) == 1) {
+        if (size > sizeof(payload) || fread(payload, 1, size, file) != size) break;
+        if (size < TELEMETRY_HEADER_SIZE + 6) continue;
+        uint8_t channels = payload[6];
+        if (!(channels & (TELEMETRY_GYRO_0 | TELEMETRY_GYRO_1))) continue;
+        uint16_t seq;
+        int16_t gyro[3];
+        memcpy(&seq, &payload[0], 2);
+        memcpy(gyro, &payload[TELEMETRY_HEADER_SIZE], 6);
+        double raw = (channels & TELEMETRY_GYRO_0) ? gyro[0] : gyro[0] / 4.0;
+        float rate = raw * CFG_GYRO_SENSITIVITY_X * config_get_mouse_sens_value(0);
+        if (capture_len > 0) {
+            uint16_t dropped = seq - seq_prev - 1;
+            for(uint16_t i=0; i<dropped && capture_len<CAPTURE_TICKS-1; i++) {
+                capture_rates[capture_len] = capture_rates[capture_len - 1];
+                capture_len++;
+            }
+        }
+        capture_rates[capture_len++] = rate;
+        seq_prev = seq;
+    }
+    return capture_len > 0;
+}
+
+// Previous path, the curve and the subpixel accumulation once per tick.
+static double averaged_sub = 0;
+
+static int32_t averaged_report() {
+    double sum = 0;
+    for(uint8_t i=0; i<CFG_IMU_TICK_SAMPLES; i++) {
+        sum += replay_trace((replay_tick * CFG_IMU_TICK_SAMPLES) + i);
+    }
+    double x = raw_rate(sum / CFG_IMU_TICK_SAMPLES) * CFG_GYRO_SENSITIVITY_X;
+    x = gyro_curve(1.0, CURVE_K, x) + averaged_sub;
+    averaged_sub = modf(x, &x);
+    return x;
+}
+
+// Reference, the curve on every sample.
+static double ideal_report() {
+    double x = 0;
+    for(uint8_t i=0; i<CFG_IMU_TICK_SAMPLES; i++) {
+        double rate = replay_trace((replay_tick * CFG_IMU_TICK_SAMPLES) + i);
+        x += gyro_curve(1.0 / CFG_IMU_TICK_SAMPLES, CURVE_K, rate / CFG_IMU_TICK_SAMPLES);
+    }
+    return x;
+}
+
+typedef struct {
+    double total;
+    double error;  // Mean distance to the reference along the trace, in pixels.
+} ReplayResult;
+
+static void replay(
+    const char *name,
+    Trace trace,
+    uint32_t ticks,
+    ReplayResult *batched,
+    ReplayResult *averaged
+) {
+    fake_reset();
+    replay_trace = trace;
+    replay_mouse_x = 0;
+    averaged_sub = 0;
+    Gyro gyro = Gyro_(GYRO_MODE_ALWAYS_ON, PIN_NONE);
+    Actions neg = {MOUSE_X_NEG,};
+    Actions pos = {MOUSE_X,};
+    gyro.config_x(&gyro, 0, 0, neg, pos);
+    // Subpixel leftovers of a previous replay.
+    gyro.report_incremental(&gyro);
+    replay_mouse_x = 0;
+    double ideal = 0;
+    int32_t averaged_x = 0;
+    *batched = (ReplayResult){0, 0};
+    *averaged = (ReplayResult){0, 0};
+    for(replay_tick=0; replay_tick<ticks; replay_tick++) {
+        gyro.report(&gyro);
+        averaged_x += averaged_report();
+        ideal += ideal_report();
+        batched->error += fabs(replay_mouse_x - ideal);
+        averaged->error += fabs(averaged_x - ideal);
+    }
+    batched->total = replay_mouse_x;
+    batched->error /= ticks;
+    averaged->total = averaged_x;
+    averaged->error /= ticks;
+    printf(
+        "  %-7s ideal %7.1f px, batched %7.1f px (error %5.2f), averaged %7.1f px (error %5.2f)\n",
+        name, ideal, batched->total, batched->error, averaged->total, averaged->error
+    );
+}
+
+static void test_constant_motion() {
+    // Same result with both paths, only the rounding differs.
+    ReplayResult batched, averaged;
+    replay("slow", trace_slow, TICKS, &batched, &averaged);
+    CHECK(fabs(batched.total - averaged.total) <= 1);
+    CHECK(batched.error < 1);
+    replay("fast", trace_fast, TICKS, &batched, &averaged);
+    CHECK(fabs(batched.total - averaged.total) <= 1);
+    CHECK(batched.error < 1);
+}
+
+static void test_varying_motion() {
+    // Closer to the reference than the tick average.
+    ReplayResult batched, averaged;
+    replay("flicks", trace_flicks, TICKS, &batched, &averaged);
+    CHECK(batched.error < averaged.error);
+    CHECK(batched.error < 1);
+    replay("sweep", trace_sweep, TICKS, &batched, &averaged);
+    CHECK(batched.error <= averaged.error);
+    CHECK(batched.error < 1);
+    replay("shake", trace_shake, TICKS, &batched, &averaged);
+    CHECK(batched.error <= averaged.error);
+}
+
+static void test_capture() {
+    // The sweep trace written as telemetry_capture.py does, with a dropped
+    // frame, replays close to the original.
+    FILE *file = tmpfile();
+    fwrite(CAPTURE_MAGIC, 1, 8, file);
+    for(replay_tick=0; replay_tick<TICKS; replay_tick++) {
+        if (replay_tick == TICKS / 2) continue;
+        double sum = 0;
+        for(uint8_t i=0; i<CFG_IMU_TICK_SAMPLES; i++) {
+            sum += trace_sweep((replay_tick * CFG_IMU_TICK_SAMPLES) + i);
+        }
+        uint16_t seq = replay_tick;
+        int16_t gyro[3] = {round(raw_rate(sum / CFG_IMU_TICK_SAMPLES)), 0, 0};
+        uint8_t payload[TELEMETRY_HEADER_SIZE + 6] = {0,};
+        memcpy(&payload[0], &seq, 2);
+        payload[6] = TELEMETRY_GYRO_0;
+        memcpy(&payload[TELEMETRY_HEADER_SIZE], gyro, 6);
+        uint8_t size = sizeof(payload);
+        fwrite(&size, 1, 1, file);
+        fwrite(payload, 1, size, file);
+    }
+    rewind(file);
+    CHECK(capture_load(file));
+    fclose(file);
+    CHECK(capture_len == TICKS);
+    ReplayResult original, batched, averaged;
+    replay("sweep", trace_sweep, TICKS, &original, &averaged);
+    replay("capture", trace_capture, TICKS, &batched, &averaged);
+    CHECK(fabs(batched.total - original.total) <= 1);
+    CHECK(batched.error < 1);
+}
+
+static void test_capture_file() {
+    // Only reported, the samples within each tick are not in the capture.
+    FILE *file = fopen(capture_path, "rb");
+    CHECK(file && capture_load(file));
+    if (file) fclose(file);
+    if (!capture_len) return;
+    ReplayResult batched, averaged;
+    replay("file", trace_capture, capture_len, &batched, &averaged);
+}
+
+int main(int argc, char **argv) {
+    RUN(test_constant_motion);
+    RUN(test_varying_motion);
+    RUN(test_capture);
+    if (argc > 1) {
+        capture_path = argv[1];
+        RUN(test_capture_file);
+    }
+    return test_result();
+}
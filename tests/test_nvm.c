@@ -0,0 +1,200 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+// NVM journal (see nvm.c) on the simulated flash, including a power cut at
+// every flash operation of a sequence of writes (and of the recovery after
+// it), for several amounts of the interrupted operation applied.
+
+#include "fakes.h"
+#include "nvm.h"
+#include "common.h"
+
+#define KEYS 2
+#define PAYLOAD 100
+// Enough writes to rotate through all the journal sectors twice.
+#define WRITES (NVM_JOURNAL_SECTORS * NVM_JOURNAL_RECORDS * 2)
+
+static uint32_t committed[KEYS];  // Last value written of each key (0: none).
+static uint32_t pending_value;  // Value being written when the power was cut.
+static uint8_t pending_key;
+
+// Firmware side, no profile sections in these tests.
+
+void config_profile_compact() {}
+
+static void payload(uint32_t value, uint8_t *buffer) {
+    for(uint8_t i=0; i<PAYLOAD; i++) buffer[i] = value + (i * 31);
+}
+
+static void write_value(uint8_t key, uint32_t value) {
+    uint8_t buffer[PAYLOAD];
+    payload(value, buffer);
+    pending_key = key;
+    pending_value = value;
+    nvm_journal_write(key, buffer, PAYLOAD);
+    committed[key] = value;
+    pending_value = 0;
+}
+
+// The value of a key, zero if not found, or UINT32_MAX if corrupted.
+static uint32_t read_value(uint8_t key) {
+    uint8_t buffer[PAYLOAD];
+    if (!nvm_journal_read(key, buffer, PAYLOAD)) return 0;
+    uint32_t value = buffer[0];
+    // Values are small enough to be recovered from the first byte.
+    for(uint32_t candidate=value; candidate<=WRITES*2; candidate+=256) {
+        uint8_t expected[PAYLOAD];
+        payload(candidate, expected);
+        if (!memcmp(buffer, expected, PAYLOAD)) return candidate;
+    }
+    return UINT32_MAX;
+}
+
+// Each key must have its last written value, or the one being written.
+static bool check_keys() {
+    bool ok = true;
+    for(uint8_t key=0; key<KEYS; key++) {
+        uint32_t value = read_value(key);
+        if (value == committed[key]) continue;
+        if (pending_value && key == pending_key && value == pending_value) {
+            committed[key] = pending_value;
+            continue;
+        }
+        printf("  Key %i is %lu, expected %lu\n", key, (unsigned long)value, (unsigned long)committed[key]);
+        ok = false;
+    }
+    pending_value = 0;
+    return ok;
+}
+
+// Key 0 written often, key 1 only once in a while (so it has to be carried
+// along by the garbage collection).
+static void writes(uint32_t first, uint32_t n) {
+    for(uint32_t i=first; i<first+n; i++) write_value(i % 100 ? 0 : 1, i + 1);
+}
+
+static void setup() {
+    fake_reset();
+    fake_flash_reset();
+    memset(committed, 0, sizeof(committed));
+    pending_value = 0;
+}
+
+static void test_empty() {
+    setup();
+    nvm_journal_init();
+    CHECK(read_value(0) == 0);
+    CHECK(fake_flash_ops == 0);
+}
+
+static void test_round_trip() {
+    setup();
+    nvm_journal_init();
+    writes(0, WRITES);
+    CHECK(check_keys());
+    // After a reboot.
+    nvm_journal_init();
+    CHECK(check_keys());
+    writes(WRITES, KEYS);
+    CHECK(check_keys());
+}
+
+static void test_page_writes() {
+    // A write only programs a page, except for the garbage collection.
+    setup();
+    nvm_journal_init();
+    writes(0, NVM_JOURNAL_RECORDS - 1);
+    CHECK(fake_flash_ops == NVM_JOURNAL_RECORDS - 1);
+}
+
+static void test_wear_leveling() {
+    setup();
+    nvm_journal_init();
+    writes(0, WRITES * 4);
+    uint32_t min_erases = UINT32_MAX;
+    uint32_t max_erases = 0;
+    for(uint8_t s=0; s<NVM_JOURNAL_SECTORS; s++) {
+        uint32_t erases = fake_flash_erases(NVM_JOURNAL_ADDR + (s * NVM_JOURNAL_SECTOR_SIZE));
+        min_erases = min(min_erases, erases);
+        max_erases = max(max_erases, erases);
+    }
+    CHECK(min_erases > 0);
+    CHECK(max_erases - min_erases <= 1);
+}
+
+// Writes with the power cut at the given operation, then reboots (and
+// optionally cuts the power again during the recovery).
+static bool power_cut(uint32_t op, uint16_t bytes, uint32_t recovery_op) {
+    setup();
+    nvm_journal_init();
+    if (!setjmp(fake_flash_cut)) {
+        fake_flash_cut_at(op, bytes);
+        writes(0, WRITES);
+        fake_flash_cut_at(FAKE_FLASH_CUT_NONE, 0);
+    }
+    if (recovery_op != FAKE_FLASH_CUT_NONE) {
+        if (!setjmp(fake_flash_cut)) {
+            fake_flash_cut_at(fake_flash_ops + recovery_op, bytes);
+            nvm_journal_init();
+            fake_flash_cut_at(FAKE_FLASH_CUT_NONE, 0);
+        }
+    }
+    nvm_journal_init();
+    bool ok = check_keys();
+    // Still usable afterwards.
+    writes(WRITES, NVM_JOURNAL_RECORDS * 2);
+    ok &= check_keys();
+    nvm_journal_init();
+    ok &= check_keys();
+    return ok;
+}
+
+static uint32_t writes_ops() {
+    setup();
+    nvm_journal_init();
+    writes(0, WRITES);
+    return fake_flash_ops;
+}
+
+static void test_power_cut() {
+    uint32_t ops = writes_ops();
+    uint16_t amounts[] = {0, 1, 12, NVM_JOURNAL_RECORD_SIZE / 2, FLASH_SECTOR_SIZE / 2};
+    for(uint8_t a=0; a<sizeof(amounts)/sizeof(amounts[0]); a++) {
+        for(uint32_t op=0; op<ops; op++) {
+            if (!power_cut(op, amounts[a], FAKE_FLASH_CUT_NONE)) {
+                printf("  FAIL: Power cut at operation %lu (%i bytes)\n", (unsigned long)op, amounts[a]);
+                test_failures++;
+            }
+        }
+    }
+}
+
+static void test_power_cut_during_recovery() {
+    uint32_t ops = writes_ops();
+    uint16_t amounts[] = {0, NVM_JOURNAL_RECORD_SIZE / 2};
+    for(uint8_t a=0; a<sizeof(amounts)/sizeof(amounts[0]); a++) {
+        for(uint32_t op=0; op<ops; op++) {
+            for(uint32_t recovery_op=0; recovery_op<NVM_JOURNAL_KEYS + 1; recovery_op++) {
+                if (!power_cut(op, amounts[a], recovery_op)) {
+                    printf(
+                        "  FAIL: Power cut at operation %lu and %lu of the recovery (%i bytes)\n",
+                        (unsigned long)op,
+                        (unsigned long)recovery_op,
+                        amounts[a]
+                    );
+                    test_failures++;
+                }
+            }
+        }
+    }
+}
+
+int main() {
+    RUN(test_empty);
+    RUN(test_round_trip);
+    RUN(test_page_writes);
+    RUN(test_wear_leveling);
+    RUN(test_power_cut);
+    RUN(test_power_cut_during_recovery);
+    return test_result();
+}
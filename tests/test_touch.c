@@ -0,0 +1,182 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+// Replay of touch traces through the dynamic threshold (touch.c), written into
+// the measurements ring as the PIO engine and the DMA would do. The traces are
+// synthetic, one measurement per tick, in microseconds.
+
+#include "fakes.h"
+#include "touch.h"
+#include "config.h"
+#include "logging.h"
+#include "common.h"
+
+#define BASELINE 10  // Same as the initial baseline, TOUCH_AUTO_START_V1_GEN0.
+#define NOISE 0.3  // Untouched noise amplitude.
+#define SECONDS(s) ((s) * CFG_TICK_FREQUENCY)
+
+extern uint32_t touch_ring[TOUCH_RING_SIZE];
+extern uint32_t touch_timeout_loops;
+extern float touch_loop_us;
+
+typedef float (*Trace)(uint32_t tick);
+
+typedef struct {
+    uint32_t engages;
+    uint32_t engaged_ticks;
+    bool engaged;
+} ReplayResult;
+
+// Firmware side.
+
+static Config config;
+
+Config* config_read() { return &config; }
+uint8_t config_get_touch_sens_preset() { return 0; }
+uint8_t config_get_touch_sens_value(uint8_t index) { return (int8_t)-2; }
+void telemetry_touch(float elapsed, float threshold) {}
+bool logging_has_mask(LogMask mask) { return false; }
+
+// Traces.
+
+static float noise(uint32_t tick, float amplitude) {
+    uint32_t hash = (tick * 1103515245) + 12345;
+    hash ^= hash >> 13;
+    hash *= 2654435761;
+    return (((float)((hash >> 16) & 0x7FFF) / 0x7FFF) - 0.5) * amplitude;
+}
+
+static float trace_untouched(uint32_t tick) {
+    return BASELINE + noise(tick, NOISE);
+}
+
+// Finger resting on the surface, moving slowly.
+static float trace_hold(uint32_t tick) {
+    float movement = sinf((float)tick / SECONDS(3));
+    return BASELINE + 6 + movement + noise(tick, 2);
+}
+
+// Short touches and lifts.
+static float trace_taps(uint32_t tick) {
+    bool touched = (tick % SECONDS(1)) < SECONDS(0.3);
+    return touched ? trace_hold(tick) : trace_untouched(tick);
+}
+
+// Untouched signal rising above the threshold faster than the model follows it
+// (eg: the controller is plugged in, changing the return path), and staying
+// there.
+static float trace_drift_up(uint32_t tick) {
+    float drift = min((float)tick / SECONDS(0.5), 1) * 2.5;
+    return trace_untouched(tick) + drift;
+}
+
+// Untouched signal dropping below the baseline.
+static float trace_drift_down(uint32_t tick) {
+    return trace_untouched(tick) - 3;
+}
+
+static float trace_drift_down_hold(uint32_t tick) {
+    return trace_drift_down(tick) + 3 + noise(tick + 1, 1);
+}
+
+// Replay.
+
+static void write_ring(float elapsed) {
+    uint32_t entry = touch_timeout_loops - (uint32_t)(elapsed / touch_loop_us);
+    for(uint8_t i=0; i<TOUCH_RING_SIZE; i++) touch_ring[i] = entry;
+}
+
+// Replay a number of ticks of a trace, from the given one.
+static ReplayResult replay(Trace trace, uint32_t first, uint32_t ticks) {
+    ReplayResult result = {0, 0, false};
+    for(uint32_t tick=first; tick<first+ticks; tick++) {
+        write_ring(trace(tick));
+        bool engaged = touch_status();
+        if (engaged && !result.engaged) result.engages++;
+        if (engaged) result.engaged_ticks++;
+        result.engaged = engaged;
+        fake_advance(CFG_TICK_INTERVAL_IN_US);
+    }
+    return result;
+}
+
+// Tick at which the surface is released.
+static uint32_t replay_until_release(Trace trace, uint32_t first, uint32_t ticks) {
+    for(uint32_t tick=first; tick<first+ticks; tick++) {
+        write_ring(trace(tick));
+        if (!touch_status()) return tick;
+        fake_advance(CFG_TICK_INTERVAL_IN_US);
+    }
+    return first + ticks;
+}
+
+static void setup() {
+    fake_reset();
+    touch_load_from_config();
+    // Learn the untouched noise.
+    ReplayResult result = replay(trace_untouched, 0, SECONDS(10));
+    CHECK(!result.engaged);
+}
+
+// Tests.
+
+static void test_untouched() {
+    setup();
+    ReplayResult result = replay(trace_untouched, 0, SECONDS(120));
+    CHECK(result.engages == 0);
+    CHECK(touch_confidence() < 0.5);
+}
+
+static void test_long_hold() {
+    // Engaged for as long as the finger rests, no matter how long.
+    setup();
+    ReplayResult result = replay(trace_hold, 0, SECONDS(180));
+    CHECK(result.engages == 1);
+    CHECK(result.engaged);
+    CHECK(result.engaged_ticks > SECONDS(180) - SECONDS(0.1));
+    CHECK(touch_confidence() == 1);
+    result = replay(trace_untouched, 0, SECONDS(1));
+    CHECK(!result.engaged);
+}
+
+static void test_taps() {
+    setup();
+    ReplayResult result = replay(trace_taps, 0, SECONDS(20));
+    CHECK(result.engages == 20);
+    CHECK(!result.engaged);
+}
+
+static void test_drift_up() {
+    // Engaged by the drift, then re-baselined by the flat signal.
+    setup();
+    ReplayResult result = replay(trace_drift_up, 0, SECONDS(1));
+    CHECK(result.engaged);
+    uint32_t released = replay_until_release(trace_drift_up, SECONDS(1), SECONDS(60));
+    printf("  Re-baselined at %.1fs\n", (float)released / CFG_TICK_FREQUENCY);
+    CHECK(released < SECONDS(TOUCH_AUTO_DRIFT_WINDOW * 2));
+    // And stays released, while touches are still detected.
+    result = replay(trace_drift_up, released + 1, SECONDS(30));
+    CHECK(result.engages == 0);
+    result = replay(trace_hold, 0, SECONDS(1));
+    CHECK(result.engaged);
+}
+
+static void test_drift_down() {
+    // Followed immediately, so touches weaker than the previous baseline are
+    // still detected.
+    setup();
+    ReplayResult result = replay(trace_drift_down, 0, SECONDS(10));
+    CHECK(result.engages == 0);
+    result = replay(trace_drift_down_hold, SECONDS(10), SECONDS(1));
+    CHECK(result.engaged);
+}
+
+int main() {
+    touch_init();
+    RUN(test_untouched);
+    RUN(test_long_hold);
+    RUN(test_taps);
+    RUN(test_drift_up);
+    RUN(test_drift_down);
+    return test_result();
+}
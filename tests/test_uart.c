@@ -0,0 +1,268 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+// UART link (uart.c) in loopback: the frames sent are damaged as they could be
+// in transit (bit flips, truncation, spurious SOF bytes), and written into the
+// receive ring as the DMA would do. Also the link format negotiation and the
+// fallback to the legacy format.
+
+#include "fakes.h"
+#include "uart.h"
+#include "common.h"
+
+#define RX_DMA 0  // First channel claimed, see main().
+#define FRAMES 16
+#define FRAME_PAYLOAD 8
+#define FRAME_LEN (UART_FRAME_HEADER_LEN + FRAME_PAYLOAD + UART_FRAME_CRC_LEN)
+#define DAMAGED 3  // Frame damaged in transit.
+
+typedef struct {
+    uint8_t ids[FRAMES * 2];
+    uint8_t count;
+    uint32_t corrupted;
+    uint32_t lost;
+} Received;
+
+// Firmware side.
+
+void config_calibrate() {}
+void config_reset_factory() {}
+void config_reset_config() {}
+void config_reset_profiles() {}
+void self_test() {}
+void power_restart() {}
+void power_bootsel() {}
+
+// Link.
+
+// Bytes written into the ring by the DMA.
+static void rx_write(uint8_t *data, uint16_t len) {
+    dma_channel_hw_t *dma = &fake_dma_channels[RX_DMA];
+    uint8_t *ring = (uint8_t*)dma->write_addr;
+    for(uint16_t i=0; i<len; i++) {
+        uint32_t received = UINT32_MAX - dma->transfer_count;
+        ring[received & UART_RX_BUFFER_MASK] = data[i];
+        dma->transfer_count--;
+    }
+}
+
+// Bytes sent so far, as they would arrive to the other end.
+static uint16_t tx_take(uint8_t *dest) {
+    fake_dma_irq0();
+    uint16_t len = fake_uart_tx_len;
+    memcpy(dest, fake_uart_tx, len);
+    fake_uart_tx_len = 0;
+    return len;
+}
+
+// HID frames identified by the first payload byte. The rest of the payload
+// contains SOF bytes, to resync on them.
+static void tx_frames(uint8_t first, uint8_t n) {
+    for(uint8_t i=first; i<first+n; i++) {
+        uint8_t payload[FRAME_PAYLOAD] = {i, UART_SOF, FRAME_PAYLOAD, AT_HID, i, UART_SOF, 0, 0xFF};
+        CHECK(uart_tx_send(AT_HID, payload, FRAME_PAYLOAD));
+        fake_dma_irq0();
+    }
+}
+
+static Received rx_frames() {
+    UartLinkStats before = uart_get_stats();
+    Received received = {{0,}, 0};
+    uint8_t command = 0;
+    uint8_t len = 0;
+    uint8_t payload[AT_WEBUSB_LEN];
+    while(uart_rx_frame(&command, payload, &len)) {
+        if (command != AT_HID || received.count == sizeof(received.ids)) continue;
+        received.ids[received.count++] = payload[0];
+    }
+    UartLinkStats after = uart_get_stats();
+    received.corrupted = after.rx_corrupted - before.rx_corrupted;
+    received.lost = after.rx_lost - before.rx_lost;
+    return received;
+}
+
+// All the frames in order, except the given one (or none if out of range).
+static bool check_ids(Received *received, uint8_t missing) {
+    uint8_t expected = missing < FRAMES ? FRAMES - 1 : FRAMES;
+    if (received->count != expected) return false;
+    uint8_t id = 0;
+    for(uint8_t i=0; i<received->count; i++, id++) {
+        if (id == missing) id++;
+        if (received->ids[i] != id) return false;
+    }
+    return true;
+}
+
+static void setup() {
+    fake_reset();
+    uart_rx_buffer_init();
+    uart_tx_init();
+    // Answer from a peer that supports frames.
+    uint8_t hello[AT_LINK_LEN] = {UART_LINK_FRAMED, true};
+    uart_link_handle(hello);
+    CHECK(uart_link_get_version() == UART_LINK_FRAMED);
+    fake_uart_tx_len = 0;
+}
+
+// Tests.
+
+static void test_frames() {
+    setup();
+    uint8_t stream[FRAMES * FRAME_LEN];
+    tx_frames(0, FRAMES);
+    uint16_t len = tx_take(stream);
+    CHECK(len == FRAMES * FRAME_LEN);
+    // Byte by byte, waiting for the rest of the frames.
+    for(uint16_t i=0; i<len; i++) {
+        rx_write(&stream[i], 1);
+        Received received = rx_frames();
+        CHECK(received.count == ((i + 1) % FRAME_LEN == 0));
+        CHECK(received.corrupted == 0);
+    }
+    // All at once.
+    tx_frames(0, FRAMES);
+    rx_write(stream, tx_take(stream));
+    Received received = rx_frames();
+    CHECK(check_ids(&received, FRAMES));
+    CHECK(received.corrupted == 0);
+    CHECK(received.lost == 0);
+}
+
+static void test_bit_flip() {
+    // Every single bit of a frame, only that frame is lost. A damaged length
+    // may wait for more bytes than the frame had, so the following frames are
+    // only received once enough bytes arrived after it.
+    for(uint16_t bit=0; bit<FRAME_LEN*8; bit++) {
+        setup();
+        uint8_t stream[FRAMES * FRAME_LEN];
+        tx_frames(0, FRAMES);
+        uint16_t len = tx_take(stream);
+        stream[(DAMAGED * FRAME_LEN) + (bit / 8)] ^= 1 << (bit % 8);
+        rx_write(stream, len);
+        Received received = rx_frames();
+        if (!check_ids(&received, DAMAGED) || received.lost != 1 || received.corrupted == 0) {
+            printf("  FAIL: Bit %i flipped\n", bit);
+            test_failures++;
+        }
+    }
+}
+
+static void test_truncation() {
+    // Frame cut at every length, only that frame is lost.
+    for(uint8_t cut=1; cut<FRAME_LEN; cut++) {
+        setup();
+        uint8_t stream[FRAMES * FRAME_LEN];
+        tx_frames(0, FRAMES);
+        tx_take(stream);
+        uint8_t *damaged = &stream[DAMAGED * FRAME_LEN];
+        rx_write(stream, DAMAGED * FRAME_LEN);
+        rx_write(damaged, cut);
+        rx_write(damaged + FRAME_LEN, (FRAMES - DAMAGED - 1) * FRAME_LEN);
+        Received received = rx_frames();
+        if (!check_ids(&received, DAMAGED) || received.lost != 1 || received.corrupted == 0) {
+            printf("  FAIL: Frame cut at %i bytes\n", cut);
+            test_failures++;
+        }
+    }
+}
+
+static void test_spurious_sof() {
+    // Stray bytes between frames (eg: ESP log output), no frame is lost.
+    uint8_t strays[][4] = {
+        {UART_SOF},
+        {UART_SOF, FRAME_PAYLOAD},
+        {UART_SOF, FRAME_PAYLOAD, AT_HID},
+        {UART_SOF, 0xFF, UART_SOF},
+        {UART_CONTROL_0, UART_CONTROL_1},
+        {'l', 'o', 'g', '\n'},
+    };
+    uint8_t strays_len[] = {1, 2, 3, 3, 2, 4};
+    for(uint8_t s=0; s<sizeof(strays_len); s++) {
+        setup();
+        uint8_t stream[FRAMES * FRAME_LEN];
+        tx_frames(0, FRAMES);
+        tx_take(stream);
+        rx_write(stream, DAMAGED * FRAME_LEN);
+        rx_write(strays[s], strays_len[s]);
+        rx_write(&stream[DAMAGED * FRAME_LEN], (FRAMES - DAMAGED) * FRAME_LEN);
+        Received received = rx_frames();
+        if (!check_ids(&received, FRAMES) || received.lost != 0) {
+            printf("  FAIL: Stray bytes %i\n", s);
+            test_failures++;
+        }
+    }
+}
+
+static void test_lost() {
+    // A frame missing entirely is lost, not corrupted.
+    setup();
+    uint8_t stream[FRAMES * FRAME_LEN];
+    tx_frames(0, FRAMES);
+    tx_take(stream);
+    rx_write(stream, DAMAGED * FRAME_LEN);
+    rx_write(&stream[(DAMAGED + 1) * FRAME_LEN], (FRAMES - DAMAGED - 1) * FRAME_LEN);
+    Received received = rx_frames();
+    CHECK(check_ids(&received, DAMAGED));
+    CHECK(received.lost == 1);
+    CHECK(received.corrupted == 0);
+    // A peer restart (sequence starting over) is not counted as lost.
+    uart_tx_init();
+    uint8_t hello[AT_LINK_LEN] = {UART_LINK_FRAMED, true};
+    uart_link_handle(hello);
+    tx_frames(0, FRAMES);
+    rx_write(stream, tx_take(stream));
+    received = rx_frames();
+    CHECK(check_ids(&received, FRAMES));
+    CHECK(received.lost == 0);
+}
+
+static void test_legacy_fallback() {
+    fake_reset();
+    uart_rx_buffer_init();
+    uart_tx_init();
+    // Hellos not answered.
+    uint8_t stream[FAKE_UART_TX_SIZE];
+    for(uint8_t i=0; i<UART_LINK_HELLO_MAX + 1; i++) {
+        CHECK(uart_link_get_version() == UART_LINK_UNKNOWN);
+        uart_link_task();
+        fake_dma_irq0();
+        fake_advance(UART_LINK_HELLO_INTERVAL * 1000);
+    }
+    CHECK(uart_link_get_version() == UART_LINK_LEGACY);
+    uint16_t len = tx_take(stream);
+    CHECK(len == UART_LINK_HELLO_MAX * (UART_FRAME_HEADER_LEN + AT_LINK_LEN + UART_FRAME_CRC_LEN));
+    // Sent in the legacy format, which is also received.
+    uint8_t payload[FRAME_PAYLOAD] = {42, UART_SOF};
+    CHECK(uart_tx_send(AT_HID, payload, FRAME_PAYLOAD));
+    CHECK(!uart_tx_send(AT_ACK, payload, 1));
+    len = tx_take(stream);
+    CHECK(len == AT_HEADER_LEN + AT_HID_LEN);
+    uint8_t header[AT_HEADER_LEN] = {UART_CONTROL_BYTES, AT_HID};
+    CHECK(!memcmp(stream, header, AT_HEADER_LEN));
+    rx_write(stream, len);
+    uint8_t command = 0;
+    uint8_t size = 0;
+    uint8_t received[AT_WEBUSB_LEN];
+    CHECK(uart_rx_frame(&command, received, &size));
+    CHECK(command == AT_HID);
+    CHECK(size == AT_HID_LEN);
+    CHECK(!memcmp(received, payload, FRAME_PAYLOAD));
+    // Upgraded peer, switched to frames and answered.
+    uint8_t hello[AT_LINK_LEN] = {UART_LINK_FRAMED, false};
+    uart_link_handle(hello);
+    CHECK(uart_link_get_version() == UART_LINK_FRAMED);
+    len = tx_take(stream);
+    CHECK(len == UART_FRAME_HEADER_LEN + AT_LINK_LEN + UART_FRAME_CRC_LEN);
+    CHECK(stream[0] == UART_SOF && stream[2] == AT_LINK);
+}
+
+int main() {
+    uart_rx_buffer_init();
+    RUN(test_frames);
+    RUN(test_bit_flip);
+    RUN(test_truncation);
+    RUN(test_spurious_sof);
+    RUN(test_lost);
+    RUN(test_legacy_fallback);
+    return test_result();
+}
@@ -0,0 +1,266 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+// Accuracy of the single precision vector and quaternion math (vector.h) used
+// by the gyro and thumbstick code, against double precision references. Also
+// reports the host time per call of each function, only meaningful to compare
+// them between themselves (the firmware runs them on the RP2040 ROM floats).
+
+#include <time.h>
+#include "fakes.h"
+#include "vector.h"
+#include "common.h"
+
+#define SAMPLES 10000
+#define BENCH_CALLS 1000000
+
+// Double precision references.
+
+typedef struct {double x, y, z, r;} Ref4;
+
+static double ref_length(Vector v) {
+    return sqrt(((double)v.x*v.x) + ((double)v.y*v.y) + ((double)v.z*v.z));
+}
+
+static Ref4 ref_quaternion(Vector v, double rotation) {
+    double len = ref_length(v);
+    double s = sin(rotation / 2);
+    return (Ref4){v.x / len * s, v.y / len * s, v.z / len * s, cos(rotation / 2)};
+}
+
+static Ref4 ref_qmultiply(Ref4 q1, Ref4 q2) {
+    return (Ref4){
+        q1.r * q2.x + q1.x * q2.r + q1.y * q2.z - q1.z * q2.y,
+        q1.r * q2.y + q1.y * q2.r + q1.z * q2.x - q1.x * q2.z,
+        q1.r * q2.z + q1.z * q2.r + q1.x * q2.y - q1.y * q2.x,
+        q1.r * q2.r - q1.x * q2.x - q1.y * q2.y - q1.z * q2.z
+    };
+}
+
+// q * v * conjugate(q).
+static Ref4 ref_qrotate(Ref4 q, Vector v) {
+    Ref4 p = {v.x, v.y, v.z, 0};
+    Ref4 c = {-q.x, -q.y, -q.z, q.r};
+    return ref_qmultiply(ref_qmultiply(q, p), c);
+}
+
+// Inputs.
+
+static float random_float(float min, float max) {
+    return min + ((max - min) * rand() / RAND_MAX);
+}
+
+static Vector random_vector() {
+    return (Vector){random_float(-1, 1), random_float(-1, 1), random_float(-1, 1)};
+}
+
+static Vector random_unit_vector() {
+    Vector v;
+    do v = random_vector();
+    while (ref_length(v) < 0.1);
+    double len = ref_length(v);
+    return (Vector){v.x / len, v.y / len, v.z / len};
+}
+
+static double max_error(Vector v, double x, double y, double z) {
+    return fmax(fabs(v.x - x), fmax(fabs(v.y - y), fabs(v.z - z)));
+}
+
+static double max_error4(Vector4 q, Ref4 ref) {
+    return fmax(max_error((Vector){q.x, q.y, q.z}, ref.x, ref.y, ref.z), fabs(q.r - ref.r));
+}
+
+// Tests.
+
+static void test_rsqrt() {
+    double worst = 0;
+    for(float x=1e-6; x<1e6; x*=1.01) {
+        double ref = 1 / sqrt(x);
+        worst = fmax(worst, fabs(vector_rsqrt(x) - ref) / ref);
+    }
+    printf("  Relative error %.2e\n", worst);
+    CHECK(worst < 5e-6);
+}
+
+static void test_normalize() {
+    double worst = 0;
+    for(uint32_t i=0; i<SAMPLES; i++) {
+        Vector v = random_vector();
+        double len = ref_length(v);
+        if (len < 1e-3) continue;
+        Vector n = vector_normalize(v);
+        worst = fmax(worst, max_error(n, v.x / len, v.y / len, v.z / len));
+    }
+    // Within the normalization tolerance it is left as it is.
+    Vector almost = {1.00004, 0, 0};
+    CHECK(vector_normalize(almost).x == almost.x);
+    // Up to half the tolerance (on the squared length) for the ones left as they are.
+    printf("  Max error %.2e\n", worst);
+    CHECK(worst < 5e-5);
+}
+
+static void test_basic() {
+    for(uint32_t i=0; i<SAMPLES; i++) {
+        Vector a = random_vector();
+        Vector b = random_vector();
+        Vector sum = vector_add(a, b);
+        Vector diff = vector_sub(a, b);
+        Vector inv = vector_invert(a);
+        Vector cross = vector_cross_product(a, b);
+        Vector smooth = vector_smooth(a, b, 9);
+        CHECK(max_error(sum, (double)a.x+b.x, (double)a.y+b.y, (double)a.z+b.z) < 1e-6);
+        CHECK(max_error(diff, (double)a.x-b.x, (double)a.y-b.y, (double)a.z-b.z) < 1e-6);
+        CHECK(max_error(inv, -a.x, -a.y, -a.z) == 0);
+        CHECK(max_error(
+            cross,
+            ((double)a.y * b.z) - ((double)a.z * b.y),
+            ((double)a.z * b.x) - ((double)a.x * b.z),
+            ((double)a.x * b.y) - ((double)a.y * b.x)
+        ) < 1e-6);
+        CHECK(max_error(
+            smooth,
+            ((double)a.x * 9 + b.x) / 10,
+            ((double)a.y * 9 + b.y) / 10,
+            ((double)a.z * 9 + b.z) / 10
+        ) < 1e-6);
+        CHECK(fabs(vector_lenght(a) - ref_length(a)) < 1e-6);
+    }
+}
+
+static void test_quaternion() {
+    double worst = 0;
+    for(uint32_t i=0; i<SAMPLES; i++) {
+        Vector axis = random_vector();
+        if (ref_length(axis) < 1e-3) continue;
+        float rotation = random_float(-M_PI, M_PI);
+        Vector4 q = quaternion(axis, rotation);
+        worst = fmax(worst, max_error4(q, ref_quaternion(axis, rotation)));
+    }
+    printf("  Max error %.2e\n", worst);
+    CHECK(worst < 1e-5);
+}
+
+static void test_qmultiply() {
+    double worst = 0;
+    for(uint32_t i=0; i<SAMPLES; i++) {
+        Vector a = random_unit_vector();
+        Vector b = random_unit_vector();
+        float ra = random_float(-M_PI, M_PI);
+        float rb = random_float(-M_PI, M_PI);
+        Vector4 q = qmultiply(quaternion(a, ra), quaternion(b, rb));
+        Ref4 ref = ref_qmultiply(ref_quaternion(a, ra), ref_quaternion(b, rb));
+        worst = fmax(worst, max_error4(q, ref));
+    }
+    printf("  Max error %.2e\n", worst);
+    CHECK(worst < 1e-5);
+}
+
+static void test_qrotate() {
+    double worst = 0;
+    double worst_fast = 0;
+    for(uint32_t i=0; i<SAMPLES; i++) {
+        Vector axis = random_unit_vector();
+        Vector v = random_unit_vector();
+        float rotation = random_float(-M_PI, M_PI);
+        Ref4 ref = ref_qrotate(ref_quaternion(axis, rotation), v);
+        Vector4 q = quaternion(axis, rotation);
+        worst = fmax(worst, max_error(qrotate(q, v), ref.x, ref.y, ref.z));
+        worst_fast = fmax(worst_fast, max_error(qrotate_fast(q, v), ref.x, ref.y, ref.z));
+    }
+    printf("  Max error %.2e (fast %.2e)\n", worst, worst_fast);
+    CHECK(worst < 1e-5);
+    CHECK(worst_fast < 1e-5);
+}
+
+static void test_qrotate_drift() {
+    // Same as the gyro integration, many small rotations of the world axes.
+    Vector top = {0, 0, 1};
+    Vector fw = {0, 1, 0};
+    for(uint32_t i=0; i<SAMPLES * 10; i++) {
+        Vector right = vector_cross_product(fw, top);
+        Vector4 rx = quaternion(right, random_float(-0.01, 0.01));
+        Vector4 ry = quaternion(fw, random_float(-0.01, 0.01));
+        Vector4 rz = quaternion(top, random_float(-0.01, 0.01));
+        Vector4 r = qmultiply(qmultiply(rx, ry), rz);
+        top = qrotate_fast(r, top);
+        fw = qrotate_fast(r, fw);
+    }
+    double dot = ((double)top.x*fw.x) + ((double)top.y*fw.y) + ((double)top.z*fw.z);
+    printf("  Length error %.2e, orthogonality error %.2e\n", fabs(ref_length(top) - 1), fabs(dot));
+    CHECK(fabs(ref_length(top) - 1) < 1e-4);
+    CHECK(fabs(ref_length(fw) - 1) < 1e-4);
+    CHECK(fabs(dot) < 1e-3);
+}
+
+static void test_angles() {
+    // Gyro absolute axes, and thumbstick polar coordinates round trip.
+    double worst = 0;
+    for(uint32_t i=0; i<SAMPLES; i++) {
+        float x = random_float(-1, 1);
+        float y = random_float(-1, 1);
+        double radius = sqrt((double)x*x + (double)y*y);
+        if (radius < 1e-3) continue;
+        float angle = degrees(atan2f(x, -y));
+        CHECK(fabs(angle - (atan2(x, -y) * 180 / M_PI)) < 1e-4);
+        float angle_sin, angle_cos;
+        sincosf(radians(angle), &angle_sin, &angle_cos);
+        worst = fmax(worst, fmax(fabs(angle_sin - x / radius), fabs(-angle_cos - y / radius)));
+        float z = random_float(-1, 1);
+        CHECK(fabs(degrees(asinf(z)) - (asin(z) * 180 / M_PI)) < 1e-4);
+    }
+    printf("  Max error %.2e\n", worst);
+    CHECK(worst < 1e-5);
+}
+
+// Benchmark.
+
+static volatile float bench_sink;
+
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+#define BENCH(name, expr)  do { \
+    double start = bench_now(); \
+    for(uint32_t i=0; i<BENCH_CALLS; i++) { \
+        float f = (float)i / BENCH_CALLS; \
+        bench_sink = (expr); \
+    } \
+    printf("  %-16s %6.1f ns\n", name, (bench_now() - start) * 1e9 / BENCH_CALLS); \
+} while(0)
+
+static void bench() {
+    Vector v = {0.3, -0.5, 0.8};
+    Vector4 q = quaternion((Vector){0.1, 0.7, -0.2}, 0.3);
+    float s, c;
+    printf("bench\n");
+    BENCH("vector_rsqrt", vector_rsqrt(f + 1));
+    BENCH("1/sqrtf", 1 / sqrtf(f + 1));
+    BENCH("vector_normalize", vector_normalize((Vector){v.x, f, v.z}).y);
+    BENCH("vector_smooth", vector_smooth(v, (Vector){f, f, f}, 9).x);
+    BENCH("vector_cross", vector_cross_product(v, (Vector){f, f, f}).x);
+    BENCH("quaternion", quaternion(v, f).r);
+    BENCH("qmultiply", qmultiply(q, (Vector4){f, f, f, f}).r);
+    BENCH("qrotate", qrotate(q, (Vector){f, v.y, v.z}).x);
+    BENCH("qrotate_fast", qrotate_fast(q, (Vector){f, v.y, v.z}).x);
+    BENCH("sincosf", (sincosf(f, &s, &c), s + c));
+    BENCH("sinf+cosf", sinf(f) + cosf(f));
+    BENCH("atan2f", atan2f(f, v.y));
+    BENCH("asinf", asinf(f));
+}
+
+int main() {
+    srand(1);
+    RUN(test_rsqrt);
+    RUN(test_normalize);
+    RUN(test_basic);
+    RUN(test_quaternion);
+    RUN(test_qmultiply);
+    RUN(test_qrotate);
+    RUN(test_qrotate_drift);
+    RUN(test_angles);
+    bench();
+    return test_result();
+}
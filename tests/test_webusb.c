@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright (C) 2022, Input Labs Oy.
+
+// Backpressure of the WebUSB layer (see loopback.c), responses must never be
+// dropped when the app sends faster than it reads. And the share of the
+// outbound messages of a continuous telemetry stream.
+
+#include "fakes.h"
+#include "loopback.h"
+#include "ctrl.h"
+#include "webusb.h"
+#include "config.h"
+
+#define REQUESTS 48
+
+static Ctrl message(Ctrl_msg_type type, uint8_t len) {
+    Ctrl ctrl = {
+        .protocol_flags = CTRL_FLAG_NONE,
+        .device_id = ALPAKKA,
+        .message_type = type,
+        .len = len
+    };
+    return ctrl;
+}
+
+static void section_get(uint8_t profile, uint8_t section) {
+    Ctrl ctrl = message(SECTION_GET, 2);
+    ctrl.payload[0] = profile;
+    ctrl.payload[1] = section;
+    loopback_send((uint8_t*)&ctrl);
+}
+
+static void section_set(uint8_t profile, uint8_t section) {
+    Ctrl ctrl = message(SECTION_SET, 60);
+    ctrl.payload[0] = profile;
+    ctrl.payload[1] = section;
+    memset(&ctrl.payload[2], 0xAA, sizeof(CtrlSection));
+    loopback_send((uint8_t*)&ctrl);
+}
+
+static uint16_t receive_all(Ctrl_msg_type type) {
+    uint16_t count = 0;
+    Ctrl ctrl;
+    while(loopback_receive((uint8_t*)&ctrl)) {
+        if (ctrl.message_type == type) count++;
+    }
+    return count;
+}
+
+static void test_responses_not_dropped() {
+    loopback_reset();
+    uint32_t overflows = webusb_get_tx_overflows();
+    // The app sends more requests than the outbound queue holds, while it is
+    // not reading the responses.
+    loopback_in_stall(true);
+    for(uint8_t i=0; i<REQUESTS; i++) section_get(i % 2, i / 2);
+    for(uint8_t i=0; i<100; i++) loopback_tick();
+    CHECK(webusb_get_tx_overflows() == overflows);
+    // Then it reads.
+    loopback_in_stall(false);
+    uint16_t received = 0;
+    for(uint8_t i=0; i<100; i++) {
+        loopback_tick();
+        received += receive_all(SECTION_SHARE);
+    }
+    CHECK(received == REQUESTS);
+    CHECK(webusb_get_tx_overflows() == overflows);
+}
+
+static void test_status_reports_overflows() {
+    loopback_reset();
+    Ctrl get = message(STATUS_GET, 0);
+    loopback_send((uint8_t*)&get);
+    uint32_t dropped = UINT32_MAX;
+    for(uint8_t i=0; i<10; i++) {
+        loopback_tick();
+        Ctrl ctrl;
+        while(loopback_receive((uint8_t*)&ctrl)) {
+            if (ctrl.message_type == STATUS_SHARE) memcpy(&dropped, &ctrl.payload[7], 4);
+        }
+    }
+    CHECK(dropped == webusb_get_tx_overflows());
+}
+
+static void test_section_out_of_range() {
+    loopback_reset();
+    section_set(0, CTRL_PROFILE_SECTIONS);
+    section_set(0, 255);
+    section_set(NVM_PROFILE_SLOTS, 1);
+    section_get(0, CTRL_PROFILE_SECTIONS);
+    section_get(NVM_PROFILE_SLOTS, 1);
+    for(uint8_t i=0; i<10; i++) loopback_tick();
+    CHECK(receive_all(SECTION_SHARE) == 0);
+    // Valid ones still go through.
+    section_set(0, CTRL_PROFILE_SECTIONS - 1);
+    for(uint8_t i=0; i<10; i++) loopback_tick();
+    CHECK(receive_all(SECTION_SHARE) == 1);
+}
+
+static void test_telemetry_share() {
+    // A continuous telemetry stream does not starve the logs, also through
+    // the dongle (a single message per tick).
+    char line[] = "Log line of forty characters, more or.\n";
+    for(uint8_t wireless=0; wireless<2; wireless++) {
+        loopback_reset();
+        loopback_wireless(wireless);
+        loopback_telemetry(true);
+        for(uint8_t i=0; i<10; i++) webusb_write(line);
+        uint16_t log_bytes = 0;
+        uint16_t frames = 0;
+        for(uint8_t i=0; i<40; i++) {
+            loopback_tick();
+            Ctrl ctrl;
+            while(loopback_receive((uint8_t*)&ctrl)) {
+                if (ctrl.message_type == LOG) log_bytes += ctrl.len;
+                if (ctrl.message_type == TELEMETRY_FRAME) frames++;
+            }
+        }
+        CHECK(log_bytes == 10 * strlen(line));
+        CHECK(frames >= 40 / 2);
+    }
+}
+
+int main() {
+    RUN(test_responses_not_dropped);
+    RUN(test_status_reports_overflows);
+    RUN(test_section_out_of_range);
+    RUN(test_telemetry_share);
+    return test_result();
+}